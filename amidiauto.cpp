@@ -19,22 +19,182 @@
 
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <assert.h>
+#ifndef AMIDIAUTO_GENERATOR
 #include <alsa/asoundlib.h>
+#endif
 #include <errno.h>
 #include <poll.h>
-
+#include <getopt.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <malloc.h>
+#include <regex.h>
+
+#ifdef AMIDIAUTO_JOURNAL
+#include <systemd/sd-journal.h>
+#endif
+
+#include <new>
 #include <string>
 #include <map>
 #include <set>
+#include <vector>
+#include <algorithm>
+#include <iterator>
 
 #define HOMEPAGE_URL "https://blokas.io/"
 #define AMIDIAUTO_VERSION 0x0101
 
+// Building with AMIDIAUTO_GENERATOR leaves out everything but the rules, for generating
+// the header of RULES= on the build host, which needs no ALSA then, see generatorMain().
+#ifndef AMIDIAUTO_GENERATOR
 static snd_seq_t *g_seq = NULL;
 static int g_port = -1;
 
+// The sequencer calls the connection logic depends on, so it can be run
+// against a simulated sequencer as well. Setup and polling stay with g_seq.
+class SeqBackend
+{
+public:
+	virtual ~SeqBackend() {}
+
+	virtual int getClientInfo(int clientId, snd_seq_client_info_t *info) = 0;
+	virtual int getPortInfo(int clientId, int port, snd_seq_port_info_t *info) = 0;
+
+	// Advance info to the next client or port of its client, like snd_seq_query_next_client and snd_seq_query_next_port.
+	virtual int queryNextClient(snd_seq_client_info_t *info) = 0;
+	virtual int queryNextPort(snd_seq_port_info_t *info) = 0;
+
+	// Stores the index-th port subscribed to output in input, returns a negative error once there are no more.
+	virtual int querySubscriber(snd_seq_addr_t output, int index, snd_seq_addr_t *input) = 0;
+
+	virtual int subscribe(snd_seq_addr_t output, snd_seq_addr_t input) = 0;
+	virtual int unsubscribe(snd_seq_addr_t output, snd_seq_addr_t input) = 0;
+
+	virtual int eventInput(snd_seq_event_t **ev) = 0;
+	virtual int eventInputPending() = 0;
+	virtual void dropInput() = 0;
+};
+
+class AlsaSeqBackend : public SeqBackend
+{
+public:
+	virtual int getClientInfo(int clientId, snd_seq_client_info_t *info);
+	virtual int getPortInfo(int clientId, int port, snd_seq_port_info_t *info);
+
+	virtual int queryNextClient(snd_seq_client_info_t *info);
+	virtual int queryNextPort(snd_seq_port_info_t *info);
+
+	virtual int querySubscriber(snd_seq_addr_t output, int index, snd_seq_addr_t *input);
+
+	virtual int subscribe(snd_seq_addr_t output, snd_seq_addr_t input);
+	virtual int unsubscribe(snd_seq_addr_t output, snd_seq_addr_t input);
+
+	virtual int eventInput(snd_seq_event_t **ev);
+	virtual int eventInputPending();
+	virtual void dropInput();
+};
+
+int AlsaSeqBackend::getClientInfo(int clientId, snd_seq_client_info_t *info)
+{
+	return snd_seq_get_any_client_info(g_seq, clientId, info);
+}
+
+int AlsaSeqBackend::getPortInfo(int clientId, int port, snd_seq_port_info_t *info)
+{
+	return snd_seq_get_any_port_info(g_seq, clientId, port, info);
+}
+
+int AlsaSeqBackend::queryNextClient(snd_seq_client_info_t *info)
+{
+	return snd_seq_query_next_client(g_seq, info);
+}
+
+int AlsaSeqBackend::queryNextPort(snd_seq_port_info_t *info)
+{
+	return snd_seq_query_next_port(g_seq, info);
+}
+
+int AlsaSeqBackend::querySubscriber(snd_seq_addr_t output, int index, snd_seq_addr_t *input)
+{
+	snd_seq_query_subscribe_t *query;
+	snd_seq_query_subscribe_alloca(&query);
+	snd_seq_query_subscribe_set_root(query, &output);
+	snd_seq_query_subscribe_set_type(query, SND_SEQ_QUERY_SUBS_READ);
+	snd_seq_query_subscribe_set_index(query, index);
+
+	int result = snd_seq_query_port_subscribers(g_seq, query);
+	if (result < 0)
+		return result;
+
+	*input = *snd_seq_query_subscribe_get_addr(query);
+	return 0;
+}
+
+int AlsaSeqBackend::subscribe(snd_seq_addr_t output, snd_seq_addr_t input)
+{
+	snd_seq_port_subscribe_t *subs;
+	snd_seq_port_subscribe_alloca(&subs);
+	snd_seq_port_subscribe_set_sender(subs, &output);
+	snd_seq_port_subscribe_set_dest(subs, &input);
+	return snd_seq_subscribe_port(g_seq, subs);
+}
+
+int AlsaSeqBackend::unsubscribe(snd_seq_addr_t output, snd_seq_addr_t input)
+{
+	snd_seq_port_subscribe_t *subs;
+	snd_seq_port_subscribe_alloca(&subs);
+	snd_seq_port_subscribe_set_sender(subs, &output);
+	snd_seq_port_subscribe_set_dest(subs, &input);
+	return snd_seq_unsubscribe_port(g_seq, subs);
+}
+
+int AlsaSeqBackend::eventInput(snd_seq_event_t **ev)
+{
+	return snd_seq_event_input(g_seq, ev);
+}
+
+int AlsaSeqBackend::eventInputPending()
+{
+	return snd_seq_event_input_pending(g_seq, 0);
+}
+
+void AlsaSeqBackend::dropInput()
+{
+	snd_seq_drop_input(g_seq);
+}
+
+static AlsaSeqBackend g_alsaBackend;
+static SeqBackend *g_backend = &g_alsaBackend;
+
+// ALSA client ids fit in snd_seq_addr_t::client.
+enum { MAX_CLIENTS = 256 };
+
+// Client and port names are at most 63 characters in the sequencer, plus the terminator.
+enum { MAX_NAME = 64 };
+
+static void copyName(char *dst, const char *src)
+{
+	strncpy(dst, src ? src : "", MAX_NAME - 1);
+	dst[MAX_NAME - 1] = '\0';
+}
+#endif // AMIDIAUTO_GENERATOR
+
 enum PortDir
 {
 	DIR_UNKNOWN = 0,
@@ -49,6 +209,7 @@ enum PortType
 	TYPE_HARDWARE = 1,
 };
 
+#ifndef AMIDIAUTO_GENERATOR
 inline static bool operator <(const snd_seq_addr_t &a, const snd_seq_addr_t &b)
 {
 	return std::make_pair(a.client, a.port) < std::make_pair(b.client, b.port);
@@ -58,658 +219,6905 @@ inline static bool operator ==(const snd_seq_addr_t &a, const snd_seq_addr_t &b)
 {
 	return a.client == b.client && a.port == b.port;
 }
+#endif // AMIDIAUTO_GENERATOR
 
-static std::string getClientName(snd_seq_addr_t addr)
+static uint64_t getTimeNs()
 {
-	snd_seq_client_info_t *clientInfo;
-	snd_seq_client_info_alloca(&clientInfo);
-	if (snd_seq_get_any_client_info(g_seq, addr.client, clientInfo) < 0)
-		return "";
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
 
-	const char *name = snd_seq_client_info_get_name(clientInfo);
+static uint64_t getTimeUs()
+{
+	return getTimeNs() / 1000u;
+}
 
-	return name ? name : "";
+#ifndef AMIDIAUTO_GENERATOR
+// Times the rule and loop checks in builds with PROFILE=1 only. They are made for every
+// pair of ports, and reading the clock twice each time would cost more than most checks.
+#ifdef AMIDIAUTO_PROFILE
+static uint64_t profileStart()
+{
+	return getTimeNs();
 }
 
-class ConnectionRules
+static void profileEnd(uint64_t &totalNs, uint64_t start)
 {
-public:
-	enum Type
-	{
-		TYPE_UNKNOWN  = -1,
-		TYPE_ALLOW    = 0,
-		TYPE_DISALLOW = 1,
-	};
+	totalNs += getTimeNs() - start;
+}
+#else
+static uint64_t profileStart()
+{
+	return 0;
+}
 
-	enum Strength
-	{
-		STRENGTH_NONE       = 0, // Rule does not apply.
-		STRENGTH_VERY_VAGUE = 1, // Wildcard matched wildcard.
-		STRENGTH_VAGUE      = 2, // One of the sides is a specific name, the other is a wildcard.
-		STRENGTH_SPECIFIC   = 3, // Both sides is a specific name.
-	};
+static void profileEnd(uint64_t &, uint64_t)
+{
+}
+#endif
+#endif // AMIDIAUTO_GENERATOR
 
-	void addRule(Type type, const char *output, const char *input);
+// Counts values in power of two buckets, bucket n holds values below 2^n.
+class Histogram
+{
+public:
+	enum { BUCKET_COUNT = 32 };
 
-	bool hasRules() const;
+	Histogram();
 
-	bool isConnectionAllowed(snd_seq_addr_t output, snd_seq_addr_t input, Strength minimumStrength) const;
+	void add(uint64_t value);
 
-private:
-	typedef std::pair<std::string, std::string> rule_t;
-	typedef std::multimap<std::string, std::string> rules_t;
+	void print(const char *name, const char *unit) const;
 
-	Strength evaluate(const rules_t &rules, snd_seq_addr_t output, snd_seq_addr_t input) const;
-	static Strength evaluate(const rule_t &rule, const std::string &outputName, const std::string &inputName);
+	uint64_t getCount() const;
+	uint64_t getSum() const;
+	uint64_t getMax() const;
 
-	rules_t m_allowRules;
-	rules_t m_disallowRules;
+private:
+	uint64_t m_buckets[BUCKET_COUNT];
+	uint64_t m_count;
+	uint64_t m_sum;
+	uint64_t m_max;
 };
 
-void ConnectionRules::addRule(Type type, const char * output, const char * input)
+Histogram::Histogram()
+	:m_count(0)
+	,m_sum(0)
+	,m_max(0)
 {
-	if (!output || !input || type == TYPE_UNKNOWN)
-		return;
+	memset(m_buckets, 0, sizeof(m_buckets));
+}
 
-	if (strchr(output, '*') != NULL && strlen(output) > 1)
-		return;
+void Histogram::add(uint64_t value)
+{
+	unsigned bucket = 0;
+	while (bucket < BUCKET_COUNT-1 && (value >> bucket) != 0)
+		++bucket;
+
+	++m_buckets[bucket];
+	++m_count;
+	m_sum += value;
+	if (value > m_max)
+		m_max = value;
+}
 
-	if (strchr(input, '*') != NULL && strlen(input) > 1)
+void Histogram::print(const char *name, const char *unit) const
+{
+	if (m_count == 0)
+	{
+		printf("%s: none\n", name);
 		return;
+	}
 
-	rules_t &rules = type == TYPE_ALLOW ? m_allowRules : m_disallowRules;
-
-	fprintf(stderr, "%s '%s' -> '%s'\n", type == TYPE_ALLOW ? "Allowing" : "Disallowing", output, input);
+	printf("%s: count %llu, avg %llu %s, max %llu %s\n", name, (unsigned long long)m_count, (unsigned long long)(m_sum / m_count), unit, (unsigned long long)m_max, unit);
 
-	rules.insert(std::make_pair(output, input));
+	for (unsigned i=0; i<BUCKET_COUNT; ++i)
+	{
+		if (m_buckets[i] != 0)
+			printf("  < %llu %s: %llu\n", 1ull << i, unit, (unsigned long long)m_buckets[i]);
+	}
 }
 
-bool ConnectionRules::hasRules() const
+uint64_t Histogram::getCount() const
 {
-	return !m_allowRules.empty() || !m_disallowRules.empty();
+	return m_count;
 }
 
-bool ConnectionRules::isConnectionAllowed(snd_seq_addr_t output, snd_seq_addr_t input, Strength minimumStrength) const
+uint64_t Histogram::getSum() const
 {
-	Strength allowStrength = evaluate(m_allowRules, output, input);
-	Strength disallowStrength = evaluate(m_disallowRules, output, input);
-
-	return allowStrength >= minimumStrength && allowStrength >= disallowStrength;
+	return m_sum;
 }
 
-ConnectionRules::Strength ConnectionRules::evaluate(const rules_t &rules, snd_seq_addr_t output, snd_seq_addr_t input) const
+uint64_t Histogram::getMax() const
 {
-	std::string outputName = getClientName(output);
-	std::string inputName = getClientName(input);
-
-	Strength strength = STRENGTH_NONE;
-
-	for (rules_t::const_iterator itr = rules.begin(); itr != rules.end(); ++itr)
-	{
-		Strength s = evaluate(*itr, outputName, inputName);
-		if (strength < s)
-			strength = s;
-	}
-
-	return strength;
+	return m_max;
 }
 
-ConnectionRules::Strength ConnectionRules::evaluate(const rule_t & rule, const std::string &outputName, const std::string &inputName)
+struct Stats
 {
-	if (rule.first == "*")
-	{
-		if (rule.second == "*")
-		{
-			return STRENGTH_VERY_VAGUE;
-		}
-		else if (inputName.find(rule.second) != std::string::npos)
-		{
-			return STRENGTH_VAGUE;
-		}
-	}
-	else if (outputName.find(rule.first) != std::string::npos)
-	{
-		if (rule.second == "*")
-		{
-			return STRENGTH_VAGUE;
-		}
-		else if (inputName.find(rule.second) != std::string::npos)
-		{
-			return STRENGTH_SPECIFIC;
-		}
-	}
+	Stats();
 
-	return STRENGTH_NONE;
-}
+	// From receiving a PORT_START announcement until a subscription of the port is made.
+	Histogram hotplugLatencyUs;
 
-static ConnectionRules g_rules;
+	// The same for the links of a priority above 0 only, and the time from starting
+	// until the first of them was made, see graphDrain().
+	Histogram priorityLatencyUs;
+	uint64_t firstPriorityLinkUs;
+	uint64_t priorityLinks;
 
-// Keeps track of one input and one output port.
-// This is to try and keep things simple and app performance under control.
-// For example, some software may create many input ports, all for the same function,
-// if a MIDI note gets sent to all of them, that will cause many duplicate notes
-// to be played.
-class Client
-{
-public:
-	Client();
-	Client(int clientId);
+	// Sequencer calls issued while applying the announcements collected in a flush.
+	Histogram syscallsPerFlush;
 
-	void setInput(snd_seq_addr_t addr);
-	void setOutput(snd_seq_addr_t addr);
+	uint64_t announcements;
+	uint64_t syscalls;
+	uint64_t subscribes;
+	uint64_t unsubscribes;
 
-	bool isInputSet() const;
-	bool isOutputSet() const;
+	uint64_t ruleChecks;
+	uint64_t ruleCheckNs;
 
-	void clearInput();
-	void clearOutput();
+	unsigned inputOverflows;
+	unsigned resyncs;
 
-	const snd_seq_addr_t *getInput() const;
-	const snd_seq_addr_t *getOutput() const;
+	// Candidate ports promoted in place of exited ones, see portFailover().
+	unsigned failovers;
 
-	bool operator <(const Client &rhs) const;
+	// Subscriptions tried again after failing, and the links given up on, see retryService().
+	uint64_t retries;
+	unsigned retriesFailed;
 
-private:
-	int m_clientId;
+	// Cycle checks made before connecting, and the links they refused, see graphWouldLoop().
+	uint64_t loopChecks;
+	uint64_t loopCheckNs;
+	unsigned loopsRefused;
+
+	// Events counted by the monitor, and outputs it disconnected for going over their limit.
+	uint64_t monitoredEvents;
+	unsigned rateLimited;
 
-	bool m_inputInitialized;
-	bool m_outputInitialized;
+	// Heap allocations made through operator new, and the part of them made while handling
+	// announcements. Counted only by the bench, which replaces operator new, see bench.cpp.
+	uint64_t allocations;
+	uint64_t eventAllocations;
 
-	snd_seq_addr_t m_input;
-	snd_seq_addr_t m_output;
+	// Bytes of heap in use as of the last sample, and the most sampled, see heapSample().
+	uint64_t heapBytes;
+	uint64_t heapPeakBytes;
 };
 
-Client::Client()
-	:m_clientId(-1)
-	,m_inputInitialized(false)
-	,m_outputInitialized(false)
+Stats::Stats()
+	:firstPriorityLinkUs(0)
+	,priorityLinks(0)
+	,announcements(0)
+	,syscalls(0)
+	,subscribes(0)
+	,unsubscribes(0)
+	,ruleChecks(0)
+	,ruleCheckNs(0)
+	,inputOverflows(0)
+	,resyncs(0)
+	,failovers(0)
+	,retries(0)
+	,retriesFailed(0)
+	,loopChecks(0)
+	,loopCheckNs(0)
+	,loopsRefused(0)
+	,monitoredEvents(0)
+	,rateLimited(0)
+	,allocations(0)
+	,eventAllocations(0)
+	,heapBytes(0)
+	,heapPeakBytes(0)
 {
 }
 
-Client::Client(int clientId)
-	:m_clientId(clientId)
-	,m_inputInitialized(false)
-	,m_outputInitialized(false)
-{
-}
+static Stats g_stats;
 
-void Client::setInput(snd_seq_addr_t addr)
-{
-	m_inputInitialized = true;
-	m_input = addr;
-}
+#ifndef AMIDIAUTO_GENERATOR
+static uint64_t g_startTimeUs = 0;
 
-void Client::setOutput(snd_seq_addr_t addr)
+// Samples the heap in use as counted by malloc, after the points it may have grown at.
+static void heapSample()
 {
-	m_outputInitialized = true;
-	m_output = addr;
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+	struct mallinfo2 info = mallinfo2();
+	uint64_t bytes = info.uordblks + info.hblkhd;
+#else
+	struct mallinfo info = mallinfo();
+	uint64_t bytes = (unsigned)info.uordblks + (unsigned)info.hblkhd;
+#endif
+
+	g_stats.heapBytes = bytes;
+	if (bytes > g_stats.heapPeakBytes)
+		g_stats.heapPeakBytes = bytes;
 }
+#endif
 
-bool Client::isInputSet() const
+enum LogLevel
 {
-	return m_inputInitialized;
-}
+	LOG_LEVEL_ERROR   = 0,
+	LOG_LEVEL_WARNING = 1,
+	LOG_LEVEL_INFO    = 2,
+};
 
-bool Client::isOutputSet() const
+// Messages are formatted into a preallocated ring of records and written out by
+// logFlush() once the events at hand are handled, so a slow log reader does not
+// delay connecting ports. Each call site may log a burst of LOG_RATE_BURST
+// messages per LOG_RATE_WINDOW_US, the rest are counted and reported as suppressed.
+enum
 {
-	return m_outputInitialized;
-}
+#ifndef AMIDIAUTO_TINY
+	LOG_RECORD_COUNT   = 256,
+#else
+	LOG_RECORD_COUNT   = 32,
+#endif
+	LOG_RECORD_SIZE    = 256,
+	LOG_LIMIT_COUNT    = 32,
+	LOG_RATE_BURST     = 20,
+	LOG_RATE_WINDOW_US = 1000000,
+};
 
-void Client::clearInput()
+struct LogRecord
 {
-	m_inputInitialized = false;
-}
+	uint8_t level;
+	char text[LOG_RECORD_SIZE - 1];
+};
 
-void Client::clearOutput()
+struct LogLimit
 {
-	m_outputInitialized = false;
-}
+	const char *fmt;
+	uint64_t windowStart;
+	unsigned count;
+	unsigned suppressed;
+};
 
-const snd_seq_addr_t * Client::getInput() const
-{
-	return m_inputInitialized ? &m_input : NULL;
-}
+static LogLevel g_logLevel = LOG_LEVEL_INFO;
+
+static LogRecord g_logRecords[LOG_RECORD_COUNT];
+static unsigned g_logHead = 0;
+static unsigned g_logTail = 0;
+static unsigned g_logDropped = 0;
+
+static LogLimit g_logLimits[LOG_LIMIT_COUNT];
+
+#ifdef AMIDIAUTO_JOURNAL
+static bool g_logJournal = false;
+#endif
 
-const snd_seq_addr_t * Client::getOutput() const
+#ifndef AMIDIAUTO_BENCH
+static void logInit()
 {
-	return m_outputInitialized ? &m_output : NULL;
+#ifdef AMIDIAUTO_JOURNAL
+	// Set by systemd when stdout and stderr are connected to the journal.
+	g_logJournal = getenv("JOURNAL_STREAM") != NULL;
+#endif
 }
+#endif
 
-bool Client::operator <(const Client &rhs) const
+static LogRecord *logAllocRecord(LogLevel level)
 {
-	return m_clientId < rhs.m_clientId;
-}
+	if (g_logHead - g_logTail >= LOG_RECORD_COUNT)
+	{
+		++g_logDropped;
+		return NULL;
+	}
 
-typedef std::map<int, Client> clients_t;
+	LogRecord *record = &g_logRecords[g_logHead++ % LOG_RECORD_COUNT];
+	record->level = level;
+	return record;
+}
 
-enum ClientType
+static void logReportSuppressed(LogLimit &limit)
 {
-	CLIENT_SOFTWARE,
-	CLIENT_HARDWARE
-};
+	if (limit.suppressed == 0)
+		return;
 
-static clients_t g_swClients;
-static clients_t g_hwClients;
+	LogRecord *record = logAllocRecord(LOG_LEVEL_WARNING);
+	if (record)
+		snprintf(record->text, sizeof(record->text), "Suppressed %u messages like '%.64s'.", limit.suppressed, limit.fmt);
 
-static Client &getClient(clients_t &list, int clientId)
-{
-	clients_t::iterator item = list.find(clientId);
-	if (item != list.end())
-	{
-		return item->second;
-	}
-	else
-	{
-		return list.insert(std::make_pair(clientId, Client(clientId))).first->second;
-	}
+	limit.suppressed = 0;
 }
 
-Client *findClientForPort(snd_seq_addr_t addr, ClientType *type = NULL)
+// Returns false if the message must be dropped due to the rate limit of its call site.
+static bool logCheckLimit(const char *fmt)
 {
-	int clientId = addr.client;
+	LogLimit &limit = g_logLimits[((uintptr_t)fmt >> 2) % LOG_LIMIT_COUNT];
 
-	clients_t::iterator item = g_swClients.find(clientId);
-	if (item == g_swClients.end())
+	uint64_t now = getTimeUs();
+
+	if (limit.fmt != fmt || now - limit.windowStart >= LOG_RATE_WINDOW_US)
 	{
-		item = g_hwClients.find(clientId);
-		if (item == g_hwClients.end())
-		{
-			return NULL;
-		}
-		else
-		{
-			if (type) *type = CLIENT_HARDWARE;
-		}
+		logReportSuppressed(limit);
+
+		limit.fmt = fmt;
+		limit.windowStart = now;
+		limit.count = 0;
 	}
-	else
+
+	if (limit.count >= LOG_RATE_BURST)
 	{
-		if (type) *type = CLIENT_SOFTWARE;
+		++limit.suppressed;
+		return false;
 	}
 
-	return &item->second;
+	++limit.count;
+	return true;
 }
 
-static void connect(snd_seq_addr_t output, snd_seq_addr_t input)
+static void logPrintf(LogLevel level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void logPrintf(LogLevel level, const char *fmt, ...)
 {
-	printf("Connecting %d:%d to %d:%d\n", output.client, output.port, input.client, input.port);
+	if (level > g_logLevel || !logCheckLimit(fmt))
+		return;
 
-	snd_seq_port_subscribe_t *subs;
-	snd_seq_port_subscribe_alloca(&subs);
-	snd_seq_port_subscribe_set_sender(subs, &output);
-	snd_seq_port_subscribe_set_dest(subs, &input);
-	snd_seq_subscribe_port(g_seq, subs);
+	LogRecord *record = logAllocRecord(level);
+	if (!record)
+		return;
+
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(record->text, sizeof(record->text), fmt, args);
+	va_end(args);
 }
 
-static PortDir portGetDir(const snd_seq_port_info_t &portInfo)
+static void logWrite(LogLevel level, const char *text)
 {
-	unsigned result = 0;
-
-	unsigned int caps = snd_seq_port_info_get_capability(&portInfo);
-
-	if (caps & SND_SEQ_PORT_CAP_READ)
+#ifdef AMIDIAUTO_JOURNAL
+	if (g_logJournal)
 	{
-		result |= DIR_OUTPUT;
+		static const int priorities[] = { LOG_ERR, LOG_WARNING, LOG_INFO };
+		sd_journal_send("MESSAGE=%s", text, "PRIORITY=%d", priorities[level], "SYSLOG_IDENTIFIER=amidiauto", NULL);
+		return;
 	}
-	if (caps & SND_SEQ_PORT_CAP_WRITE)
+#endif
+	FILE *f = level == LOG_LEVEL_INFO ? stdout : stderr;
+	fputs(text, f);
+	fputc('\n', f);
+}
+
+// Writes out the logged messages, to be called outside of event handling.
+static void logFlush()
+{
+	uint64_t now = getTimeUs();
+	for (int i=0; i<LOG_LIMIT_COUNT; ++i)
 	{
-		result |= DIR_INPUT;
+		if (now - g_logLimits[i].windowStart >= LOG_RATE_WINDOW_US)
+			logReportSuppressed(g_logLimits[i]);
 	}
 
-	return (PortDir)result;
-}
+	if (g_logHead == g_logTail && g_logDropped == 0)
+		return;
 
-static PortType portGetType(const snd_seq_port_info_t &portInfo)
-{
-	const char *name = snd_seq_port_info_get_name(&portInfo);
+	for (; g_logTail != g_logHead; ++g_logTail)
+	{
+		const LogRecord &record = g_logRecords[g_logTail % LOG_RECORD_COUNT];
+		logWrite((LogLevel)record.level, record.text);
+	}
 
-	if (strncmp("TouchOSC Bridge", name, 15) == 0)
+	if (g_logDropped != 0)
 	{
-		// Treat touchosc2midi ports as 'hardware' ones.
-		return TYPE_HARDWARE;
+		char text[64];
+		snprintf(text, sizeof(text), "Log buffer full, %u messages dropped.", g_logDropped);
+		logWrite(LOG_LEVEL_WARNING, text);
+		g_logDropped = 0;
 	}
 
-	unsigned int type = snd_seq_port_info_get_type(&portInfo);
+	fflush(stdout);
+	fflush(stderr);
+}
 
-	return (type & SND_SEQ_PORT_TYPE_APPLICATION) ? TYPE_SOFTWARE : TYPE_HARDWARE;
+typedef std::vector<uint32_t> bits_t;
+
+static inline void bitsSet(bits_t &bits, size_t n)
+{
+	bits[n / 32] |= 1u << (n % 32);
 }
 
-static bool portAdd(const snd_seq_port_info_t &portInfo)
+static inline bool bitsTest(const bits_t &bits, size_t n)
 {
-	unsigned int caps = snd_seq_port_info_get_capability(&portInfo);
+	return (bits[n / 32] >> (n % 32)) & 1;
+}
 
-	if (caps & SND_SEQ_PORT_CAP_NO_EXPORT)
-		return false;
+// The elements of one of the compiled rule tables, either held while building the rules,
+// or referring to the table within a compiled image, which must outlive it. Copies refer
+// to the same image, so the rules loaded from one are used in place.
+template <typename T>
+class ImageArray
+{
+public:
+	typedef const T *const_iterator;
 
-	// Ignore System client and its Announce and Timer ports.
-	int clientId = snd_seq_port_info_get_client(&portInfo);
-	if (clientId == SND_SEQ_CLIENT_SYSTEM)
-		return false;
+	ImageArray();
 
-	snd_seq_client_info_t *clientInfo;
-	snd_seq_client_info_alloca(&clientInfo);
-	if (snd_seq_get_any_client_info(g_seq, clientId, clientInfo) < 0)
-		return false;
+	size_t size() const;
+	bool empty() const;
 
-	// Ignore through ports.
-	const char *name = snd_seq_client_info_get_name(clientInfo);
-	if (!name || strncmp(name, "Midi Through", 12) == 0)
-		return false;
+	const T &operator [](size_t i) const;
+	const T &back() const;
 
-	PortType type = portGetType(portInfo);
-	clients_t &list = (type == TYPE_SOFTWARE) ? g_swClients : g_hwClients;
+	const_iterator begin() const;
+	const_iterator end() const;
 
-	PortDir dir = portGetDir(portInfo);
+	// The elements to build them in, copied out of the image first if referring to one.
+	std::vector<T> &edit();
 
-	bool gotAdded = false;
+	void refer(const T *items, size_t count);
 
-	snd_seq_addr_t addr = *snd_seq_port_info_get_addr(&portInfo);
+private:
+	const T *data() const;
 
-	Client &client = getClient(list, addr.client);
-	if (dir & DIR_OUTPUT)
-	{
-		if (!client.isOutputSet())
-		{
-			client.setOutput(addr);
-			gotAdded = true;
-		}
-	}
-	if (dir & DIR_INPUT)
-	{
-		if (!client.isInputSet())
-		{
-			client.setInput(addr);
-			gotAdded = true;
-		}
-	}
+	std::vector<T> m_items;
+	const T *m_image;
+	size_t m_imageCount;
+};
 
-	return gotAdded;
+template <typename T>
+ImageArray<T>::ImageArray()
+	:m_image(NULL)
+	,m_imageCount(0)
+{
 }
 
-static void portRemove(snd_seq_addr_t addr)
+template <typename T>
+inline const T *ImageArray<T>::data() const
 {
-	Client *client = findClientForPort(addr);
+	if (m_image)
+		return m_image;
 
+	return m_items.empty() ? NULL : &m_items[0];
+}
+
+template <typename T>
+inline size_t ImageArray<T>::size() const
+{
+	return m_image ? m_imageCount : m_items.size();
+}
+
+template <typename T>
+inline bool ImageArray<T>::empty() const
+{
+	return size() == 0;
+}
+
+template <typename T>
+inline const T &ImageArray<T>::operator [](size_t i) const
+{
+	return data()[i];
+}
+
+template <typename T>
+inline const T &ImageArray<T>::back() const
+{
+	return data()[size() - 1];
+}
+
+template <typename T>
+inline typename ImageArray<T>::const_iterator ImageArray<T>::begin() const
+{
+	return data();
+}
+
+template <typename T>
+inline typename ImageArray<T>::const_iterator ImageArray<T>::end() const
+{
+	return data() + size();
+}
+
+template <typename T>
+std::vector<T> &ImageArray<T>::edit()
+{
+	if (m_image)
+	{
+		m_items.assign(m_image, m_image + m_imageCount);
+		m_image = NULL;
+		m_imageCount = 0;
+	}
+
+	return m_items;
+}
+
+template <typename T>
+void ImageArray<T>::refer(const T *items, size_t count)
+{
+	std::vector<T>().swap(m_items);
+	m_image = items;
+	m_imageCount = count;
+}
+
+// Builds a compiled rules image, see ConnectionRules::writeImage(). Arrays are stored
+// with their element count and size, 4 byte aligned, so they can be read straight out
+// of a mapping of the file. The items are copied as they are in memory, so their types
+// must have no padding, other than explicit members set to zero.
+class ImageWriter
+{
+public:
+	void writeValue(uint32_t value);
+
+	template <typename T>
+	void writeArray(const ImageArray<T> &items);
+
+	const std::vector<char> &getData() const;
+
+private:
+	void append(const void *data, size_t size);
+
+	std::vector<char> m_data;
+};
+
+void ImageWriter::append(const void *data, size_t size)
+{
+	const char *p = (const char *)data;
+	m_data.insert(m_data.end(), p, p + size);
+	m_data.resize((m_data.size() + 3) & ~3u, '\0');
+}
+
+void ImageWriter::writeValue(uint32_t value)
+{
+	append(&value, sizeof(value));
+}
+
+template <typename T>
+void ImageWriter::writeArray(const ImageArray<T> &items)
+{
+	writeValue(items.size());
+	writeValue(sizeof(T));
+	if (!items.empty())
+		append(&items[0], items.size() * sizeof(T));
+}
+
+const std::vector<char> &ImageWriter::getData() const
+{
+	return m_data;
+}
+
+// Reads what ImageWriter wrote, every read fails once the data ran out or didn't fit.
+// The arrays read refer into the data, which must stay as it is while they are in use.
+class ImageReader
+{
+public:
+	ImageReader(const char *data, size_t size);
+
+	bool readValue(uint32_t &value);
+
+	template <typename T>
+	bool readArray(ImageArray<T> &items);
+
+	bool isAtEnd() const;
+
+private:
+	const char *take(size_t size);
+
+	const char *m_data;
+	size_t m_size;
+	size_t m_offset;
+	bool m_failed;
+};
+
+ImageReader::ImageReader(const char *data, size_t size)
+	:m_data(data)
+	,m_size(size)
+	,m_offset(0)
+	,m_failed(false)
+{
+}
+
+const char *ImageReader::take(size_t size)
+{
+	size_t padded = (size + 3) & ~(size_t)3;
+	if (m_failed || padded < size || padded > m_size - m_offset)
+	{
+		m_failed = true;
+		return NULL;
+	}
+
+	const char *p = m_data + m_offset;
+	m_offset += padded;
+	return p;
+}
+
+bool ImageReader::readValue(uint32_t &value)
+{
+	const char *p = take(sizeof(value));
+	if (!p)
+		return false;
+
+	memcpy(&value, p, sizeof(value));
+	return true;
+}
+
+template <typename T>
+bool ImageReader::readArray(ImageArray<T> &items)
+{
+	uint32_t count, size;
+	if (!readValue(count) || !readValue(size) || size != sizeof(T) || count > m_size / sizeof(T))
+	{
+		m_failed = true;
+		return false;
+	}
+
+	const char *p = take(count * sizeof(T));
+	if (!p || (uintptr_t)p % __alignof__(T) != 0)
+	{
+		m_failed = true;
+		return false;
+	}
+
+	items.refer((const T *)p, count);
+	return true;
+}
+
+bool ImageReader::isAtEnd() const
+{
+	return !m_failed && m_offset == m_size;
+}
+
+// A read-only mapping of a compiled rules image file, unmapped once the last copy is gone.
+class ImageMapping
+{
+public:
+	ImageMapping();
+	ImageMapping(const ImageMapping &other);
+	~ImageMapping();
+
+	ImageMapping &operator =(const ImageMapping &other);
+
+	// Takes over a mapping made with mmap().
+	void reset(void *data, size_t size);
+
+	const char *getData() const;
+	size_t getSize() const;
+
+private:
+	void release();
+
+	struct shared_t
+	{
+		void *data;
+		size_t size;
+		unsigned refs;
+	};
+
+	shared_t *m_shared;
+};
+
+ImageMapping::ImageMapping()
+	:m_shared(NULL)
+{
+}
+
+ImageMapping::ImageMapping(const ImageMapping &other)
+	:m_shared(other.m_shared)
+{
+	if (m_shared)
+		++m_shared->refs;
+}
+
+ImageMapping::~ImageMapping()
+{
+	release();
+}
+
+ImageMapping &ImageMapping::operator =(const ImageMapping &other)
+{
+	if (other.m_shared)
+		++other.m_shared->refs;
+
+	release();
+	m_shared = other.m_shared;
+
+	return *this;
+}
+
+void ImageMapping::reset(void *data, size_t size)
+{
+	release();
+
+	m_shared = new shared_t;
+	m_shared->data = data;
+	m_shared->size = size;
+	m_shared->refs = 1;
+}
+
+const char *ImageMapping::getData() const
+{
+	return m_shared ? (const char *)m_shared->data : NULL;
+}
+
+size_t ImageMapping::getSize() const
+{
+	return m_shared ? m_shared->size : 0;
+}
+
+void ImageMapping::release()
+{
+	if (m_shared && --m_shared->refs == 0)
+	{
+		munmap(m_shared->data, m_shared->size);
+		delete m_shared;
+	}
+
+	m_shared = NULL;
+}
+
+// Aho-Corasick automaton, finds all of the patterns occurring in a string in a single pass.
+class PatternMatcher
+{
+public:
+	PatternMatcher();
+
+	// Patterns starting with BEGIN or ending with END only occur at the start or the end of a string.
+	enum
+	{
+		BEGIN = 0x02,
+		END   = 0x03,
+	};
+
+	// Pattern ids are the indices within the patterns vector, empty patterns never occur.
+	void build(const std::vector<std::string> &patterns);
+
+	// Calls onMatch(patternId) for every occurrence of a pattern in str.
+	template <typename F>
+	void match(const char *str, F &onMatch) const;
+
+	void write(ImageWriter &writer) const;
+
+	// Returns false if the automaton read is not consistent.
+	bool read(ImageReader &reader, size_t patternCount);
+
+private:
+	struct Node
+	{
+		uint32_t firstEdge;
+		uint32_t edgeCount;
+		int32_t fail;
+		int32_t pattern;  // Id of the pattern ending at this node, or -1.
+		int32_t dictLink; // Nearest node on the fail chain that ends a pattern, or -1.
+	};
+
+	struct Edge
+	{
+		uint8_t c;
+		uint8_t pad[3]; // Zero, so the image holds no indeterminate bytes.
+		int32_t target;
+	};
+
+	int findEdge(int node, uint8_t c) const;
+
+	template <typename F>
+	int step(int state, uint8_t c, F &onMatch) const;
+
+	ImageArray<Node> m_nodes;
+	ImageArray<Edge> m_edges;
+};
+
+PatternMatcher::PatternMatcher()
+{
+}
+
+void PatternMatcher::build(const std::vector<std::string> &patterns)
+{
+	typedef std::map<uint8_t, int> children_t;
+
+	std::vector<children_t> trie(1);
+	std::vector<int> terminal(1, -1);
+
+	for (size_t i=0; i<patterns.size(); ++i)
+	{
+		int node = 0;
+		const std::string &pattern = patterns[i];
+		if (pattern.empty())
+			continue;
+
+		for (size_t j=0; j<pattern.size(); ++j)
+		{
+			uint8_t c = pattern[j];
+			children_t::const_iterator child = trie[node].find(c);
+			if (child != trie[node].end())
+			{
+				node = child->second;
+			}
+			else
+			{
+				int next = trie.size();
+				trie[node][c] = next;
+				trie.push_back(children_t());
+				terminal.push_back(-1);
+				node = next;
+			}
+		}
+		terminal[node] = i;
+	}
+
+	std::vector<Node> &nodes = m_nodes.edit();
+	std::vector<Edge> &edges = m_edges.edit();
+
+	nodes.resize(trie.size());
+	edges.clear();
+
+	for (size_t i=0; i<trie.size(); ++i)
+	{
+		Node &node = nodes[i];
+		node.firstEdge = edges.size();
+		node.edgeCount = trie[i].size();
+		node.fail = 0;
+		node.pattern = terminal[i];
+		node.dictLink = -1;
+
+		for (children_t::const_iterator itr = trie[i].begin(); itr != trie[i].end(); ++itr)
+		{
+			Edge edge;
+			edge.c = itr->first;
+			memset(edge.pad, 0, sizeof(edge.pad));
+			edge.target = itr->second;
+			edges.push_back(edge);
+		}
+	}
+
+	// Breadth first, so fail links always point to already processed nodes.
+	std::vector<int> queue;
+	queue.reserve(nodes.size());
+	queue.push_back(0);
+
+	for (size_t q=0; q<queue.size(); ++q)
+	{
+		int parent = queue[q];
+
+		for (uint32_t e=0; e<nodes[parent].edgeCount; ++e)
+		{
+			const Edge &edge = edges[nodes[parent].firstEdge + e];
+			Node &child = nodes[edge.target];
+
+			if (parent != 0)
+			{
+				int f = nodes[parent].fail;
+				int next;
+				while ((next = findEdge(f, edge.c)) < 0 && f != 0)
+					f = nodes[f].fail;
+				child.fail = next >= 0 ? next : 0;
+			}
+
+			const Node &fail = nodes[child.fail];
+			child.dictLink = fail.pattern >= 0 ? child.fail : fail.dictLink;
+
+			queue.push_back(edge.target);
+		}
+	}
+}
+
+void PatternMatcher::write(ImageWriter &writer) const
+{
+	writer.writeArray(m_nodes);
+	writer.writeArray(m_edges);
+}
+
+bool PatternMatcher::read(ImageReader &reader, size_t patternCount)
+{
+	if (!reader.readArray(m_nodes) || !reader.readArray(m_edges) || m_nodes.empty())
+		return false;
+
+	// Every index followed while matching must stay within the tables.
+	int32_t nodeCount = m_nodes.size();
+	for (size_t i=0; i<m_nodes.size(); ++i)
+	{
+		const Node &node = m_nodes[i];
+		if (node.firstEdge > m_edges.size() || node.edgeCount > m_edges.size() - node.firstEdge)
+			return false;
+		if (node.fail < 0 || node.fail >= nodeCount || node.dictLink < -1 || node.dictLink >= nodeCount)
+			return false;
+		if (node.pattern < -1 || node.pattern >= (int32_t)patternCount)
+			return false;
+	}
+
+	for (size_t i=0; i<m_edges.size(); ++i)
+	{
+		if (m_edges[i].target <= 0 || m_edges[i].target >= nodeCount)
+			return false;
+	}
+
+	return true;
+}
+
+int PatternMatcher::findEdge(int node, uint8_t c) const
+{
+	const Node &n = m_nodes[node];
+
+	uint32_t lo = n.firstEdge;
+	uint32_t hi = n.firstEdge + n.edgeCount;
+
+	while (lo < hi)
+	{
+		uint32_t mid = (lo + hi) / 2;
+		if (m_edges[mid].c < c)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo < n.firstEdge + n.edgeCount && m_edges[lo].c == c ? m_edges[lo].target : -1;
+}
+
+template <typename F>
+int PatternMatcher::step(int state, uint8_t c, F &onMatch) const
+{
+	int next;
+	while ((next = findEdge(state, c)) < 0 && state != 0)
+		state = m_nodes[state].fail;
+
+	state = next >= 0 ? next : 0;
+
+	for (int n = m_nodes[state].pattern >= 0 ? state : m_nodes[state].dictLink; n >= 0; n = m_nodes[n].dictLink)
+		onMatch(m_nodes[n].pattern);
+
+	return state;
+}
+
+template <typename F>
+void PatternMatcher::match(const char *str, F &onMatch) const
+{
+	if (m_nodes.empty())
+		return;
+
+	int state = step(0, BEGIN, onMatch);
+
+	for (; *str; ++str)
+		state = step(state, *str, onMatch);
+
+	step(state, END, onMatch);
+}
+
+// A POSIX extended regular expression, compiled once. Copies compile it again.
+class Regex
+{
+public:
+	Regex();
+	Regex(const Regex &other);
+	~Regex();
+
+	Regex &operator =(const Regex &other);
+
+	// Returns false if the expression is not valid.
+	bool compile(const char *source);
+
+	bool matches(const char *str) const;
+
+private:
+	void release();
+
+	std::string m_source;
+	regex_t m_regex;
+	bool m_compiled;
+};
+
+Regex::Regex()
+	:m_compiled(false)
+{
+}
+
+Regex::Regex(const Regex &other)
+	:m_compiled(false)
+{
+	if (other.m_compiled)
+		compile(other.m_source.c_str());
+}
+
+Regex::~Regex()
+{
+	release();
+}
+
+Regex &Regex::operator =(const Regex &other)
+{
+	if (this != &other)
+	{
+		release();
+		if (other.m_compiled)
+			compile(other.m_source.c_str());
+	}
+	return *this;
+}
+
+bool Regex::compile(const char *source)
+{
+	release();
+
+	if (regcomp(&m_regex, source, REG_EXTENDED | REG_NOSUB) != 0)
+		return false;
+
+	m_source = source;
+	m_compiled = true;
+	return true;
+}
+
+bool Regex::matches(const char *str) const
+{
+	return m_compiled && regexec(&m_regex, str, 0, NULL, 0) == 0;
+}
+
+void Regex::release()
+{
+	if (m_compiled)
+	{
+		regfree(&m_regex);
+		m_compiled = false;
+	}
+}
+
+// The distinct patterns of one part of the rule sides, either client or port, each compiled once:
+// text, optionally anchored by a leading ^ or a trailing $, into a PatternMatcher,
+// /regular expressions/ with regcomp() and @numbers into a table of client ids or port numbers.
+class PatternSet
+{
+public:
+	static bool isValid(const std::string &pattern);
+
+	// Pattern ids are the indices within the patterns vector, which must all be valid.
+	void build(const std::vector<std::string> &patterns);
+
+	// Calls onMatch(patternId) for every pattern matching the number or the name.
+	template <typename F>
+	void match(int number, const char *name, F &onMatch) const;
+
+	void write(ImageWriter &writer) const;
+
+	// Returns false if the tables read are not consistent.
+	bool read(ImageReader &reader, size_t patternCount);
+
+private:
+	struct number_t
+	{
+		uint32_t number;
+		int32_t pattern;
+
+		bool operator <(const number_t &rhs) const;
+	};
+
+	static bool parseNumber(const std::string &pattern, uint32_t &number);
+	static bool isRegex(const std::string &pattern);
+
+	PatternMatcher m_matcher;
+
+	// Sorted by number.
+	ImageArray<number_t> m_numbers;
+
+	// Zero terminated sources of the regular expressions, kept for writing them out.
+	ImageArray<char> m_regexSources;
+	ImageArray<int32_t> m_regexPatterns;
+
+	// Compiled at loading, regex_t can't be stored in an image.
+	std::vector<Regex> m_regexes;
+};
+
+bool PatternSet::number_t::operator <(const number_t &rhs) const
+{
+	return number < rhs.number;
+}
+
+bool PatternSet::parseNumber(const std::string &pattern, uint32_t &number)
+{
+	if (pattern.size() < 2 || pattern.size() > 4 || pattern[0] != '@' || strspn(pattern.c_str() + 1, "0123456789") != pattern.size() - 1)
+		return false;
+
+	number = strtoul(pattern.c_str() + 1, NULL, 10);
+	return number <= 255;
+}
+
+bool PatternSet::isRegex(const std::string &pattern)
+{
+	return pattern.size() >= 2 && pattern[0] == '/' && pattern[pattern.size()-1] == '/';
+}
+
+bool PatternSet::isValid(const std::string &pattern)
+{
+	uint32_t number;
+	if (parseNumber(pattern, number))
+		return true;
+
+	if (isRegex(pattern))
+		return Regex().compile(pattern.substr(1, pattern.size() - 2).c_str());
+
+	size_t begin = pattern.size() > 0 && pattern[0] == '^' ? 1 : 0;
+	size_t end = pattern.size() > begin && pattern[pattern.size()-1] == '$' ? pattern.size() - 1 : pattern.size();
+
+	return end > begin && pattern.find('*') == std::string::npos;
+}
+
+void PatternSet::build(const std::vector<std::string> &patterns)
+{
+	std::vector<std::string> texts(patterns.size());
+
+	std::vector<number_t> &numbers = m_numbers.edit();
+	std::vector<char> &regexSources = m_regexSources.edit();
+	std::vector<int32_t> &regexPatterns = m_regexPatterns.edit();
+
+	numbers.clear();
+	regexSources.clear();
+	regexPatterns.clear();
+	m_regexes.clear();
+
+	for (size_t i=0; i<patterns.size(); ++i)
+	{
+		const std::string &pattern = patterns[i];
+
+		number_t number;
+		if (parseNumber(pattern, number.number))
+		{
+			number.pattern = i;
+			numbers.push_back(number);
+		}
+		else if (isRegex(pattern))
+		{
+			std::string source = pattern.substr(1, pattern.size() - 2);
+			regexSources.insert(regexSources.end(), source.c_str(), source.c_str() + source.size() + 1);
+			regexPatterns.push_back(i);
+			m_regexes.push_back(Regex());
+			m_regexes.back().compile(source.c_str());
+		}
+		else
+		{
+			std::string &text = texts[i];
+			text = pattern;
+			if (text[0] == '^')
+				text[0] = PatternMatcher::BEGIN;
+			if (text.size() > 1 && text[text.size()-1] == '$')
+				text[text.size()-1] = PatternMatcher::END;
+		}
+	}
+
+	std::sort(numbers.begin(), numbers.end());
+
+	m_matcher.build(texts);
+}
+
+template <typename F>
+void PatternSet::match(int number, const char *name, F &onMatch) const
+{
+	m_matcher.match(name, onMatch);
+
+	number_t key;
+	key.number = number;
+	for (const number_t *itr = std::lower_bound(m_numbers.begin(), m_numbers.end(), key); itr != m_numbers.end() && itr->number == key.number; ++itr)
+		onMatch(itr->pattern);
+
+	for (size_t i=0; i<m_regexes.size(); ++i)
+	{
+		if (m_regexes[i].matches(name))
+			onMatch(m_regexPatterns[i]);
+	}
+}
+
+void PatternSet::write(ImageWriter &writer) const
+{
+	m_matcher.write(writer);
+	writer.writeArray(m_numbers);
+	writer.writeArray(m_regexSources);
+	writer.writeArray(m_regexPatterns);
+}
+
+bool PatternSet::read(ImageReader &reader, size_t patternCount)
+{
+	if (!m_matcher.read(reader, patternCount) || !reader.readArray(m_numbers) || !reader.readArray(m_regexSources) || !reader.readArray(m_regexPatterns))
+		return false;
+
+	for (size_t i=0; i<m_numbers.size(); ++i)
+	{
+		if (m_numbers[i].pattern < 0 || m_numbers[i].pattern >= (int32_t)patternCount || (i > 0 && m_numbers[i] < m_numbers[i-1]))
+			return false;
+	}
+
+	if (!m_regexSources.empty() && m_regexSources.back() != '\0')
+		return false;
+
+	m_regexes.clear();
+	m_regexes.resize(m_regexPatterns.size());
+
+	const char *source = m_regexSources.empty() ? NULL : &m_regexSources[0];
+	const char *end = source + m_regexSources.size();
+	for (size_t i=0; i<m_regexPatterns.size(); ++i)
+	{
+		if (m_regexPatterns[i] < 0 || m_regexPatterns[i] >= (int32_t)patternCount || source >= end || !m_regexes[i].compile(source))
+			return false;
+
+		source += strlen(source) + 1;
+	}
+
+	return source == end;
+}
+
+class ConnectionRules
+{
+public:
+	enum Type
+	{
+		TYPE_UNKNOWN  = -1,
+		TYPE_ALLOW    = 0,
+		TYPE_DISALLOW = 1,
+	};
+
+	enum Strength
+	{
+		STRENGTH_NONE       = 0, // Rule does not apply.
+		STRENGTH_VERY_VAGUE = 1, // Wildcard matched wildcard.
+		STRENGTH_VAGUE      = 2, // One of the sides is a specific name, the other is a wildcard.
+		STRENGTH_SPECIFIC   = 3, // Both sides is a specific name.
+	};
+
+	// Result of matching a single client name against all of the rules.
+	// Bit n is set if the corresponding side of rule n matches the name,
+	// a wildcard side always matches.
+	struct Match
+	{
+		Match();
+
+		bits_t outputBits;
+		bits_t inputBits;
+
+		// The strongest allow rule the name could take part in, used to reject pairs early.
+		Strength bestAllowAsOutput;
+		Strength bestAllowAsInput;
+	};
+
+	ConnectionRules();
+
+	// Each side is a client pattern, optionally followed by :port, the port pattern.
+	// Returns false if a side is not valid, see PatternSet.
+	bool addRule(Type type, const char *output, const char *input);
+
+	bool hasRules() const;
+
+	// Must be called after adding rules, before matching names.
+	void compile();
+
+	// Changes on every rule change, Match results of an older generation are stale.
+	// Generations are unique among all ConnectionRules instances.
+	unsigned getGeneration() const;
+
+	// Fills changes with the rules present in only one of the sets, as allow rules,
+	// so a pair of clients is affected by the difference if changes allow it.
+	void diff(const ConnectionRules &other, ConnectionRules &changes) const;
+
+	// Matches a client, sides with a port pattern are set if their client pattern matches.
+	void match(int clientId, const char *name, Match &result) const;
+
+	// Whether any side has a port pattern, otherwise the match of a client applies to all of its ports.
+	bool hasPortRules() const;
+
+	// Narrows the match of a client down to one of its ports.
+	void matchPort(const Match &client, int port, const char *portName, Match &result) const;
+
+	// Sizes the bits of result for the current rules, so matching into it does not allocate.
+	void reserve(Match &result) const;
+
+	bool isConnectionAllowed(const Match &output, const Match &input, Strength minimumStrength) const;
+
+	// The reasoning behind an isConnectionAllowed result. The rules are the indexes
+	// of the first strongest rule of each type applying to the pair, -1 if none does.
+	struct Verdict
+	{
+		bool allowed;
+		Strength allowStrength;
+		Strength disallowStrength;
+		int allowRule;
+		int disallowRule;
+	};
+
+	void explain(const Match &output, const Match &input, Strength minimumStrength, Verdict &verdict) const;
+
+	// Returns false if there's no such rule.
+	bool getRule(int n, Type &type, const char *&output, const char *&input) const;
+
+	// Which ports of a client get tracked for connecting, from the [ports] section.
+	enum PortSelection
+	{
+		SELECT_FIRST, // The first port of each direction, the default.
+		SELECT_ALL,
+		SELECT_MAX,   // Up to count ports of each direction.
+		SELECT_NAME,  // The ports whose name contains a pattern.
+	};
+
+	struct PortPolicy
+	{
+		PortPolicy();
+
+		PortSelection selection;
+		unsigned count;
+
+		// Most inputs an output port may get linked to, 0 if there's no limit.
+		unsigned fanout;
+	};
+
+	// The client patterns of the sections are those of the rule sides, without a port.
+	// The add functions return false if the client pattern is not valid.
+	static bool isValidClient(const char *client);
+
+	// The port name pattern is used by SELECT_NAME only.
+	bool addPortPolicy(const char *client, const PortPolicy &policy, const char *port);
+
+	// Whether a port of a client should be tracked, given the number of its ports already tracked.
+	bool isPortSelected(int policy, const char *portName, size_t selectedCount) const;
+
+	// The two halves of isPortSelected(), a port passing the name check is a failover candidate.
+	bool isPortNameSelected(int policy, const char *portName) const;
+	bool hasPortRoom(int policy, size_t selectedCount) const;
+
+	unsigned getFanout(int policy) const;
+
+	bool hasSamePortPolicies(const ConnectionRules &other) const;
+
+	// Most events per second the outputs of a client may send, from the [limits] section.
+	struct RateLimit
+	{
+		RateLimit();
+
+		unsigned eventsPerSecond;
+
+		// How long an output over the limit stays disconnected, 0 until it reappears.
+		unsigned holdSeconds;
+	};
+
+	bool addRateLimit(const char *client, const RateLimit &limit);
+
+	// The limit must exist.
+	const RateLimit &getRateLimit(int limit) const;
+
+	bool hasRateLimits() const;
+	bool hasSameRateLimits(const ConnectionRules &other) const;
+
+	// Clients passing the events of their inputs on to their outputs, from the [thru]
+	// section. Links closing a cycle of these are refused, see graphWouldLoop().
+	bool addThru(const char *client);
+	bool hasSameThru(const ConnectionRules &other) const;
+
+	// Clients whose links get made first, from the [priority] section, see graphDrain().
+	bool addPriority(const char *client, int priority);
+
+	bool hasSamePriorities(const ConnectionRules &other) const;
+
+	// What the sections hold for a client, of the first line of each whose client pattern matches.
+	struct SectionMatch
+	{
+		// Index of the port policy, -1 if there's none.
+		int portPolicy;
+
+		// Index of the rate limit, -1 if there's none.
+		int rateLimit;
+
+		bool thru;
+
+		// 0 if there's none.
+		int priority;
+	};
+
+	// Must be called again after a rule change, like match().
+	void matchSections(int clientId, const char *clientName, SectionMatch &result) const;
+
+	// The compiled tables, so the rules can be loaded without parsing and compiling
+	// again, see rulesImageWrite(). Must be compiled first.
+	void writeImage(ImageWriter &writer) const;
+
+	// Returns false if the image is not consistent, the rules are left empty then.
+	// The tables are used in place, the image must outlive the rules and their copies,
+	// unless it's kept by them, see keepImage().
+	bool readImage(ImageReader &reader);
+
+	// Keeps the mapping the tables were read from, for as long as the rules or a copy are around.
+	void keepImage(const ImageMapping &mapping);
+
+private:
+	// The patterns are offsets into m_names, which stay valid when the rules get copied.
+	struct rule_t
+	{
+		Type type;
+		Strength strength;
+		uint32_t output;
+		uint32_t input;
+	};
+
+	typedef ImageArray<rule_t> rules_t;
+
+	struct port_policy_t
+	{
+		uint32_t client;
+		uint32_t port;
+		PortPolicy policy;
+	};
+
+	typedef ImageArray<port_policy_t> port_policies_t;
+
+	struct rate_limit_t
+	{
+		uint32_t client;
+		RateLimit limit;
+	};
+
+	typedef ImageArray<rate_limit_t> rate_limits_t;
+
+	struct priority_t
+	{
+		uint32_t client;
+		int32_t priority;
+	};
+
+	typedef ImageArray<priority_t> priorities_t;
+
+	// The distinct patterns of one part of the sides and the sides using each, for compile().
+	struct PatternSides
+	{
+		void add(const std::string &pattern, uint32_t side);
+		void flatten(std::vector<uint32_t> &sidesBegin, std::vector<uint32_t> &flat) const;
+
+		typedef std::map<std::string, int> ids_t;
+
+		ids_t ids;
+		std::vector<std::string> patterns;
+		std::vector<std::vector<uint32_t> > sides;
+	};
+
+	enum Section
+	{
+		SECTION_PORTS,
+		SECTION_LIMITS,
+		SECTION_THRU,
+		SECTION_PRIORITY,
+		SECTION_COUNT
+	};
+
+	// Keeps the first line of each section referred to by the patterns found.
+	struct SectionCollector
+	{
+		SectionCollector(const ImageArray<uint32_t> &sidesBegin, const ImageArray<uint32_t> &sides, uint32_t *first);
+
+		void operator ()(int patternId);
+
+		const ImageArray<uint32_t> &m_sidesBegin;
+		const ImageArray<uint32_t> &m_sides;
+		uint32_t *m_first;
+	};
+
+	size_t getSectionSize(Section section) const;
+	uint32_t getSectionClient(Section section, uint32_t line) const;
+
+	uint32_t addName(const char *name);
+	const char *getName(uint32_t offset) const;
+
+	// Sets the rule bits of the sides referring to a pattern found, if set in filter as well, when given.
+	struct MatchCollector
+	{
+		MatchCollector(const ImageArray<uint32_t> &sidesBegin, const ImageArray<uint32_t> &sides, Match &result, const Match *filter);
+
+		void operator ()(int patternId);
+
+		const ImageArray<uint32_t> &m_sidesBegin;
+		const ImageArray<uint32_t> &m_sides;
+		Match &m_result;
+		const Match *m_filter;
+	};
+
+	static bool splitSide(const char *side, std::string &client, std::string &port);
+	static bool isValidSide(const char *side);
+	static bool isConsistent(const ImageArray<uint32_t> &sidesBegin, const ImageArray<uint32_t> &sides, size_t ruleCount);
+
+	void insertRule(Type type, const char *output, const char *input);
+
+	Strength evaluate(Type type, const Match &output, const Match &input) const;
+	int findRule(Type type, Strength strength, const Match &output, const Match &input) const;
+	Strength getStrongest(Type type, const bits_t &bits) const;
+
+	bool isName(uint32_t offset) const;
+	bool isConsistent() const;
+
+	rules_t m_rules;
+	port_policies_t m_portPolicies;
+	rate_limits_t m_rateLimits;
+	ImageArray<uint32_t> m_thru;
+	priorities_t m_priorities;
+
+	// Arena of the zero terminated rule patterns.
+	ImageArray<char> m_names;
+
+	// Bits of the rules of each type, grouped by strength.
+	ImageArray<uint32_t> m_masks[2][STRENGTH_SPECIFIC+1];
+
+	// Rule sides whose client pattern is a wildcard, those match any client.
+	ImageArray<uint32_t> m_wildcardOutputs;
+	ImageArray<uint32_t> m_wildcardInputs;
+
+	// Rule sides with a port pattern.
+	ImageArray<uint32_t> m_portOutputs;
+	ImageArray<uint32_t> m_portInputs;
+
+	// For each distinct client pattern, the list of rule sides using it,
+	// encoded as (rule index << 1) | (1 if input side).
+	ImageArray<uint32_t> m_patternSidesBegin;
+	ImageArray<uint32_t> m_patternSides;
+
+	// The same for each distinct port pattern.
+	ImageArray<uint32_t> m_portSidesBegin;
+	ImageArray<uint32_t> m_portSides;
+
+	// The same for each distinct client pattern of the sections, but "*",
+	// encoded as (line index << 2) | Section.
+	ImageArray<uint32_t> m_sectionSidesBegin;
+	ImageArray<uint32_t> m_sectionSides;
+
+	PatternSet m_clientPatterns;
+	PatternSet m_portPatterns;
+	PatternSet m_sectionPatterns;
+
+	ImageMapping m_image;
+
+	unsigned m_generation;
+	unsigned m_compiledGeneration;
+
+	static unsigned s_lastGeneration;
+};
+
+unsigned ConnectionRules::s_lastGeneration = 0;
+
+ConnectionRules::Match::Match()
+	:bestAllowAsOutput(STRENGTH_NONE)
+	,bestAllowAsInput(STRENGTH_NONE)
+{
+}
+
+ConnectionRules::ConnectionRules()
+	:m_generation(0)
+	,m_compiledGeneration(0)
+{
+}
+
+ConnectionRules::MatchCollector::MatchCollector(const ImageArray<uint32_t> &sidesBegin, const ImageArray<uint32_t> &sides, Match &result, const Match *filter)
+	:m_sidesBegin(sidesBegin)
+	,m_sides(sides)
+	,m_result(result)
+	,m_filter(filter)
+{
+}
+
+void ConnectionRules::MatchCollector::operator ()(int patternId)
+{
+	for (uint32_t i=m_sidesBegin[patternId]; i<m_sidesBegin[patternId+1]; ++i)
+	{
+		uint32_t side = m_sides[i];
+		uint32_t rule = side >> 1;
+		if (m_filter && !((side & 1) ? bitsTest(m_filter->inputBits, rule) : bitsTest(m_filter->outputBits, rule)))
+			continue;
+
+		bitsSet((side & 1) ? m_result.inputBits : m_result.outputBits, rule);
+	}
+}
+
+ConnectionRules::SectionCollector::SectionCollector(const ImageArray<uint32_t> &sidesBegin, const ImageArray<uint32_t> &sides, uint32_t *first)
+	:m_sidesBegin(sidesBegin)
+	,m_sides(sides)
+	,m_first(first)
+{
+}
+
+void ConnectionRules::SectionCollector::operator ()(int patternId)
+{
+	for (uint32_t i=m_sidesBegin[patternId]; i<m_sidesBegin[patternId+1]; ++i)
+	{
+		uint32_t side = m_sides[i];
+		uint32_t &first = m_first[side & 3];
+		first = std::min(first, side >> 2);
+	}
+}
+
+// Returns false if there's no port pattern. A client pattern that is a regular
+// expression may contain colons, it ends at the first "/:".
+bool ConnectionRules::splitSide(const char *side, std::string &client, std::string &port)
+{
+	const char *colon;
+	if (side[0] == '/')
+	{
+		colon = strstr(side + 1, "/:");
+		if (colon)
+			++colon;
+	}
+	else
+	{
+		colon = strchr(side, ':');
+	}
+
+	if (!colon)
+	{
+		client = side;
+		port.clear();
+		return false;
+	}
+
+	client.assign(side, colon);
+	port = colon + 1;
+	return true;
+}
+
+bool ConnectionRules::isValidSide(const char *side)
+{
+	std::string client, port;
+	if (!splitSide(side, client, port))
+		return client == "*" || PatternSet::isValid(client);
+
+	if (client != "*" && !PatternSet::isValid(client))
+		return false;
+
+	// Any port of any client is written as a lone "*".
+	return port == "*" ? client != "*" : PatternSet::isValid(port);
+}
+
+bool ConnectionRules::addRule(Type type, const char * output, const char * input)
+{
+	if (!output || !input || type == TYPE_UNKNOWN)
+		return false;
+
+	if (!isValidSide(output) || !isValidSide(input))
+		return false;
+
+	logPrintf(LOG_LEVEL_INFO, "%s '%s' -> '%s'", type == TYPE_ALLOW ? "Allowing" : "Disallowing", output, input);
+
+	insertRule(type, output, input);
+
+	return true;
+}
+
+uint32_t ConnectionRules::addName(const char *name)
+{
+	std::vector<char> &names = m_names.edit();
+
+	uint32_t offset = names.size();
+	names.insert(names.end(), name, name + strlen(name) + 1);
+	return offset;
+}
+
+const char *ConnectionRules::getName(uint32_t offset) const
+{
+	return &m_names[offset];
+}
+
+void ConnectionRules::insertRule(Type type, const char *output, const char *input)
+{
+	rule_t rule;
+	rule.type = type;
+	rule.output = addName(output);
+	rule.input = addName(input);
+
+	// Graded on the client patterns, a side naming a port of any client is still a wildcard.
+	std::string client, port;
+	splitSide(output, client, port);
+	bool outputWildcard = client == "*";
+	splitSide(input, client, port);
+	bool inputWildcard = client == "*";
+
+	if (outputWildcard && inputWildcard)
+		rule.strength = STRENGTH_VERY_VAGUE;
+	else if (outputWildcard || inputWildcard)
+		rule.strength = STRENGTH_VAGUE;
+	else
+		rule.strength = STRENGTH_SPECIFIC;
+
+	m_rules.edit().push_back(rule);
+
+	size_t words = (m_rules.size() + 31) / 32;
+	for (int t=0; t<2; ++t)
+	{
+		for (int i=0; i<=STRENGTH_SPECIFIC; ++i)
+		{
+			m_masks[t][i].edit().resize(words, 0);
+		}
+	}
+
+	bitsSet(m_masks[type][rule.strength].edit(), m_rules.size() - 1);
+
+	m_generation = ++s_lastGeneration;
+}
+
+bool ConnectionRules::hasRules() const
+{
+	return !m_rules.empty();
+}
+
+unsigned ConnectionRules::getGeneration() const
+{
+	return m_generation;
+}
+
+void ConnectionRules::diff(const ConnectionRules &other, ConnectionRules &changes) const
+{
+	typedef std::multiset<std::pair<int, std::pair<std::string, std::string> > > set_t;
+
+	set_t a, b;
+
+	for (rules_t::const_iterator itr = m_rules.begin(); itr != m_rules.end(); ++itr)
+		a.insert(std::make_pair((int)itr->type, std::make_pair(std::string(getName(itr->output)), std::string(getName(itr->input)))));
+
+	for (rules_t::const_iterator itr = other.m_rules.begin(); itr != other.m_rules.end(); ++itr)
+		b.insert(std::make_pair((int)itr->type, std::make_pair(std::string(other.getName(itr->output)), std::string(other.getName(itr->input)))));
+
+	std::vector<set_t::value_type> difference;
+	std::set_symmetric_difference(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(difference));
+
+	for (size_t i=0; i<difference.size(); ++i)
+		changes.insertRule(TYPE_ALLOW, difference[i].second.first.c_str(), difference[i].second.second.c_str());
+
+	changes.compile();
+}
+
+void ConnectionRules::compile()
+{
+	size_t words = (m_rules.size() + 31) / 32;
+
+	bits_t &wildcardOutputs = m_wildcardOutputs.edit();
+	bits_t &wildcardInputs = m_wildcardInputs.edit();
+	bits_t &portOutputs = m_portOutputs.edit();
+	bits_t &portInputs = m_portInputs.edit();
+
+	wildcardOutputs.assign(words, 0);
+	wildcardInputs.assign(words, 0);
+	portOutputs.assign(words, 0);
+	portInputs.assign(words, 0);
+
+	// [0] for the client patterns, [1] for the port patterns.
+	PatternSides sides[2];
+
+	for (size_t i=0; i<m_rules.size(); ++i)
+	{
+		const char *names[2] = { getName(m_rules[i].output), getName(m_rules[i].input) };
+
+		for (int j=0; j<2; ++j)
+		{
+			uint32_t side = (i << 1) | j;
+
+			std::string client, port;
+			splitSide(names[j], client, port);
+
+			if (client == "*")
+				bitsSet(j ? wildcardInputs : wildcardOutputs, i);
+			else
+				sides[0].add(client, side);
+
+			// Any port is the same as no port pattern.
+			if (!port.empty() && port != "*")
+			{
+				bitsSet(j ? portInputs : portOutputs, i);
+				sides[1].add(port, side);
+			}
+		}
+	}
+
+	sides[0].flatten(m_patternSidesBegin.edit(), m_patternSides.edit());
+	sides[1].flatten(m_portSidesBegin.edit(), m_portSides.edit());
+
+	m_clientPatterns.build(sides[0].patterns);
+	m_portPatterns.build(sides[1].patterns);
+
+	// Any client is taken care of by matchSections() directly.
+	PatternSides sections;
+
+	for (int s=0; s<SECTION_COUNT; ++s)
+	{
+		for (size_t i=0; i<getSectionSize((Section)s); ++i)
+		{
+			const char *client = getName(getSectionClient((Section)s, i));
+			if (strcmp(client, "*") != 0)
+				sections.add(client, (i << 2) | s);
+		}
+	}
+
+	sections.flatten(m_sectionSidesBegin.edit(), m_sectionSides.edit());
+	m_sectionPatterns.build(sections.patterns);
+
+	m_compiledGeneration = m_generation;
+}
+
+void ConnectionRules::PatternSides::add(const std::string &pattern, uint32_t side)
+{
+	ids_t::iterator item = ids.find(pattern);
+	if (item == ids.end())
+	{
+		item = ids.insert(std::make_pair(pattern, (int)patterns.size())).first;
+		patterns.push_back(pattern);
+		sides.push_back(std::vector<uint32_t>());
+	}
+
+	sides[item->second].push_back(side);
+}
+
+void ConnectionRules::PatternSides::flatten(std::vector<uint32_t> &sidesBegin, std::vector<uint32_t> &flat) const
+{
+	sidesBegin.clear();
+	flat.clear();
+
+	for (size_t i=0; i<sides.size(); ++i)
+	{
+		sidesBegin.push_back(flat.size());
+		flat.insert(flat.end(), sides[i].begin(), sides[i].end());
+	}
+	sidesBegin.push_back(flat.size());
+}
+
+void ConnectionRules::match(int clientId, const char *name, Match &result) const
+{
+	assert(m_compiledGeneration == m_generation);
+
+	result.outputBits.assign(m_wildcardOutputs.begin(), m_wildcardOutputs.end());
+	result.inputBits.assign(m_wildcardInputs.begin(), m_wildcardInputs.end());
+
+	MatchCollector collector(m_patternSidesBegin, m_patternSides, result, NULL);
+	m_clientPatterns.match(clientId, name, collector);
+
+	result.bestAllowAsOutput = getStrongest(TYPE_ALLOW, result.outputBits);
+	result.bestAllowAsInput = getStrongest(TYPE_ALLOW, result.inputBits);
+}
+
+bool ConnectionRules::hasPortRules() const
+{
+	return !m_portSides.empty();
+}
+
+void ConnectionRules::matchPort(const Match &client, int port, const char *portName, Match &result) const
+{
+	assert(m_compiledGeneration == m_generation);
+
+	// The sides with a port pattern are set again only if the client matched them too.
+	result.outputBits = client.outputBits;
+	result.inputBits = client.inputBits;
+
+	for (size_t i=0; i<result.outputBits.size(); ++i)
+	{
+		result.outputBits[i] &= ~m_portOutputs[i];
+		result.inputBits[i] &= ~m_portInputs[i];
+	}
+
+	MatchCollector collector(m_portSidesBegin, m_portSides, result, &client);
+	m_portPatterns.match(port, portName, collector);
+
+	result.bestAllowAsOutput = getStrongest(TYPE_ALLOW, result.outputBits);
+	result.bestAllowAsInput = getStrongest(TYPE_ALLOW, result.inputBits);
+}
+
+void ConnectionRules::reserve(Match &result) const
+{
+	result.outputBits.reserve(m_wildcardOutputs.size());
+	result.inputBits.reserve(m_wildcardInputs.size());
+}
+
+bool ConnectionRules::isConnectionAllowed(const Match &output, const Match &input, Strength minimumStrength) const
+{
+	if (output.bestAllowAsOutput < minimumStrength || input.bestAllowAsInput < minimumStrength)
+		return false;
+
+	Strength allowStrength = evaluate(TYPE_ALLOW, output, input);
+	if (allowStrength < minimumStrength)
+		return false;
+
+	Strength disallowStrength = evaluate(TYPE_DISALLOW, output, input);
+
+	return allowStrength >= disallowStrength;
+}
+
+ConnectionRules::Strength ConnectionRules::evaluate(Type type, const Match &output, const Match &input) const
+{
+	assert(output.outputBits.size() == m_masks[type][0].size());
+	assert(input.inputBits.size() == m_masks[type][0].size());
+
+	for (int s=STRENGTH_SPECIFIC; s>STRENGTH_NONE; --s)
+	{
+		const ImageArray<uint32_t> &mask = m_masks[type][s];
+
+		for (size_t i=0; i<mask.size(); ++i)
+		{
+			if (output.outputBits[i] & input.inputBits[i] & mask[i])
+				return (Strength)s;
+		}
+	}
+
+	return STRENGTH_NONE;
+}
+
+int ConnectionRules::findRule(Type type, Strength strength, const Match &output, const Match &input) const
+{
+	if (strength == STRENGTH_NONE)
+		return -1;
+
+	const ImageArray<uint32_t> &mask = m_masks[type][strength];
+
+	for (size_t i=0; i<mask.size(); ++i)
+	{
+		uint32_t bits = output.outputBits[i] & input.inputBits[i] & mask[i];
+		if (bits)
+			return i * 32 + __builtin_ctz(bits);
+	}
+
+	return -1;
+}
+
+void ConnectionRules::explain(const Match &output, const Match &input, Strength minimumStrength, Verdict &verdict) const
+{
+	verdict.allowStrength = evaluate(TYPE_ALLOW, output, input);
+	verdict.disallowStrength = evaluate(TYPE_DISALLOW, output, input);
+	verdict.allowRule = findRule(TYPE_ALLOW, verdict.allowStrength, output, input);
+	verdict.disallowRule = findRule(TYPE_DISALLOW, verdict.disallowStrength, output, input);
+	verdict.allowed = verdict.allowStrength >= minimumStrength && verdict.allowStrength >= verdict.disallowStrength;
+}
+
+bool ConnectionRules::getRule(int n, Type &type, const char *&output, const char *&input) const
+{
+	if (n < 0 || (size_t)n >= m_rules.size())
+		return false;
+
+	type = m_rules[n].type;
+	output = getName(m_rules[n].output);
+	input = getName(m_rules[n].input);
+
+	return true;
+}
+
+ConnectionRules::PortPolicy::PortPolicy()
+	:selection(SELECT_FIRST)
+	,count(1)
+	,fanout(0)
+{
+}
+
+bool ConnectionRules::addPortPolicy(const char *client, const PortPolicy &policy, const char *port)
+{
+	if (!isValidClient(client))
+		return false;
+
+	switch (policy.selection)
+	{
+	case SELECT_ALL:
+		logPrintf(LOG_LEVEL_INFO, "Selecting all ports of '%s'", client);
+		break;
+	case SELECT_MAX:
+		logPrintf(LOG_LEVEL_INFO, "Selecting up to %u ports of '%s'", policy.count, client);
+		break;
+	case SELECT_NAME:
+		logPrintf(LOG_LEVEL_INFO, "Selecting ports of '%s' named like '%s'", client, port ? port : "");
+		break;
+	case SELECT_FIRST:
+	default:
+		logPrintf(LOG_LEVEL_INFO, "Selecting the first ports of '%s'", client);
+		break;
+	}
+
+	if (policy.fanout != 0)
+		logPrintf(LOG_LEVEL_INFO, "Linking each output of '%s' to at most %u inputs", client, policy.fanout);
+
+	port_policy_t p;
+	p.client = addName(client);
+	p.port = addName(policy.selection == SELECT_NAME && port ? port : "");
+	p.policy = policy;
+
+	m_portPolicies.edit().push_back(p);
+
+	m_generation = ++s_lastGeneration;
+
+	return true;
+}
+
+bool ConnectionRules::isValidClient(const char *client)
+{
+	return strcmp(client, "*") == 0 || PatternSet::isValid(client);
+}
+
+size_t ConnectionRules::getSectionSize(Section section) const
+{
+	switch (section)
+	{
+	case SECTION_PORTS:    return m_portPolicies.size();
+	case SECTION_LIMITS:   return m_rateLimits.size();
+	case SECTION_THRU:     return m_thru.size();
+	case SECTION_PRIORITY: return m_priorities.size();
+	default:               return 0;
+	}
+}
+
+uint32_t ConnectionRules::getSectionClient(Section section, uint32_t line) const
+{
+	switch (section)
+	{
+	case SECTION_PORTS:    return m_portPolicies[line].client;
+	case SECTION_LIMITS:   return m_rateLimits[line].client;
+	case SECTION_THRU:     return m_thru[line];
+	case SECTION_PRIORITY: return m_priorities[line].client;
+	default:               return 0;
+	}
+}
+
+void ConnectionRules::matchSections(int clientId, const char *clientName, SectionMatch &result) const
+{
+	assert(m_compiledGeneration == m_generation);
+
+	uint32_t first[SECTION_COUNT];
+
+	for (int s=0; s<SECTION_COUNT; ++s)
+	{
+		size_t size = getSectionSize((Section)s);
+
+		first[s] = size;
+		for (size_t i=0; i<size; ++i)
+		{
+			if (strcmp(getName(getSectionClient((Section)s, i)), "*") == 0)
+			{
+				first[s] = i;
+				break;
+			}
+		}
+	}
+
+	SectionCollector collector(m_sectionSidesBegin, m_sectionSides, first);
+	m_sectionPatterns.match(clientId, clientName, collector);
+
+	result.portPolicy = first[SECTION_PORTS] < m_portPolicies.size() ? (int)first[SECTION_PORTS] : -1;
+	result.rateLimit = first[SECTION_LIMITS] < m_rateLimits.size() ? (int)first[SECTION_LIMITS] : -1;
+	result.thru = first[SECTION_THRU] < m_thru.size();
+	result.priority = first[SECTION_PRIORITY] < m_priorities.size() ? m_priorities[first[SECTION_PRIORITY]].priority : 0;
+}
+
+bool ConnectionRules::isPortSelected(int policy, const char *portName, size_t selectedCount) const
+{
+	return hasPortRoom(policy, selectedCount) && isPortNameSelected(policy, portName);
+}
+
+bool ConnectionRules::isPortNameSelected(int policy, const char *portName) const
+{
+	if (policy < 0 || (size_t)policy >= m_portPolicies.size())
+		return true;
+
+	const port_policy_t &p = m_portPolicies[policy];
+
+	return p.policy.selection != SELECT_NAME || strstr(portName, getName(p.port)) != NULL;
+}
+
+bool ConnectionRules::hasPortRoom(int policy, size_t selectedCount) const
+{
+	if (policy < 0 || (size_t)policy >= m_portPolicies.size())
+		return selectedCount == 0;
+
+	const port_policy_t &p = m_portPolicies[policy];
+
+	switch (p.policy.selection)
+	{
+	case SELECT_ALL:
+	case SELECT_NAME:
+		return true;
+	case SELECT_MAX:
+		return selectedCount < p.policy.count;
+	case SELECT_FIRST:
+	default:
+		return selectedCount == 0;
+	}
+}
+
+unsigned ConnectionRules::getFanout(int policy) const
+{
+	if (policy < 0 || (size_t)policy >= m_portPolicies.size())
+		return 0;
+
+	return m_portPolicies[policy].policy.fanout;
+}
+
+bool ConnectionRules::hasSamePortPolicies(const ConnectionRules &other) const
+{
+	if (m_portPolicies.size() != other.m_portPolicies.size())
+		return false;
+
+	for (size_t i=0; i<m_portPolicies.size(); ++i)
+	{
+		const port_policy_t &a = m_portPolicies[i];
+		const port_policy_t &b = other.m_portPolicies[i];
+
+		if (a.policy.selection != b.policy.selection || a.policy.count != b.policy.count || a.policy.fanout != b.policy.fanout)
+			return false;
+
+		if (strcmp(getName(a.client), other.getName(b.client)) != 0 || strcmp(getName(a.port), other.getName(b.port)) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+ConnectionRules::RateLimit::RateLimit()
+	:eventsPerSecond(0)
+	,holdSeconds(10)
+{
+}
+
+bool ConnectionRules::addRateLimit(const char *client, const RateLimit &limit)
+{
+	if (!isValidClient(client))
+		return false;
+
+	if (limit.holdSeconds != 0)
+		logPrintf(LOG_LEVEL_INFO, "Limiting '%s' to %u events/s, throttling for %u s", client, limit.eventsPerSecond, limit.holdSeconds);
+	else
+		logPrintf(LOG_LEVEL_INFO, "Limiting '%s' to %u events/s, disconnecting", client, limit.eventsPerSecond);
+
+	rate_limit_t r;
+	r.client = addName(client);
+	r.limit = limit;
+
+	m_rateLimits.edit().push_back(r);
+
+	m_generation = ++s_lastGeneration;
+
+	return true;
+}
+
+const ConnectionRules::RateLimit &ConnectionRules::getRateLimit(int limit) const
+{
+	assert(limit >= 0 && (size_t)limit < m_rateLimits.size());
+	return m_rateLimits[limit].limit;
+}
+
+bool ConnectionRules::hasRateLimits() const
+{
+	return !m_rateLimits.empty();
+}
+
+bool ConnectionRules::hasSameRateLimits(const ConnectionRules &other) const
+{
+	if (m_rateLimits.size() != other.m_rateLimits.size())
+		return false;
+
+	for (size_t i=0; i<m_rateLimits.size(); ++i)
+	{
+		const rate_limit_t &a = m_rateLimits[i];
+		const rate_limit_t &b = other.m_rateLimits[i];
+
+		if (a.limit.eventsPerSecond != b.limit.eventsPerSecond || a.limit.holdSeconds != b.limit.holdSeconds)
+			return false;
+
+		if (strcmp(getName(a.client), other.getName(b.client)) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+bool ConnectionRules::addThru(const char *client)
+{
+	if (!isValidClient(client))
+		return false;
+
+	logPrintf(LOG_LEVEL_INFO, "Treating '%s' as passing its input through", client);
+
+	m_thru.edit().push_back(addName(client));
+
+	m_generation = ++s_lastGeneration;
+
+	return true;
+}
+
+bool ConnectionRules::hasSameThru(const ConnectionRules &other) const
+{
+	if (m_thru.size() != other.m_thru.size())
+		return false;
+
+	for (size_t i=0; i<m_thru.size(); ++i)
+	{
+		if (strcmp(getName(m_thru[i]), other.getName(other.m_thru[i])) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+bool ConnectionRules::addPriority(const char *client, int priority)
+{
+	if (!isValidClient(client))
+		return false;
+
+	logPrintf(LOG_LEVEL_INFO, "Connecting '%s' at priority %d", client, priority);
+
+	priority_t p;
+	p.client = addName(client);
+	p.priority = priority;
+
+	m_priorities.edit().push_back(p);
+
+	m_generation = ++s_lastGeneration;
+
+	return true;
+}
+
+bool ConnectionRules::hasSamePriorities(const ConnectionRules &other) const
+{
+	if (m_priorities.size() != other.m_priorities.size())
+		return false;
+
+	for (size_t i=0; i<m_priorities.size(); ++i)
+	{
+		const priority_t &a = m_priorities[i];
+		const priority_t &b = other.m_priorities[i];
+
+		if (a.priority != b.priority || strcmp(getName(a.client), other.getName(b.client)) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+void ConnectionRules::writeImage(ImageWriter &writer) const
+{
+	assert(m_compiledGeneration == m_generation);
+
+	writer.writeArray(m_names);
+	writer.writeArray(m_rules);
+	writer.writeArray(m_portPolicies);
+	writer.writeArray(m_rateLimits);
+	writer.writeArray(m_thru);
+	writer.writeArray(m_priorities);
+
+	for (int t=0; t<2; ++t)
+	{
+		for (int i=0; i<=STRENGTH_SPECIFIC; ++i)
+			writer.writeArray(m_masks[t][i]);
+	}
+
+	writer.writeArray(m_wildcardOutputs);
+	writer.writeArray(m_wildcardInputs);
+	writer.writeArray(m_portOutputs);
+	writer.writeArray(m_portInputs);
+	writer.writeArray(m_patternSidesBegin);
+	writer.writeArray(m_patternSides);
+	writer.writeArray(m_portSidesBegin);
+	writer.writeArray(m_portSides);
+
+	writer.writeArray(m_sectionSidesBegin);
+	writer.writeArray(m_sectionSides);
+
+	m_clientPatterns.write(writer);
+	m_portPatterns.write(writer);
+	m_sectionPatterns.write(writer);
+}
+
+bool ConnectionRules::readImage(ImageReader &reader)
+{
+	bool ok = reader.readArray(m_names) && reader.readArray(m_rules) && reader.readArray(m_portPolicies) && reader.readArray(m_rateLimits) && reader.readArray(m_thru) && reader.readArray(m_priorities);
+
+	for (int t=0; t<2 && ok; ++t)
+	{
+		for (int i=0; i<=STRENGTH_SPECIFIC && ok; ++i)
+			ok = reader.readArray(m_masks[t][i]);
+	}
+
+	ok = ok && reader.readArray(m_wildcardOutputs) && reader.readArray(m_wildcardInputs) && reader.readArray(m_portOutputs) && reader.readArray(m_portInputs);
+	ok = ok && reader.readArray(m_patternSidesBegin) && reader.readArray(m_patternSides) && reader.readArray(m_portSidesBegin) && reader.readArray(m_portSides);
+	ok = ok && reader.readArray(m_sectionSidesBegin) && reader.readArray(m_sectionSides);
+	ok = ok && isConsistent() && m_clientPatterns.read(reader, m_patternSidesBegin.size() - 1) && m_portPatterns.read(reader, m_portSidesBegin.size() - 1);
+	ok = ok && m_sectionPatterns.read(reader, m_sectionSidesBegin.size() - 1) && reader.isAtEnd();
+
+	if (!ok)
+	{
+		*this = ConnectionRules();
+		return false;
+	}
+
+	m_generation = ++s_lastGeneration;
+	m_compiledGeneration = m_generation;
+
+	return true;
+}
+
+void ConnectionRules::keepImage(const ImageMapping &mapping)
+{
+	m_image = mapping;
+}
+
+bool ConnectionRules::isName(uint32_t offset) const
+{
+	return offset < m_names.size();
+}
+
+// Checks that every index within the tables is in range, for reading an image.
+bool ConnectionRules::isConsistent() const
+{
+	if (!m_names.empty() && m_names.back() != '\0')
+		return false;
+
+	for (size_t i=0; i<m_rules.size(); ++i)
+	{
+		const rule_t &rule = m_rules[i];
+		if ((rule.type != TYPE_ALLOW && rule.type != TYPE_DISALLOW) || rule.strength < STRENGTH_VERY_VAGUE || rule.strength > STRENGTH_SPECIFIC)
+			return false;
+		if (!isName(rule.output) || !isName(rule.input))
+			return false;
+	}
+
+	for (size_t i=0; i<m_portPolicies.size(); ++i)
+	{
+		const port_policy_t &policy = m_portPolicies[i];
+		if (!isName(policy.client) || !isName(policy.port) || policy.policy.selection < SELECT_FIRST || policy.policy.selection > SELECT_NAME)
+			return false;
+	}
+
+	for (size_t i=0; i<m_rateLimits.size(); ++i)
+	{
+		if (!isName(m_rateLimits[i].client))
+			return false;
+	}
+
+	for (size_t i=0; i<m_thru.size(); ++i)
+	{
+		if (!isName(m_thru[i]))
+			return false;
+	}
+
+	for (size_t i=0; i<m_priorities.size(); ++i)
+	{
+		if (!isName(m_priorities[i].client))
+			return false;
+	}
+
+	size_t words = (m_rules.size() + 31) / 32;
+
+	for (int t=0; t<2; ++t)
+	{
+		for (int i=0; i<=STRENGTH_SPECIFIC; ++i)
+		{
+			if (m_masks[t][i].size() != words)
+				return false;
+		}
+	}
+
+	if (m_wildcardOutputs.size() != words || m_wildcardInputs.size() != words || m_portOutputs.size() != words || m_portInputs.size() != words)
+		return false;
+
+	if (!isConsistent(m_patternSidesBegin, m_patternSides, m_rules.size()) || !isConsistent(m_portSidesBegin, m_portSides, m_rules.size()))
+		return false;
+
+	if (!isConsistent(m_sectionSidesBegin, m_sectionSides, SIZE_MAX))
+		return false;
+
+	for (size_t i=0; i<m_sectionSides.size(); ++i)
+	{
+		uint32_t side = m_sectionSides[i];
+		if ((side & 3) >= SECTION_COUNT || (side >> 2) >= getSectionSize((Section)(side & 3)))
+			return false;
+	}
+
+	return true;
+}
+
+bool ConnectionRules::isConsistent(const ImageArray<uint32_t> &sidesBegin, const ImageArray<uint32_t> &sides, size_t ruleCount)
+{
+	if (sidesBegin.empty() || sidesBegin[0] != 0 || sidesBegin.back() != sides.size())
+		return false;
+
+	for (size_t i=1; i<sidesBegin.size(); ++i)
+	{
+		if (sidesBegin[i] < sidesBegin[i-1])
+			return false;
+	}
+
+	for (size_t i=0; i<sides.size(); ++i)
+	{
+		if ((sides[i] >> 1) >= ruleCount)
+			return false;
+	}
+
+	return true;
+}
+
+ConnectionRules::Strength ConnectionRules::getStrongest(Type type, const bits_t &bits) const
+{
+	for (int s=STRENGTH_SPECIFIC; s>STRENGTH_NONE; --s)
+	{
+		const ImageArray<uint32_t> &mask = m_masks[type][s];
+
+		for (size_t i=0; i<mask.size(); ++i)
+		{
+			if (bits[i] & mask[i])
+				return (Strength)s;
+		}
+	}
+
+	return STRENGTH_NONE;
+}
+
+#ifndef AMIDIAUTO_GENERATOR
+static ConnectionRules g_rules;
+
+// Keeps the names of the sequencer clients together with their rule matches,
+// so rule evaluation does not have to query the sequencer or compare strings
+// for every candidate pair of ports.
+class ClientInfoCache
+{
+public:
+	struct ClientInfo
+	{
+		char name[MAX_NAME];
+		ConnectionRules::Match match;
+
+		// See ConnectionRules::matchSections().
+		int portPolicy;
+		int rateLimit;
+		bool thru;
+		int priority;
+
+		unsigned generation;
+
+		// Changes whenever match does, unique among all clients, for caching what's derived from it.
+		unsigned serial;
+	};
+
+	ClientInfoCache();
+
+	// Returns NULL if the client does not exist.
+	const ClientInfo *get(int clientId);
+
+	// Like get(), but never queries the sequencer, returns NULL if the client is not cached.
+	const ClientInfo *find(int clientId);
+
+	void set(int clientId, const char *name);
+	void invalidate(int clientId);
+	void clear();
+
+private:
+	struct Entry
+	{
+		Entry();
+
+		bool valid;
+		ClientInfo info;
+	};
+
+	void update(int clientId, ClientInfo &info);
+
+	Entry m_clients[MAX_CLIENTS];
+
+	// Rules generation the match bits of all entries were sized for.
+	unsigned m_reservedGeneration;
+
+	unsigned m_lastSerial;
+};
+
+ClientInfoCache::Entry::Entry()
+	:valid(false)
+{
+	info.name[0] = '\0';
+	info.portPolicy = -1;
+	info.rateLimit = -1;
+	info.thru = false;
+	info.priority = 0;
+	info.generation = 0;
+	info.serial = 0;
+}
+
+ClientInfoCache::ClientInfoCache()
+	:m_reservedGeneration(0)
+	,m_lastSerial(0)
+{
+}
+
+void ClientInfoCache::update(int clientId, ClientInfo &info)
+{
+	// Sized all at once on a rule change, so a client appearing later does not allocate.
+	if (m_reservedGeneration != g_rules.getGeneration())
+	{
+		for (int i=0; i<MAX_CLIENTS; ++i)
+			g_rules.reserve(m_clients[i].info.match);
+
+		m_reservedGeneration = g_rules.getGeneration();
+	}
+
+	g_rules.match(clientId, info.name, info.match);
+	ConnectionRules::SectionMatch sections;
+	g_rules.matchSections(clientId, info.name, sections);
+	info.portPolicy = sections.portPolicy;
+	info.rateLimit = sections.rateLimit;
+	info.thru = sections.thru;
+	info.priority = sections.priority;
+	info.generation = g_rules.getGeneration();
+	info.serial = ++m_lastSerial;
+}
+
+const ClientInfoCache::ClientInfo *ClientInfoCache::get(int clientId)
+{
+	if (clientId < 0 || clientId >= MAX_CLIENTS)
+		return NULL;
+
+	Entry &entry = m_clients[clientId];
+
+	if (!entry.valid)
+	{
+		snd_seq_client_info_t *clientInfo;
+		snd_seq_client_info_alloca(&clientInfo);
+		++g_stats.syscalls;
+		if (g_backend->getClientInfo(clientId, clientInfo) < 0)
+			return NULL;
+
+		const char *name = snd_seq_client_info_get_name(clientInfo);
+		if (!name)
+			return NULL;
+
+		entry.valid = true;
+		copyName(entry.info.name, name);
+		update(clientId, entry.info);
+	}
+	else if (entry.info.generation != g_rules.getGeneration())
+	{
+		update(clientId, entry.info);
+	}
+
+	return &entry.info;
+}
+
+const ClientInfoCache::ClientInfo *ClientInfoCache::find(int clientId)
+{
+	if (clientId < 0 || clientId >= MAX_CLIENTS || !m_clients[clientId].valid)
+		return NULL;
+
+	return get(clientId);
+}
+
+void ClientInfoCache::set(int clientId, const char *name)
+{
+	if (clientId < 0 || clientId >= MAX_CLIENTS)
+		return;
+
+	Entry &entry = m_clients[clientId];
+
+	if (!name)
+	{
+		entry.valid = false;
+		return;
+	}
+
+	if (!entry.valid || strncmp(entry.info.name, name, MAX_NAME - 1) != 0 || entry.info.generation != g_rules.getGeneration())
+	{
+		entry.valid = true;
+		copyName(entry.info.name, name);
+		update(clientId, entry.info);
+	}
+}
+
+void ClientInfoCache::invalidate(int clientId)
+{
+	if (clientId >= 0 && clientId < MAX_CLIENTS)
+		m_clients[clientId].valid = false;
+}
+
+void ClientInfoCache::clear()
+{
+	for (int i=0; i<MAX_CLIENTS; ++i)
+		m_clients[i].valid = false;
+}
+
+static ClientInfoCache g_clientInfo;
+
+enum ClientType
+{
+	CLIENT_SOFTWARE,
+	CLIENT_HARDWARE
+};
+
+enum EndpointDir
+{
+	ENDPOINT_OUTPUT = 0,
+	ENDPOINT_INPUT  = 1,
+};
+
+enum
+{
+	// Most ports of one client tracked per direction.
+	MAX_CLIENT_PORTS = 16,
+
+	// Most ports tracked per direction in total.
+#ifndef AMIDIAUTO_TINY
+	MAX_ENDPOINTS = 512,
+#else
+	MAX_ENDPOINTS = 128,
+#endif
+};
+
+// Keeps track of the ports of a client that get connected, by default one input
+// and one output port. This is to try and keep things simple and app performance
+// under control. For example, some software may create many input ports, all for
+// the same function, if a MIDI note gets sent to all of them, that will cause many
+// duplicate notes to be played. The [ports] section of the rules can select more
+// ports of a client and limit the fan-out of its outputs, see ConnectionRules::PortPolicy.
+class Client
+{
+public:
+	Client();
+	Client(int clientId, ClientType type);
+
+	int getId() const;
+	ClientType getType() const;
+
+	// The tracked ports as endpoint ids, see EndpointTable, in the order they got selected.
+	size_t getEndpointCount(EndpointDir dir) const;
+	int getEndpoint(EndpointDir dir, size_t i) const;
+
+	// Returns the endpoint id of the port, -1 if it is not tracked.
+	int findEndpoint(EndpointDir dir, int port) const;
+
+	void addEndpoint(EndpointDir dir, int port, int endpointId);
+	void removeEndpoint(EndpointDir dir, int port);
+
+	// Ports that would be selected if there was room, in the order they appeared.
+	// When a tracked port exits, the first ones get promoted in its place.
+	size_t getCandidateCount(EndpointDir dir) const;
+	int getCandidate(EndpointDir dir, size_t i) const;
+
+	// Returns false if the list is full.
+	bool addCandidate(EndpointDir dir, int port);
+	void removeCandidate(EndpointDir dir, int port);
+
+	bool operator <(const Client &rhs) const;
+
+private:
+	static bool removePort(uint8_t *ports, int16_t *endpoints, uint8_t &count, int port);
+
+	int m_clientId;
+	ClientType m_type;
+
+	uint8_t m_ports[2][MAX_CLIENT_PORTS];
+	int16_t m_endpoints[2][MAX_CLIENT_PORTS];
+	uint8_t m_endpointCount[2];
+
+	uint8_t m_candidates[2][MAX_CLIENT_PORTS];
+	uint8_t m_candidateCount[2];
+};
+
+Client::Client()
+	:m_clientId(-1)
+	,m_type(CLIENT_SOFTWARE)
+{
+	m_endpointCount[ENDPOINT_OUTPUT] = 0;
+	m_endpointCount[ENDPOINT_INPUT] = 0;
+	m_candidateCount[ENDPOINT_OUTPUT] = 0;
+	m_candidateCount[ENDPOINT_INPUT] = 0;
+}
+
+Client::Client(int clientId, ClientType type)
+	:m_clientId(clientId)
+	,m_type(type)
+{
+	m_endpointCount[ENDPOINT_OUTPUT] = 0;
+	m_endpointCount[ENDPOINT_INPUT] = 0;
+	m_candidateCount[ENDPOINT_OUTPUT] = 0;
+	m_candidateCount[ENDPOINT_INPUT] = 0;
+}
+
+int Client::getId() const
+{
+	return m_clientId;
+}
+
+ClientType Client::getType() const
+{
+	return m_type;
+}
+
+size_t Client::getEndpointCount(EndpointDir dir) const
+{
+	return m_endpointCount[dir];
+}
+
+int Client::getEndpoint(EndpointDir dir, size_t i) const
+{
+	assert(i < m_endpointCount[dir]);
+	return m_endpoints[dir][i];
+}
+
+int Client::findEndpoint(EndpointDir dir, int port) const
+{
+	for (size_t i=0; i<m_endpointCount[dir]; ++i)
+	{
+		if (m_ports[dir][i] == port)
+			return m_endpoints[dir][i];
+	}
+
+	return -1;
+}
+
+void Client::addEndpoint(EndpointDir dir, int port, int endpointId)
+{
+	assert(m_endpointCount[dir] < MAX_CLIENT_PORTS);
+
+	m_ports[dir][m_endpointCount[dir]] = port;
+	m_endpoints[dir][m_endpointCount[dir]] = endpointId;
+	++m_endpointCount[dir];
+}
+
+void Client::removeEndpoint(EndpointDir dir, int port)
+{
+	removePort(m_ports[dir], m_endpoints[dir], m_endpointCount[dir], port);
+}
+
+size_t Client::getCandidateCount(EndpointDir dir) const
+{
+	return m_candidateCount[dir];
+}
+
+int Client::getCandidate(EndpointDir dir, size_t i) const
+{
+	assert(i < m_candidateCount[dir]);
+	return m_candidates[dir][i];
+}
+
+bool Client::addCandidate(EndpointDir dir, int port)
+{
+	for (size_t i=0; i<m_candidateCount[dir]; ++i)
+	{
+		if (m_candidates[dir][i] == port)
+			return true;
+	}
+
+	if (m_candidateCount[dir] >= MAX_CLIENT_PORTS)
+		return false;
+
+	m_candidates[dir][m_candidateCount[dir]++] = port;
+	return true;
+}
+
+void Client::removeCandidate(EndpointDir dir, int port)
+{
+	removePort(m_candidates[dir], NULL, m_candidateCount[dir], port);
+}
+
+bool Client::removePort(uint8_t *ports, int16_t *endpoints, uint8_t &count, int port)
+{
+	for (size_t i=0; i<count; ++i)
+	{
+		if (ports[i] != port)
+			continue;
+
+		// Keeps the order.
+		memmove(&ports[i], &ports[i+1], (count - i - 1) * sizeof(ports[0]));
+		if (endpoints)
+			memmove(&endpoints[i], &endpoints[i+1], (count - i - 1) * sizeof(endpoints[0]));
+		--count;
+		return true;
+	}
+
+	return false;
+}
+
+bool Client::operator <(const Client &rhs) const
+{
+	return m_clientId < rhs.m_clientId;
+}
+
+// Tracked clients indexed by id, with a dense list of the active ids of each type for scanning.
+class ClientTable
+{
+public:
+	ClientTable();
+
+	// Returns the client, starting to track it as the given type if it was not yet.
+	// A client keeps the type it was first tracked as.
+	Client &get(int clientId, ClientType type);
+
+	// Returns NULL if the client is not tracked.
+	Client *find(int clientId);
+
+	void remove(int clientId);
+	void clear();
+
+	size_t count(ClientType type) const;
+	Client &at(ClientType type, size_t i);
+
+private:
+	Client m_clients[MAX_CLIENTS];
+
+	int16_t m_index[MAX_CLIENTS]; // Position within the dense list, or -1 if not tracked.
+
+	uint8_t m_active[2][MAX_CLIENTS];
+	uint16_t m_activeCount[2];
+};
+
+ClientTable::ClientTable()
+{
+	clear();
+}
+
+Client &ClientTable::get(int clientId, ClientType type)
+{
+	assert(clientId >= 0 && clientId < MAX_CLIENTS);
+
+	if (m_index[clientId] < 0)
+	{
+		m_clients[clientId] = Client(clientId, type);
+		m_index[clientId] = m_activeCount[type];
+		m_active[type][m_activeCount[type]++] = clientId;
+	}
+
+	return m_clients[clientId];
+}
+
+Client *ClientTable::find(int clientId)
+{
+	if (clientId < 0 || clientId >= MAX_CLIENTS || m_index[clientId] < 0)
+		return NULL;
+
+	return &m_clients[clientId];
+}
+
+void ClientTable::remove(int clientId)
+{
+	Client *client = find(clientId);
+	if (!client)
+		return;
+
+	ClientType type = client->getType();
+	int index = m_index[clientId];
+	int last = m_active[type][--m_activeCount[type]];
+
+	m_active[type][index] = last;
+	m_index[last] = index;
+	m_index[clientId] = -1;
+}
+
+void ClientTable::clear()
+{
+	memset(m_index, 0xff, sizeof(m_index));
+	m_activeCount[CLIENT_SOFTWARE] = 0;
+	m_activeCount[CLIENT_HARDWARE] = 0;
+}
+
+size_t ClientTable::count(ClientType type) const
+{
+	return m_activeCount[type];
+}
+
+Client &ClientTable::at(ClientType type, size_t i)
+{
+	assert(i < m_activeCount[type]);
+	return m_clients[m_active[type][i]];
+}
+
+static ClientTable g_clients;
+
+// The tracked ports of one direction by endpoint id. Ids are reused once freed
+// and stay below MAX_ENDPOINTS, so they can index dense tables like LinkMatrix.
+class EndpointTable
+{
+public:
+	EndpointTable();
+
+	// Returns the id of the new endpoint, -1 if the table is full.
+	int add(snd_seq_addr_t addr, const char *name);
+	void remove(int id);
+	void clear();
+
+	snd_seq_addr_t getAddr(int id) const;
+	const char *getName(int id) const;
+
+	// The match of the client narrowed down to the port, see ConnectionRules::matchPort().
+	// Kept until the match of the client changes.
+	const ConnectionRules::Match &getMatch(int id, const ClientInfoCache::ClientInfo &client);
+
+private:
+	struct Endpoint
+	{
+		snd_seq_addr_t addr;
+		char name[MAX_NAME];
+
+		ConnectionRules::Match match;
+
+		// ClientInfo::serial the match was made from, 0 if none.
+		unsigned clientSerial;
+	};
+
+	Endpoint m_endpoints[MAX_ENDPOINTS];
+
+	// Rules generation the match bits of all entries were sized for.
+	unsigned m_reservedGeneration;
+
+	// Stack of the free ids, the lowest on top.
+	int16_t m_free[MAX_ENDPOINTS];
+	uint16_t m_freeCount;
+};
+
+EndpointTable::EndpointTable()
+	:m_reservedGeneration(0)
+{
+	clear();
+}
+
+int EndpointTable::add(snd_seq_addr_t addr, const char *name)
+{
+	if (m_freeCount == 0)
+		return -1;
+
+	int id = m_free[--m_freeCount];
+
+	m_endpoints[id].addr = addr;
+	copyName(m_endpoints[id].name, name);
+	m_endpoints[id].clientSerial = 0;
+
+	return id;
+}
+
+void EndpointTable::remove(int id)
+{
+	assert(id >= 0 && id < MAX_ENDPOINTS && m_freeCount < MAX_ENDPOINTS);
+	m_free[m_freeCount++] = id;
+}
+
+void EndpointTable::clear()
+{
+	for (int i=0; i<MAX_ENDPOINTS; ++i)
+		m_free[i] = MAX_ENDPOINTS - 1 - i;
+
+	m_freeCount = MAX_ENDPOINTS;
+}
+
+snd_seq_addr_t EndpointTable::getAddr(int id) const
+{
+	return m_endpoints[id].addr;
+}
+
+const char *EndpointTable::getName(int id) const
+{
+	return m_endpoints[id].name;
+}
+
+const ConnectionRules::Match &EndpointTable::getMatch(int id, const ClientInfoCache::ClientInfo &client)
+{
+	// Sized all at once on a rule change, like the matches of ClientInfoCache.
+	if (m_reservedGeneration != g_rules.getGeneration())
+	{
+		for (int i=0; i<MAX_ENDPOINTS; ++i)
+			g_rules.reserve(m_endpoints[i].match);
+
+		m_reservedGeneration = g_rules.getGeneration();
+	}
+
+	Endpoint &endpoint = m_endpoints[id];
+
+	if (endpoint.clientSerial != client.serial)
+	{
+		g_rules.matchPort(client.match, endpoint.addr.port, endpoint.name, endpoint.match);
+		endpoint.clientSerial = client.serial;
+	}
+
+	return endpoint.match;
+}
+
+// Indexed by EndpointDir.
+static EndpointTable g_endpointTables[2];
+
+// Dense list of the endpoint ids of one client type and direction, so that
+// a new port only has to be checked against the ports it could connect to.
+class EndpointIndex
+{
+public:
+	EndpointIndex();
+
+	void add(int id);
+	void remove(int id);
+	void clear();
+
+	size_t size() const;
+	int operator [](size_t i) const;
+
+private:
+	int16_t m_ids[MAX_ENDPOINTS];
+
+	// Position in m_ids by endpoint id, -1 if not in the list.
+	int16_t m_index[MAX_ENDPOINTS];
+
+	uint16_t m_count;
+};
+
+EndpointIndex::EndpointIndex()
+{
+	clear();
+}
+
+void EndpointIndex::add(int id)
+{
+	if (m_index[id] >= 0)
+		return;
+
+	m_index[id] = m_count;
+	m_ids[m_count++] = id;
+}
+
+void EndpointIndex::remove(int id)
+{
+	int index = m_index[id];
+	if (index < 0)
+		return;
+
+	int last = m_ids[--m_count];
+
+	m_ids[index] = last;
+	m_index[last] = index;
+	m_index[id] = -1;
+}
+
+void EndpointIndex::clear()
+{
+	memset(m_index, 0xff, sizeof(m_index));
+	m_count = 0;
+}
+
+size_t EndpointIndex::size() const
+{
+	return m_count;
+}
+
+int EndpointIndex::operator [](size_t i) const
+{
+	assert(i < m_count);
+	return m_ids[i];
+}
+
+// Indexed by [ClientType][EndpointDir].
+static EndpointIndex g_endpoints[2][2];
+
+// Minimum rule strength for connecting an output of one client type to an input of another, [output][input].
+static const ConnectionRules::Strength g_linkStrengths[2][2] =
+{
+	{ ConnectionRules::STRENGTH_SPECIFIC,   ConnectionRules::STRENGTH_VERY_VAGUE },
+	{ ConnectionRules::STRENGTH_VERY_VAGUE, ConnectionRules::STRENGTH_SPECIFIC   },
+};
+
+static void endpointsClear()
+{
+	for (int i=0; i<2; ++i)
+	{
+		g_endpoints[i][ENDPOINT_OUTPUT].clear();
+		g_endpoints[i][ENDPOINT_INPUT].clear();
+		g_endpointTables[i].clear();
+	}
+}
+
+static snd_seq_addr_t endpointGetAddr(EndpointDir dir, int id)
+{
+	return g_endpointTables[dir].getAddr(id);
+}
+
+Client *findClientForPort(snd_seq_addr_t addr, ClientType *type = NULL)
+{
+	Client *client = g_clients.find(addr.client);
+
+	if (client && type)
+		*type = client->getType();
+
+	return client;
+}
+
+// Measures the event rates of the outputs of clients having a [limits] entry. A second
+// sequencer client gets subscribed to them, as the one of g_port filters out all but
+// the announcements, and so that floods never delay them. Outputs going over their
+// limit get muted, graphIsFull() then keeps them from being linked, see monitorSample().
+static bool g_monitorEnabled = false;
+
+static snd_seq_t *g_monitorSeq = NULL;
+static int g_monitorClient = -1;
+static int g_monitorPort = -1;
+
+enum MonitorState
+{
+	MONITOR_OFF,
+	MONITOR_OK,
+	MONITOR_THROTTLED,
+	MONITOR_DISCONNECTED,
+};
+
+static const char *monitorStateName(MonitorState state)
+{
+	static const char *const names[] = { "off", "ok", "throttled", "disconnected" };
+	return names[state];
+}
+
+struct MonitorSource
+{
+	MonitorState state;
+
+	// Counted since the last sample.
+	uint32_t events;
+
+	// Events per second at the last sample, and the highest seen.
+	uint32_t rate;
+	uint32_t peak;
+
+	uint64_t mutedUntilUs;
+};
+
+// By output endpoint id.
+static MonitorSource g_monitorSources[MAX_ENDPOINTS];
+static unsigned g_monitorTapCount = 0;
+
+static uint64_t g_monitorSampleUs = 0;
+
+static bool monitorIsTap(snd_seq_addr_t input)
+{
+	return g_monitorSeq && input.client == g_monitorClient;
+}
+
+static bool monitorIsMuted(int outputId)
+{
+	return g_monitorSources[outputId].state == MONITOR_THROTTLED || g_monitorSources[outputId].state == MONITOR_DISCONNECTED;
+}
+
+// Starts counting the events of a newly tracked output, if its client is limited.
+static void monitorTap(int outputId)
+{
+	if (!g_monitorSeq)
+		return;
+
+	snd_seq_addr_t addr = endpointGetAddr(ENDPOINT_OUTPUT, outputId);
+
+	const ClientInfoCache::ClientInfo *info = g_clientInfo.get(addr.client);
+	if (!info || info->rateLimit < 0)
+		return;
+
+	++g_stats.syscalls;
+	int result = snd_seq_connect_from(g_monitorSeq, g_monitorPort, addr.client, addr.port);
+	if (result < 0)
+	{
+		logPrintf(LOG_LEVEL_ERROR, "Failed monitoring %d:%d! (%d)", addr.client, addr.port, result);
+		return;
+	}
+
+	MonitorSource &source = g_monitorSources[outputId];
+	source.state = MONITOR_OK;
+	source.events = 0;
+	source.rate = 0;
+	source.peak = 0;
+	source.mutedUntilUs = 0;
+
+	if (g_monitorTapCount++ == 0)
+		g_monitorSampleUs = getTimeUs();
+}
+
+// Must be called while the output is still tracked. The subscription is gone already if its port is.
+static void monitorUntap(int outputId, bool portExists)
+{
+	MonitorSource &source = g_monitorSources[outputId];
+	if (source.state == MONITOR_OFF)
+		return;
+
+	if (portExists)
+	{
+		snd_seq_addr_t addr = endpointGetAddr(ENDPOINT_OUTPUT, outputId);
+
+		++g_stats.syscalls;
+		snd_seq_disconnect_from(g_monitorSeq, g_monitorPort, addr.client, addr.port);
+	}
+
+	source.state = MONITOR_OFF;
+	--g_monitorTapCount;
+}
+
+// Untaps all the outputs before the tracked state gets rebuilt.
+static void monitorClear()
+{
+	for (int i=0; i<MAX_ENDPOINTS && g_monitorTapCount > 0; ++i)
+		monitorUntap(i, true);
+}
+
+// Taps the tracked outputs that got a limit and untaps those that lost it, after the limits
+// changed, and unmutes the muted ones, to be measured against the new limits. Returns true
+// if any output got unmuted, its links are due to be made then.
+static bool monitorRetap()
+{
+	if (!g_monitorSeq)
+		return false;
+
+	bool unmuted = false;
+
+	for (int t=0; t<2; ++t)
+	{
+		const EndpointIndex &outputs = g_endpoints[t][ENDPOINT_OUTPUT];
+		for (size_t i=0; i<outputs.size(); ++i)
+		{
+			int id = outputs[i];
+
+			const ClientInfoCache::ClientInfo *info = g_clientInfo.get(endpointGetAddr(ENDPOINT_OUTPUT, id).client);
+			bool limited = info && info->rateLimit >= 0;
+
+			MonitorSource &source = g_monitorSources[id];
+
+			if (monitorIsMuted(id))
+			{
+				source.state = MONITOR_OK;
+				source.mutedUntilUs = 0;
+				unmuted = true;
+			}
+
+			if (limited && source.state == MONITOR_OFF)
+				monitorTap(id);
+			else if (!limited && source.state != MONITOR_OFF)
+				monitorUntap(id, true);
+		}
+	}
+
+	return unmuted;
+}
+
+static int monitorInit()
+{
+	int result = snd_seq_open(&g_monitorSeq, "default", SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK);
+	if (result < 0)
+	{
+		logPrintf(LOG_LEVEL_ERROR, "Couldn't open the monitoring sequencer client! (%d)", result);
+		g_monitorSeq = NULL;
+		return result;
+	}
+
+	snd_seq_set_client_name(g_monitorSeq, "amidiauto monitor");
+
+	result = snd_seq_create_simple_port(g_monitorSeq, "monitor", SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_NO_EXPORT, SND_SEQ_PORT_TYPE_APPLICATION);
+	if (result < 0)
+	{
+		logPrintf(LOG_LEVEL_ERROR, "Couldn't create the monitoring port! (%d)", result);
+		snd_seq_close(g_monitorSeq);
+		g_monitorSeq = NULL;
+		return result;
+	}
+
+	g_monitorPort = result;
+	g_monitorClient = snd_seq_client_id(g_monitorSeq);
+
+	return 0;
+}
+
+static void monitorUninit()
+{
+	if (g_monitorSeq)
+	{
+		snd_seq_close(g_monitorSeq);
+		g_monitorSeq = NULL;
+	}
+}
+
+enum PendingFlags
+{
+	PENDING_EXIT   = 1 << 0,
+	PENDING_START  = 1 << 1,
+	PENDING_CHANGE = 1 << 2,
+};
+
+struct PendingPort
+{
+	snd_seq_addr_t addr;
+	unsigned flags;
+
+	// Time at which PORT_START was received, 0 if it was not.
+	uint64_t arrivalUs;
+};
+
+inline static bool operator <(const PendingPort &a, const PendingPort &b)
+{
+	return a.addr < b.addr;
+}
+
+// Port announcements collected within the coalescing window, see pendingFlush().
+// A flat list keeps its capacity once cleared, so steady announcements don't allocate.
+typedef std::vector<PendingPort> pending_ports_t;
+
+static pending_ports_t g_pendingPorts;
+
+static PendingPort *pendingFind(snd_seq_addr_t addr)
+{
+	for (size_t i=0; i<g_pendingPorts.size(); ++i)
+	{
+		if (g_pendingPorts[i].addr == addr)
+			return &g_pendingPorts[i];
+	}
+
+	return NULL;
+}
+
+// The earliest time either port got announced within the current flush, 0 if neither did.
+static uint64_t portGetArrival(snd_seq_addr_t output, snd_seq_addr_t input)
+{
+	if (g_pendingPorts.empty())
+		return 0;
+
+	uint64_t arrival = 0;
+
+	const PendingPort *item = pendingFind(output);
+	if (item)
+		arrival = item->arrivalUs;
+
+	item = pendingFind(input);
+	if (item && item->arrivalUs != 0 && (arrival == 0 || item->arrivalUs < arrival))
+		arrival = item->arrivalUs;
+
+	return arrival;
+}
+
+static void portArrivalConnected(snd_seq_addr_t output, snd_seq_addr_t input)
+{
+	uint64_t arrival = portGetArrival(output, input);
+	if (arrival != 0)
+		g_stats.hotplugLatencyUs.add(getTimeUs() - arrival);
+}
+
+static int connect(snd_seq_addr_t output, snd_seq_addr_t input)
+{
+	logPrintf(LOG_LEVEL_INFO, "Connecting %d:%d to %d:%d", output.client, output.port, input.client, input.port);
+
+	++g_stats.syscalls;
+	int result = g_backend->subscribe(output, input);
+
+	// Already connected.
+	if (result == -EBUSY)
+		result = 0;
+
+	if (result < 0)
+	{
+		logPrintf(LOG_LEVEL_ERROR, "Failed connecting %d:%d to %d:%d! (%d)", output.client, output.port, input.client, input.port, result);
+		return result;
+	}
+
+	++g_stats.subscribes;
+	portArrivalConnected(output, input);
+
+	return result;
+}
+
+static int disconnect(snd_seq_addr_t output, snd_seq_addr_t input)
+{
+	logPrintf(LOG_LEVEL_INFO, "Disconnecting %d:%d from %d:%d", output.client, output.port, input.client, input.port);
+
+	++g_stats.syscalls;
+	int result = g_backend->unsubscribe(output, input);
+
+	// Already disconnected.
+	if (result == -ENOENT)
+		result = 0;
+
+	if (result < 0)
+		logPrintf(LOG_LEVEL_ERROR, "Failed disconnecting %d:%d from %d:%d! (%d)", output.client, output.port, input.client, input.port, result);
+	else
+		++g_stats.unsubscribes;
+
+	return result;
+}
+
+static PortDir portGetDir(const snd_seq_port_info_t &portInfo)
+{
+	unsigned result = 0;
+
+	unsigned int caps = snd_seq_port_info_get_capability(&portInfo);
+
+	if (caps & SND_SEQ_PORT_CAP_READ)
+	{
+		result |= DIR_OUTPUT;
+	}
+	if (caps & SND_SEQ_PORT_CAP_WRITE)
+	{
+		result |= DIR_INPUT;
+	}
+
+	return (PortDir)result;
+}
+
+static PortType portGetType(const snd_seq_port_info_t &portInfo)
+{
+	const char *name = snd_seq_port_info_get_name(&portInfo);
+
+	if (strncmp("TouchOSC Bridge", name, 15) == 0)
+	{
+		// Treat touchosc2midi ports as 'hardware' ones.
+		return TYPE_HARDWARE;
+	}
+
+	unsigned int type = snd_seq_port_info_get_type(&portInfo);
+
+	return (type & SND_SEQ_PORT_TYPE_APPLICATION) ? TYPE_SOFTWARE : TYPE_HARDWARE;
+}
+
+// Returns the directions the port got tracked for, DIR_UNKNOWN if none.
+static PortDir portAdd(const snd_seq_port_info_t &portInfo)
+{
+	unsigned int caps = snd_seq_port_info_get_capability(&portInfo);
+
+	if (caps & SND_SEQ_PORT_CAP_NO_EXPORT)
+		return DIR_UNKNOWN;
+
+	// Ignore System client and its Announce and Timer ports.
+	int clientId = snd_seq_port_info_get_client(&portInfo);
+	if (clientId == SND_SEQ_CLIENT_SYSTEM)
+		return DIR_UNKNOWN;
+
+	// Ignore through ports.
+	const ClientInfoCache::ClientInfo *info = g_clientInfo.get(clientId);
+	if (!info || strncmp(info->name, "Midi Through", 12) == 0)
+		return DIR_UNKNOWN;
+
+	PortType type = portGetType(portInfo);
+
+	PortDir dir = portGetDir(portInfo);
+
+	unsigned added = DIR_UNKNOWN;
+
+	snd_seq_addr_t addr = *snd_seq_port_info_get_addr(&portInfo);
+	const char *name = snd_seq_port_info_get_name(&portInfo);
+
+	Client &client = g_clients.get(addr.client, type == TYPE_SOFTWARE ? CLIENT_SOFTWARE : CLIENT_HARDWARE);
+
+	static const PortDir dirs[2] = { DIR_OUTPUT, DIR_INPUT };
+	for (int d=0; d<2; ++d)
+	{
+		EndpointDir endpointDir = (EndpointDir)d;
+
+		if (!(dir & dirs[d]) || client.findEndpoint(endpointDir, addr.port) >= 0)
+			continue;
+
+		if (!g_rules.isPortNameSelected(info->portPolicy, name))
+			continue;
+
+		size_t count = client.getEndpointCount(endpointDir);
+
+		int id = -1;
+		if (count < MAX_CLIENT_PORTS && g_rules.hasPortRoom(info->portPolicy, count))
+		{
+			id = g_endpointTables[endpointDir].add(addr, name);
+			if (id < 0)
+				logPrintf(LOG_LEVEL_WARNING, "Too many ports tracked, ignoring %d:%d!", addr.client, addr.port);
+		}
+
+		if (id < 0)
+		{
+			// Kept in case a tracked port of the client exits, see portFailover().
+			client.addCandidate(endpointDir, addr.port);
+			continue;
+		}
+
+		client.addEndpoint(endpointDir, addr.port, id);
+		g_endpoints[client.getType()][endpointDir].add(id);
+		added |= dirs[d];
+
+		if (endpointDir == ENDPOINT_OUTPUT)
+			monitorTap(id);
+	}
+
+	return (PortDir)added;
+}
+
+// An existing port is one no longer tracked after a change, its monitoring gets unsubscribed.
+static void portRemove(snd_seq_addr_t addr, bool portExists = false)
+{
+	Client *client = findClientForPort(addr);
+
+	if (!client)
+		return;
+
+	for (int d=0; d<2; ++d)
+	{
+		EndpointDir dir = (EndpointDir)d;
+
+		client->removeCandidate(dir, addr.port);
+
+		int id = client->findEndpoint(dir, addr.port);
+		if (id < 0)
+			continue;
+
+		if (dir == ENDPOINT_OUTPUT)
+			monitorUntap(id, portExists);
+
+		client->removeEndpoint(dir, addr.port);
+		g_endpoints[client->getType()][dir].remove(id);
+		g_endpointTables[dir].remove(id);
+	}
+}
+
+static void clientRemove(int clientId)
+{
+	Client *client = g_clients.find(clientId);
+	if (!client)
+		return;
+
+	for (int d=0; d<2; ++d)
+	{
+		EndpointDir dir = (EndpointDir)d;
+		while (client->getEndpointCount(dir) > 0)
+			portRemove(endpointGetAddr(dir, client->getEndpoint(dir, 0)));
+	}
+
+	g_clients.remove(clientId);
+}
+
+// Keeps freed single objects on a free list for reuse instead of returning them
+// to the heap, so node based containers that only churn stop allocating once warm.
+template <typename T>
+class PoolAllocator
+{
+public:
+	typedef T value_type;
+	typedef T *pointer;
+	typedef const T *const_pointer;
+	typedef T &reference;
+	typedef const T &const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+
+	template <typename U>
+	struct rebind
+	{
+		typedef PoolAllocator<U> other;
+	};
+
+	PoolAllocator() {}
+	template <typename U>
+	PoolAllocator(const PoolAllocator<U> &) {}
+
+	pointer address(reference x) const { return &x; }
+	const_pointer address(const_reference x) const { return &x; }
+
+	pointer allocate(size_type n, const void *hint = NULL);
+	void deallocate(pointer p, size_type n);
+
+	size_type max_size() const { return (size_t)-1 / sizeof(T); }
+
+	void construct(pointer p, const T &value) { new (p) T(value); }
+	void destroy(pointer p) { p->~T(); }
+
+	bool operator ==(const PoolAllocator &) const { return true; }
+	bool operator !=(const PoolAllocator &) const { return false; }
+
+private:
+	enum { OBJECT_SIZE = sizeof(T) > sizeof(void*) ? sizeof(T) : sizeof(void*) };
+
+	// Each free object holds the pointer to the next one.
+	static void *s_free;
+};
+
+template <typename T>
+void *PoolAllocator<T>::s_free = NULL;
+
+template <typename T>
+typename PoolAllocator<T>::pointer PoolAllocator<T>::allocate(size_type n, const void *)
+{
+	if (n != 1)
+		return (pointer)operator new(n * sizeof(T));
+
+	void *p = s_free;
+	if (p)
+		s_free = *(void**)p;
+	else
+		p = operator new(OBJECT_SIZE);
+
+	return (pointer)p;
+}
+
+template <typename T>
+void PoolAllocator<T>::deallocate(pointer p, size_type n)
+{
+	if (n != 1)
+	{
+		operator delete(p);
+		return;
+	}
+
+	*(void**)p = s_free;
+	s_free = p;
+}
+
+#ifdef AMIDIAUTO_TINY
+// A set kept as a sorted array, taking the size of its values per item instead of
+// the tens of bytes of a tree node. Erasing only marks the item, so iterators stay
+// valid and loops may erase as they go, the marked items are reused or squeezed
+// out by later inserts. Inserting a new value moves the items after it.
+template <typename T>
+class FlatSet
+{
+public:
+	class const_iterator
+	{
+	public:
+		const_iterator() :m_set(NULL), m_index(0) {}
+		const_iterator(const FlatSet *set, size_t index) :m_set(set), m_index(set->skip(index)) {}
+
+		const T &operator *() const { return m_set->m_items[m_index]; }
+		const T *operator ->() const { return &m_set->m_items[m_index]; }
+
+		const_iterator &operator ++() { m_index = m_set->skip(m_index + 1); return *this; }
+		const_iterator operator ++(int) { const_iterator result = *this; ++*this; return result; }
+
+		bool operator ==(const const_iterator &rhs) const { return m_index == rhs.m_index; }
+		bool operator !=(const const_iterator &rhs) const { return m_index != rhs.m_index; }
+
+	private:
+		friend class FlatSet;
+
+		const FlatSet *m_set;
+		size_t m_index;
+	};
+
+	typedef const_iterator iterator;
+
+	FlatSet();
+
+	const_iterator begin() const { return const_iterator(this, 0); }
+	const_iterator end() const { return const_iterator(this, m_items.size()); }
+
+	const_iterator find(const T &value) const;
+	const_iterator lower_bound(const T &value) const;
+
+	void insert(const T &value);
+	template <typename I>
+	void insert(I first, I last);
+
+	void erase(const_iterator itr);
+	void clear();
+
+	size_t size() const { return m_size; }
+	bool empty() const { return m_size == 0; }
+
+	bool operator ==(const FlatSet &rhs) const;
+
+private:
+	friend class const_iterator;
+
+	// Returns the index of the first item left at or after index.
+	size_t skip(size_t index) const;
+
+	void compact();
+
+	std::vector<T> m_items;
+	std::vector<bool> m_erased;
+	size_t m_size;
+};
+
+template <typename T>
+FlatSet<T>::FlatSet()
+	:m_size(0)
+{
+}
+
+template <typename T>
+size_t FlatSet<T>::skip(size_t index) const
+{
+	while (index < m_items.size() && m_erased[index])
+		++index;
+	return index;
+}
+
+template <typename T>
+typename FlatSet<T>::const_iterator FlatSet<T>::lower_bound(const T &value) const
+{
+	return const_iterator(this, std::lower_bound(m_items.begin(), m_items.end(), value) - m_items.begin());
+}
+
+template <typename T>
+typename FlatSet<T>::const_iterator FlatSet<T>::find(const T &value) const
+{
+	size_t index = std::lower_bound(m_items.begin(), m_items.end(), value) - m_items.begin();
+	if (index == m_items.size() || m_erased[index] || value < m_items[index])
+		return end();
+
+	return const_iterator(this, index);
+}
+
+template <typename T>
+void FlatSet<T>::insert(const T &value)
+{
+	size_t index = std::lower_bound(m_items.begin(), m_items.end(), value) - m_items.begin();
+	if (index != m_items.size() && !(value < m_items[index]))
+	{
+		if (m_erased[index])
+		{
+			m_erased[index] = false;
+			++m_size;
+		}
+		return;
+	}
+
+	// Reusing the space of the erased items before growing.
+	if (m_items.size() == m_items.capacity() && m_size < m_items.size())
+	{
+		compact();
+		index = std::lower_bound(m_items.begin(), m_items.end(), value) - m_items.begin();
+	}
+
+	m_items.insert(m_items.begin() + index, value);
+	m_erased.insert(m_erased.begin() + index, false);
+	++m_size;
+}
+
+template <typename T>
+template <typename I>
+void FlatSet<T>::insert(I first, I last)
+{
+	for (; first != last; ++first)
+		insert(*first);
+}
+
+template <typename T>
+void FlatSet<T>::erase(const_iterator itr)
+{
+	m_erased[itr.m_index] = true;
+	--m_size;
+}
+
+template <typename T>
+void FlatSet<T>::clear()
+{
+	m_items.clear();
+	m_erased.clear();
+	m_size = 0;
+}
+
+template <typename T>
+void FlatSet<T>::compact()
+{
+	size_t n = 0;
+	for (size_t i=0; i<m_items.size(); ++i)
+	{
+		if (!m_erased[i])
+			m_items[n++] = m_items[i];
+	}
+
+	m_items.resize(n);
+	m_erased.assign(n, false);
+}
+
+template <typename T>
+bool FlatSet<T>::operator ==(const FlatSet &rhs) const
+{
+	if (m_size != rhs.m_size)
+		return false;
+
+	for (const_iterator a = begin(), b = rhs.begin(); a != end(); ++a, ++b)
+	{
+		if (!(*a == *b))
+			return false;
+	}
+
+	return true;
+}
+#endif
+
+typedef std::pair<snd_seq_addr_t, snd_seq_addr_t> link_t;
+#ifndef AMIDIAUTO_TINY
+typedef std::set<link_t, std::less<link_t>, PoolAllocator<link_t> > links_t;
+#else
+typedef FlatSet<link_t> links_t;
+#endif
+
+// Links between the tracked ports, as a bit per pair of output and input endpoint
+// ids. Testing, adding and scanning links take no lookups and no allocations.
+class LinkMatrix
+{
+public:
+	LinkMatrix();
+
+	void set(int outputId, int inputId);
+	bool test(int outputId, int inputId) const;
+
+	// Clears the links from an output, or to an input.
+	void clearOutput(int outputId);
+	void clearInput(int inputId);
+	void clear();
+
+	size_t size() const;
+
+	// Returns the number of links from an output.
+	size_t count(int outputId) const;
+
+	// Return the first id at or after the given one of an output having any links,
+	// or of an input linked to from the output, -1 if there's none.
+	int nextOutput(int outputId) const;
+	int nextInput(int outputId, int inputId) const;
+
+private:
+	enum { WORD_COUNT = MAX_ENDPOINTS / 32 };
+
+	static int findBit(const uint32_t *words, int from);
+
+	void updateRow(int outputId);
+
+	uint32_t m_bits[MAX_ENDPOINTS][WORD_COUNT];
+
+	// Bit per output which has any links.
+	uint32_t m_rows[WORD_COUNT];
+
+	size_t m_count;
+};
+
+LinkMatrix::LinkMatrix()
+{
+	clear();
+}
+
+void LinkMatrix::set(int outputId, int inputId)
+{
+	uint32_t &word = m_bits[outputId][inputId / 32];
+	uint32_t bit = 1u << (inputId % 32);
+
+	if (word & bit)
+		return;
+
+	word |= bit;
+	m_rows[outputId / 32] |= 1u << (outputId % 32);
+	++m_count;
+}
+
+bool LinkMatrix::test(int outputId, int inputId) const
+{
+	return (m_bits[outputId][inputId / 32] >> (inputId % 32)) & 1;
+}
+
+void LinkMatrix::clearOutput(int outputId)
+{
+	m_count -= count(outputId);
+	memset(m_bits[outputId], 0, sizeof(m_bits[outputId]));
+
+	m_rows[outputId / 32] &= ~(1u << (outputId % 32));
+}
+
+void LinkMatrix::clearInput(int inputId)
+{
+	uint32_t bit = 1u << (inputId % 32);
+
+	for (int o = nextOutput(0); o >= 0; o = nextOutput(o + 1))
+	{
+		uint32_t &word = m_bits[o][inputId / 32];
+		if (word & bit)
+		{
+			word &= ~bit;
+			--m_count;
+			updateRow(o);
+		}
+	}
+}
+
+void LinkMatrix::clear()
+{
+	memset(m_bits, 0, sizeof(m_bits));
+	memset(m_rows, 0, sizeof(m_rows));
+	m_count = 0;
+}
+
+size_t LinkMatrix::size() const
+{
+	return m_count;
+}
+
+size_t LinkMatrix::count(int outputId) const
+{
+	size_t n = 0;
+	for (int i=0; i<WORD_COUNT; ++i)
+		n += __builtin_popcount(m_bits[outputId][i]);
+
+	return n;
+}
+
+int LinkMatrix::findBit(const uint32_t *words, int from)
+{
+	for (int i = from / 32; i < WORD_COUNT; ++i)
+	{
+		uint32_t word = words[i];
+		if (i == from / 32)
+			word &= ~0u << (from % 32);
+
+		if (word)
+			return i * 32 + __builtin_ctz(word);
+	}
+
+	return -1;
+}
+
+int LinkMatrix::nextOutput(int outputId) const
+{
+	return outputId < MAX_ENDPOINTS ? findBit(m_rows, outputId) : -1;
+}
+
+int LinkMatrix::nextInput(int outputId, int inputId) const
+{
+	return inputId < MAX_ENDPOINTS ? findBit(m_bits[outputId], inputId) : -1;
+}
+
+void LinkMatrix::updateRow(int outputId)
+{
+	for (int i=0; i<WORD_COUNT; ++i)
+	{
+		if (m_bits[outputId][i])
+			return;
+	}
+
+	m_rows[outputId / 32] &= ~(1u << (outputId % 32));
+}
+
+// Which clients have an actual link to which others, a bit per pair.
+class RouteGraph
+{
+public:
+	enum { WORD_COUNT = MAX_CLIENTS / 32 };
+
+	RouteGraph();
+
+	void set(int outputClient, int inputClient);
+	void reset(int outputClient, int inputClient);
+	void clear();
+
+	bool test(int outputClient, int inputClient) const;
+
+	// Bits of the clients linked to from the client.
+	const uint32_t *getRow(int outputClient) const;
+
+private:
+	uint32_t m_bits[MAX_CLIENTS][WORD_COUNT];
+};
+
+RouteGraph::RouteGraph()
+{
+	clear();
+}
+
+void RouteGraph::set(int outputClient, int inputClient)
+{
+	m_bits[outputClient][inputClient / 32] |= 1u << (inputClient % 32);
+}
+
+void RouteGraph::reset(int outputClient, int inputClient)
+{
+	m_bits[outputClient][inputClient / 32] &= ~(1u << (inputClient % 32));
+}
+
+void RouteGraph::clear()
+{
+	memset(m_bits, 0, sizeof(m_bits));
+}
+
+bool RouteGraph::test(int outputClient, int inputClient) const
+{
+	return (m_bits[outputClient][inputClient / 32] & (1u << (inputClient % 32))) != 0;
+}
+
+const uint32_t *RouteGraph::getRow(int outputClient) const
+{
+	return m_bits[outputClient];
+}
+
+// Subscriptions the rules call for between the tracked ports.
+static LinkMatrix g_desiredLinks;
+
+// Subscriptions between ports present in the sequencer, kept up to date from announcements.
+// Changed through graphAddActual() and graphEraseActual() only, so g_routes follows.
+static links_t g_actualLinks;
+static RouteGraph g_routes;
+
+// Pairs of clients whose links were refused for closing a loop, so a refusal is logged and
+// counted once. Checked again by graphRecheckRefused() once some route went away.
+static RouteGraph g_refusedRoutes;
+static bool g_refusedStale = false;
+
+// Set when applied links may close a loop, as the clients passing their input on changed
+// or links were restored unchecked.
+static bool g_loopsUnchecked = false;
+
+// Subscriptions amidiauto is responsible for, only these ever get disconnected.
+static links_t g_appliedLinks;
+
+static bool graphCheckRules(const ConnectionRules::Match &output, const ConnectionRules::Match &input, ConnectionRules::Strength minimumStrength)
+{
+	uint64_t start = profileStart();
+	bool allowed = g_rules.isConnectionAllowed(output, input, minimumStrength);
+	profileEnd(g_stats.ruleCheckNs, start);
+	++g_stats.ruleChecks;
+
+	return allowed;
+}
+
+static void graphAddActual(const link_t &link)
+{
+	g_actualLinks.insert(link);
+	g_routes.set(link.first.client, link.second.client);
+}
+
+static void graphEraseActual(links_t::iterator itr)
+{
+	int outputClient = itr->first.client;
+	int inputClient = itr->second.client;
+
+	g_actualLinks.erase(itr);
+
+	// The clients stay routed while any other of their port pairs is linked.
+	snd_seq_addr_t first;
+	first.client = outputClient;
+	first.port = 0;
+
+	for (links_t::const_iterator i = g_actualLinks.lower_bound(link_t(first, first)); i != g_actualLinks.end() && i->first.client == outputClient; ++i)
+	{
+		if (i->second.client == inputClient)
+			return;
+	}
+
+	g_routes.reset(outputClient, inputClient);
+	g_refusedStale = true;
+}
+
+static void graphEraseActual(const link_t &link)
+{
+	links_t::iterator itr = g_actualLinks.find(link);
+	if (itr != g_actualLinks.end())
+		graphEraseActual(itr);
+}
+
+static void graphClearActual()
+{
+	g_actualLinks.clear();
+	g_routes.clear();
+	g_refusedStale = true;
+}
+
+static bool graphIsThru(int clientId)
+{
+	const ClientInfoCache::ClientInfo *info = g_clientInfo.get(clientId);
+	return info && info->thru;
+}
+
+// Whether linking the clients would close a cycle of clients passing their input on,
+// which would have every event going around it forever. Each client is visited at most once.
+static bool graphWouldLoop(int outputClient, int inputClient)
+{
+	if (!graphIsThru(outputClient) || !graphIsThru(inputClient))
+		return false;
+
+	if (outputClient == inputClient)
+		return true;
+
+	uint64_t start = profileStart();
+	++g_stats.loopChecks;
+
+	uint32_t visited[RouteGraph::WORD_COUNT];
+	memset(visited, 0, sizeof(visited));
+
+	uint8_t stack[MAX_CLIENTS];
+	size_t depth = 0;
+
+	visited[inputClient / 32] |= 1u << (inputClient % 32);
+	stack[depth++] = inputClient;
+
+	bool loop = false;
+
+	while (depth > 0 && !loop)
+	{
+		const uint32_t *row = g_routes.getRow(stack[--depth]);
+
+		for (int w=0; w<RouteGraph::WORD_COUNT && !loop; ++w)
+		{
+			uint32_t bits = row[w] & ~visited[w];
+			visited[w] |= bits;
+
+			while (bits)
+			{
+				int next = w * 32 + __builtin_ctz(bits);
+				bits &= bits - 1;
+
+				if (next == outputClient)
+				{
+					loop = true;
+					break;
+				}
+
+				// Events stop at clients not passing them on.
+				if (graphIsThru(next))
+					stack[depth++] = next;
+			}
+		}
+	}
+
+	profileEnd(g_stats.loopCheckNs, start);
+
+	return loop;
+}
+
+static bool graphIsRefused(const link_t &link)
+{
+	return g_refusedRoutes.test(link.first.client, link.second.client);
+}
+
+// Forgets the refusals that no longer hold, as routes went away or the clients changed.
+static void graphRecheckRefused()
+{
+	if (!g_refusedStale)
+		return;
+
+	for (int outputClient=0; outputClient<MAX_CLIENTS; ++outputClient)
+	{
+		const uint32_t *row = g_refusedRoutes.getRow(outputClient);
+
+		for (int w=0; w<RouteGraph::WORD_COUNT; ++w)
+		{
+			uint32_t bits = row[w];
+			while (bits)
+			{
+				int inputClient = w * 32 + __builtin_ctz(bits);
+				bits &= bits - 1;
+
+				// A client gone or changed meanwhile gets checked again when linked.
+				if (!g_clientInfo.find(outputClient) || !g_clientInfo.find(inputClient) || !graphWouldLoop(outputClient, inputClient))
+					g_refusedRoutes.reset(outputClient, inputClient);
+			}
+		}
+	}
+
+	g_refusedStale = false;
+}
+
+// Disconnects the applied links that close a loop, each one is refused from then on.
+// Checked one at a time, so of a loop only the first link found goes.
+static void graphBreakLoops()
+{
+	for (links_t::iterator itr = g_appliedLinks.begin(); itr != g_appliedLinks.end();)
+	{
+		links_t::iterator actual = g_actualLinks.find(*itr);
+		if (actual == g_actualLinks.end() || !graphWouldLoop(itr->first.client, itr->second.client))
+		{
+			++itr;
+			continue;
+		}
+
+		logPrintf(LOG_LEVEL_WARNING, "Disconnecting %d:%d from %d:%d, it closes a loop!", itr->first.client, itr->first.port, itr->second.client, itr->second.port);
+		++g_stats.loopsRefused;
+		g_refusedRoutes.set(itr->first.client, itr->second.client);
+
+		if (disconnect(itr->first, itr->second) >= 0)
+			graphEraseActual(actual);
+
+		g_appliedLinks.erase(itr++);
+	}
+
+	g_loopsUnchecked = false;
+}
+
+// Subscribes the link unless it would close a loop, see graphWouldLoop().
+static int graphConnect(const link_t &link)
+{
+	if (graphIsRefused(link))
+		return -ELOOP;
+
+	if (graphWouldLoop(link.first.client, link.second.client))
+	{
+		logPrintf(LOG_LEVEL_WARNING, "Not connecting %d:%d to %d:%d, it would close a loop!", link.first.client, link.first.port, link.second.client, link.second.port);
+		++g_stats.loopsRefused;
+		g_refusedRoutes.set(link.first.client, link.second.client);
+		return -ELOOP;
+	}
+
+	int result = connect(link.first, link.second);
+	if (result >= 0)
+		graphAddActual(link);
+
+	return result;
+}
+
+// The rule matches of an endpoint, those of its client unless some rules name ports.
+static const ConnectionRules::Match *graphGetMatch(EndpointDir dir, int endpointId)
+{
+	const ClientInfoCache::ClientInfo *info = g_clientInfo.get(endpointGetAddr(dir, endpointId).client);
+	if (!info)
+		return NULL;
+
+	if (!g_rules.hasPortRules())
+		return &info->match;
+
+	return &g_endpointTables[dir].getMatch(endpointId, *info);
+}
+
+static bool graphIsAllowed(int outputId, ClientType outputType, int inputId, ClientType inputType)
+{
+	const ConnectionRules::Match *output = graphGetMatch(ENDPOINT_OUTPUT, outputId);
+	const ConnectionRules::Match *input = graphGetMatch(ENDPOINT_INPUT, inputId);
+
+	return output && input && graphCheckRules(*output, *input, g_linkStrengths[outputType][inputType]);
+}
+
+// Returns the most inputs an output port of the client may get linked to, 0 if there's no limit.
+static unsigned graphGetFanout(int clientId)
+{
+	const ClientInfoCache::ClientInfo *info = g_clientInfo.get(clientId);
+	return info ? g_rules.getFanout(info->portPolicy) : 0;
+}
+
+// Whether the output takes no more links, for its fan-out limit or while muted by the monitor.
+static bool graphIsFull(int outputId, unsigned fanout)
+{
+	return monitorIsMuted(outputId) || (fanout != 0 && g_desiredLinks.count(outputId) >= fanout);
+}
+
+// Adds the desired links of a newly tracked port, scanning only the ports of the opposite direction.
+static void graphDesirePort(snd_seq_addr_t addr, PortDir dirs)
+{
+	const Client *client = findClientForPort(addr);
+	if (!client)
+		return;
+
+	ClientType type = client->getType();
+
+	int outputId = (dirs & DIR_OUTPUT) ? client->findEndpoint(ENDPOINT_OUTPUT, addr.port) : -1;
+	int inputId = (dirs & DIR_INPUT) ? client->findEndpoint(ENDPOINT_INPUT, addr.port) : -1;
+
+	unsigned fanout = outputId >= 0 ? graphGetFanout(addr.client) : 0;
+
+	for (int t=0; t<2; ++t)
+	{
+		ClientType otherType = (ClientType)t;
+
+		if (outputId >= 0)
+		{
+			const EndpointIndex &inputs = g_endpoints[otherType][ENDPOINT_INPUT];
+			for (size_t i=0; i<inputs.size() && !graphIsFull(outputId, fanout); ++i)
+			{
+				if (graphIsAllowed(outputId, type, inputs[i], otherType))
+					g_desiredLinks.set(outputId, inputs[i]);
+			}
+		}
+		if (inputId >= 0)
+		{
+			const EndpointIndex &outputs = g_endpoints[otherType][ENDPOINT_OUTPUT];
+			for (size_t i=0; i<outputs.size(); ++i)
+			{
+				snd_seq_addr_t output = endpointGetAddr(ENDPOINT_OUTPUT, outputs[i]);
+				if (!graphIsFull(outputs[i], graphGetFanout(output.client)) && graphIsAllowed(outputs[i], otherType, inputId, type))
+					g_desiredLinks.set(outputs[i], inputId);
+			}
+		}
+	}
+}
+
+static bool graphFindEndpoints(const link_t &link, int &outputId, int &inputId)
+{
+	const Client *output = g_clients.find(link.first.client);
+	const Client *input = g_clients.find(link.second.client);
+
+	outputId = output ? output->findEndpoint(ENDPOINT_OUTPUT, link.first.port) : -1;
+	inputId = input ? input->findEndpoint(ENDPOINT_INPUT, link.second.port) : -1;
+
+	return outputId >= 0 && inputId >= 0;
+}
+
+// Recomputes all of the desired links.
+static void graphDesireAll()
+{
+	g_desiredLinks.clear();
+
+	// Links already made count towards the fan-out limits first, so a recompute
+	// does not move the routes of a limited output to other inputs.
+	for (links_t::const_iterator itr = g_appliedLinks.begin(); itr != g_appliedLinks.end(); ++itr)
+	{
+		int outputId, inputId;
+		unsigned fanout = graphGetFanout(itr->first.client);
+		if (fanout == 0 || !graphFindEndpoints(*itr, outputId, inputId) || graphIsFull(outputId, fanout))
+			continue;
+
+		const Client *output = g_clients.find(itr->first.client);
+		const Client *input = g_clients.find(itr->second.client);
+		if (graphIsAllowed(outputId, output->getType(), inputId, input->getType()))
+			g_desiredLinks.set(outputId, inputId);
+	}
+
+	for (int o=0; o<2; ++o)
+	{
+		const EndpointIndex &outputs = g_endpoints[o][ENDPOINT_OUTPUT];
+
+		for (size_t a=0; a<outputs.size(); ++a)
+		{
+			int outputId = outputs[a];
+			int outputClientId = endpointGetAddr(ENDPOINT_OUTPUT, outputId).client;
+
+			const ClientInfoCache::ClientInfo *outputInfo = g_clientInfo.get(outputClientId);
+			const ConnectionRules::Match *outputMatch = graphGetMatch(ENDPOINT_OUTPUT, outputId);
+			if (!outputInfo || !outputMatch)
+				continue;
+
+			unsigned fanout = g_rules.getFanout(outputInfo->portPolicy);
+
+			for (int i=0; i<2; ++i)
+			{
+				const EndpointIndex &inputs = g_endpoints[i][ENDPOINT_INPUT];
+
+				for (size_t b=0; b<inputs.size() && !graphIsFull(outputId, fanout); ++b)
+				{
+					if (g_desiredLinks.test(outputId, inputs[b]))
+						continue;
+
+					const ConnectionRules::Match *inputMatch = graphGetMatch(ENDPOINT_INPUT, inputs[b]);
+					if (inputMatch && graphCheckRules(*outputMatch, *inputMatch, g_linkStrengths[o][i]))
+						g_desiredLinks.set(outputId, inputs[b]);
+				}
+			}
+		}
+	}
+}
+
+static void graphQuerySubscribers(snd_seq_addr_t output)
+{
+	snd_seq_addr_t input;
+	for (int i=0; ; ++i)
+	{
+		++g_stats.syscalls;
+		if (g_backend->querySubscriber(output, i, &input) < 0)
+			break;
+
+		if (!monitorIsTap(input))
+			graphAddActual(std::make_pair(output, input));
+	}
+}
+
+// Rebuilds the actual subscriptions of the tracked output ports from the sequencer.
+static void graphQueryActual()
+{
+	graphClearActual();
+
+	for (int t=0; t<2; ++t)
+	{
+		const EndpointIndex &outputs = g_endpoints[t][ENDPOINT_OUTPUT];
+		for (size_t i=0; i<outputs.size(); ++i)
+			graphQuerySubscribers(endpointGetAddr(ENDPOINT_OUTPUT, outputs[i]));
+	}
+}
+
+// Removes the links of a port from the given sets. A port of -1 matches all ports of the client.
+static bool graphHasPort(const link_t &link, int clientId, int port)
+{
+	const snd_seq_addr_t &a = link.first;
+	const snd_seq_addr_t &b = link.second;
+
+	return (a.client == clientId && (port < 0 || a.port == port)) || (b.client == clientId && (port < 0 || b.port == port));
+}
+
+// Removes the actual and applied links of a port. A port of -1 matches all ports of the client.
+static void graphRemove(int clientId, int port)
+{
+	for (links_t::iterator itr = g_actualLinks.begin(); itr != g_actualLinks.end();)
+	{
+		if (graphHasPort(*itr, clientId, port))
+			graphEraseActual(itr++);
+		else
+			++itr;
+	}
+
+	for (links_t::iterator itr = g_appliedLinks.begin(); itr != g_appliedLinks.end();)
+	{
+		if (graphHasPort(*itr, clientId, port))
+			g_appliedLinks.erase(itr++);
+		else
+			++itr;
+	}
+}
+
+// Forgets the desired links of a port about to stop being tracked, its subscriptions
+// remain and the next graphApply() disconnects them. Must be called before portRemove().
+static void graphUndesirePort(snd_seq_addr_t addr)
+{
+	const Client *client = findClientForPort(addr);
 	if (!client)
 		return;
 
-	if (client->isInputSet() && *client->getInput() == addr)
+	int outputId = client->findEndpoint(ENDPOINT_OUTPUT, addr.port);
+	if (outputId >= 0)
+		g_desiredLinks.clearOutput(outputId);
+
+	int inputId = client->findEndpoint(ENDPOINT_INPUT, addr.port);
+	if (inputId >= 0)
+		g_desiredLinks.clearInput(inputId);
+}
+
+// Forgets all links of a port that is gone, the sequencer drops them together with the port.
+// Must be called before portRemove().
+static void graphRemovePort(snd_seq_addr_t addr)
+{
+	graphUndesirePort(addr);
+
+	graphRemove(addr.client, addr.port);
+}
+
+// Must be called before clientRemove().
+static void graphRemoveClient(int clientId)
+{
+	const Client *client = g_clients.find(clientId);
+	if (client)
+	{
+		for (size_t i=0; i<client->getEndpointCount(ENDPOINT_OUTPUT); ++i)
+			g_desiredLinks.clearOutput(client->getEndpoint(ENDPOINT_OUTPUT, i));
+		for (size_t i=0; i<client->getEndpointCount(ENDPOINT_INPUT); ++i)
+			g_desiredLinks.clearInput(client->getEndpoint(ENDPOINT_INPUT, i));
+	}
+
+	graphRemove(clientId, -1);
+}
+
+// Returns true if the rules call for the link, between the currently tracked ports.
+static bool graphIsDesired(const link_t &link)
+{
+	int outputId, inputId;
+	return graphFindEndpoints(link, outputId, inputId) && g_desiredLinks.test(outputId, inputId);
+}
+
+// Calls f(link) for each desired link, in endpoint id order.
+template <typename F>
+static void graphForEachDesired(F &f)
+{
+	for (int o = g_desiredLinks.nextOutput(0); o >= 0; o = g_desiredLinks.nextOutput(o + 1))
+	{
+		snd_seq_addr_t output = endpointGetAddr(ENDPOINT_OUTPUT, o);
+
+		for (int i = g_desiredLinks.nextInput(o, 0); i >= 0; i = g_desiredLinks.nextInput(o, i + 1))
+			f(std::make_pair(output, endpointGetAddr(ENDPOINT_INPUT, i)));
+	}
+}
+
+// Limits reconciliation to the pairs of clients that any of the given rules apply to.
+class GraphScope
+{
+public:
+	explicit GraphScope(const ConnectionRules &rules);
+
+	bool contains(int outputClientId, int inputClientId);
+
+private:
+	const ConnectionRules::Match *getMatch(int clientId);
+
+	const ConnectionRules &m_rules;
+	ConnectionRules::Match m_matches[MAX_CLIENTS];
+	bool m_matched[MAX_CLIENTS];
+};
+
+GraphScope::GraphScope(const ConnectionRules &rules)
+	:m_rules(rules)
+{
+	memset(m_matched, 0, sizeof(m_matched));
+}
+
+const ConnectionRules::Match *GraphScope::getMatch(int clientId)
+{
+	if (clientId < 0 || clientId >= MAX_CLIENTS)
+		return NULL;
+
+	if (m_matched[clientId])
+		return &m_matches[clientId];
+
+	const ClientInfoCache::ClientInfo *info = g_clientInfo.get(clientId);
+	if (!info)
+		return NULL;
+
+	m_rules.match(clientId, info->name, m_matches[clientId]);
+	m_matched[clientId] = true;
+
+	return &m_matches[clientId];
+}
+
+bool GraphScope::contains(int outputClientId, int inputClientId)
+{
+	const ConnectionRules::Match *output = getMatch(outputClientId);
+	const ConnectionRules::Match *input = getMatch(inputClientId);
+
+	return output && input && m_rules.isConnectionAllowed(*output, *input, ConnectionRules::STRENGTH_VERY_VAGUE);
+}
+
+// A link to be made by graphDrain().
+struct QueuedLink
+{
+	link_t link;
+	int priority;
+	uint32_t order;
+
+	// Highest priority first, then in the order queued.
+	bool operator <(const QueuedLink &rhs) const;
+
+	// By link, then as above, for dropping the links queued again.
+	static bool byLink(const QueuedLink &lhs, const QueuedLink &rhs);
+	static bool sameLink(const QueuedLink &lhs, const QueuedLink &rhs);
+};
+
+bool QueuedLink::operator <(const QueuedLink &rhs) const
+{
+	return priority != rhs.priority ? priority > rhs.priority : order < rhs.order;
+}
+
+bool QueuedLink::byLink(const QueuedLink &lhs, const QueuedLink &rhs)
+{
+	return lhs.link != rhs.link ? lhs.link < rhs.link : lhs < rhs;
+}
+
+bool QueuedLink::sameLink(const QueuedLink &lhs, const QueuedLink &rhs)
+{
+	return lhs.link == rhs.link;
+}
+
+typedef std::vector<QueuedLink> link_queue_t;
+
+// Links made by a graphDrain() at most, so the announcements arriving meanwhile get handled
+// and the links of a client of a higher priority appearing then get made ahead of the rest.
+enum { LINK_DRAIN_BATCH = 32 };
+
+// Kept between passes, so it does not allocate once grown. The links before
+// g_linkQueueHead are made, the rest are sorted unless g_linkQueueSorted is false.
+static link_queue_t g_linkQueue;
+static size_t g_linkQueueHead = 0;
+static bool g_linkQueueSorted = true;
+static uint32_t g_linkQueueOrder = 0;
+
+// The priority of a link is the sum of the priorities of its clients.
+static void graphQueue(const link_t &link)
+{
+	const ClientInfoCache::ClientInfo *output = g_clientInfo.find(link.first.client);
+	const ClientInfoCache::ClientInfo *input = g_clientInfo.find(link.second.client);
+
+	QueuedLink item;
+	item.link = link;
+	item.priority = (output ? output->priority : 0) + (input ? input->priority : 0);
+	item.order = g_linkQueueOrder++;
+
+	g_linkQueue.push_back(item);
+	g_linkQueueSorted = false;
+}
+
+// First delay before trying a failed subscription again, doubled on every further failure.
+enum
+{
+	RETRY_INITIAL_US   = 20000,
+	RETRY_MAX_ATTEMPTS = 8,
+};
+
+// A link whose subscription failed for a reason that may pass, like a USB device still settling.
+struct RetryLink
+{
+	link_t link;
+	uint64_t dueUs;
+	unsigned attempts;
+};
+
+typedef std::vector<RetryLink> retry_links_t;
+
+static retry_links_t g_retryLinks;
+
+static bool retryIsTransient(int error)
+{
+	switch (error)
+	{
+	case -EAGAIN:
+	case -EINTR:
+	case -ENOMEM:
+	case -ENODEV:
+	case -ENXIO:
+	case -ENOENT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Schedules the next attempt after the given number of failed ones, returns false once out of attempts.
+static bool retrySchedule(RetryLink &item, unsigned attempts)
+{
+	if (attempts >= RETRY_MAX_ATTEMPTS)
+	{
+		logPrintf(LOG_LEVEL_ERROR, "Giving up connecting %d:%d to %d:%d after %u attempts!", item.link.first.client, item.link.first.port, item.link.second.client, item.link.second.port, attempts);
+		++g_stats.retriesFailed;
+		return false;
+	}
+
+	uint64_t delay = (uint64_t)RETRY_INITIAL_US << (attempts - 1);
+	item.attempts = attempts;
+	item.dueUs = getTimeUs() + delay;
+
+	logPrintf(LOG_LEVEL_INFO, "Retrying %d:%d to %d:%d in %llu ms.", item.link.first.client, item.link.first.port, item.link.second.client, item.link.second.port, (unsigned long long)(delay / 1000u));
+	return true;
+}
+
+// Called after the first attempt to make a link failed.
+static void retryAdd(const link_t &link, int error)
+{
+	if (!retryIsTransient(error))
+		return;
+
+	for (size_t i=0; i<g_retryLinks.size(); ++i)
+	{
+		if (g_retryLinks[i].link == link)
+			return;
+	}
+
+	RetryLink item;
+	item.link = link;
+	if (retrySchedule(item, 1))
+		g_retryLinks.push_back(item);
+}
+
+static int retryGetTimeout()
+{
+	if (g_retryLinks.empty())
+		return -1;
+
+	uint64_t due = g_retryLinks[0].dueUs;
+	for (size_t i=1; i<g_retryLinks.size(); ++i)
+		due = std::min(due, g_retryLinks[i].dueUs);
+
+	uint64_t now = getTimeUs();
+	if (now >= due)
+		return 0;
+
+	return (due - now + 999) / 1000;
+}
+
+// Tries the links that are due again, dropping the ones no longer desired or made meanwhile.
+static void retryService()
+{
+	uint64_t now = getTimeUs();
+
+	for (size_t i=0; i<g_retryLinks.size();)
+	{
+		RetryLink &item = g_retryLinks[i];
+
+		if (item.dueUs > now)
+		{
+			++i;
+			continue;
+		}
+
+		bool keep = false;
+
+		if (graphIsDesired(item.link) && g_appliedLinks.find(item.link) == g_appliedLinks.end())
+		{
+			++g_stats.retries;
+
+			int result = graphConnect(item.link);
+			if (result >= 0)
+				g_appliedLinks.insert(item.link);
+			else if (retryIsTransient(result))
+				keep = retrySchedule(item, item.attempts + 1);
+		}
+
+		if (keep)
+		{
+			++i;
+		}
+		else
+		{
+			g_retryLinks[i] = g_retryLinks.back();
+			g_retryLinks.pop_back();
+		}
+	}
+}
+
+// 0 while links are queued, for the loop to make the next batch right away, -1 otherwise.
+static int graphDrainGetTimeout()
+{
+	return g_linkQueueHead < g_linkQueue.size() ? 0 : -1;
+}
+
+// Makes a batch of the queued links, the ones of the highest priority first, so the routes
+// that matter for playing are in place before the rest after a boot or a burst of ports.
+// Links queued again are made once, the ones no longer desired or made meanwhile are skipped.
+static void graphDrain()
+{
+	if (!g_linkQueueSorted)
+	{
+		g_linkQueue.erase(g_linkQueue.begin(), g_linkQueue.begin() + g_linkQueueHead);
+		g_linkQueueHead = 0;
+
+		std::sort(g_linkQueue.begin(), g_linkQueue.end(), QueuedLink::byLink);
+		g_linkQueue.erase(std::unique(g_linkQueue.begin(), g_linkQueue.end(), QueuedLink::sameLink), g_linkQueue.end());
+		std::sort(g_linkQueue.begin(), g_linkQueue.end());
+
+		g_linkQueueSorted = true;
+	}
+
+	size_t end = std::min<size_t>(g_linkQueue.size(), g_linkQueueHead + LINK_DRAIN_BATCH);
+
+	for (; g_linkQueueHead < end; ++g_linkQueueHead)
+	{
+		const QueuedLink &item = g_linkQueue[g_linkQueueHead];
+
+		if (!graphIsDesired(item.link) || g_appliedLinks.find(item.link) != g_appliedLinks.end())
+			continue;
+
+		if (g_actualLinks.find(item.link) != g_actualLinks.end())
+		{
+			g_appliedLinks.insert(item.link);
+			continue;
+		}
+
+		uint64_t arrival = item.priority > 0 ? portGetArrival(item.link.first, item.link.second) : 0;
+
+		int result = graphConnect(item.link);
+		if (result < 0)
+		{
+			retryAdd(item.link, result);
+			continue;
+		}
+
+		g_appliedLinks.insert(item.link);
+
+		if (item.priority > 0)
+		{
+			uint64_t now = getTimeUs();
+			if (arrival != 0)
+				g_stats.priorityLatencyUs.add(now - arrival);
+			if (g_stats.firstPriorityLinkUs == 0)
+				g_stats.firstPriorityLinkUs = now - g_startTimeUs;
+			++g_stats.priorityLinks;
+		}
+	}
+
+	if (g_linkQueueHead == g_linkQueue.size())
+	{
+		g_linkQueue.clear();
+		g_linkQueueHead = 0;
+	}
+}
+
+// Queues a desired link that is not in place yet.
+struct GraphConnector
+{
+	explicit GraphConnector(GraphScope *scope);
+
+	void operator ()(const link_t &link);
+
+	GraphScope *m_scope;
+};
+
+GraphConnector::GraphConnector(GraphScope *scope)
+	:m_scope(scope)
+{
+}
+
+void GraphConnector::operator ()(const link_t &link)
+{
+	bool actual = g_actualLinks.find(link) != g_actualLinks.end();
+
+	if (actual && g_appliedLinks.find(link) != g_appliedLinks.end())
+		return;
+
+	if (m_scope && !m_scope->contains(link.first.client, link.second.client))
+		return;
+
+	if (actual)
+		g_appliedLinks.insert(link);
+	else if (!graphIsRefused(link))
+		graphQueue(link);
+}
+
+// Issues only the subscribes and unsubscribes needed to get from the actual
+// to the desired links. If scope is given, links outside of it are left untouched.
+static void graphApply(GraphScope *scope = NULL)
+{
+	for (links_t::iterator itr = g_appliedLinks.begin(); itr != g_appliedLinks.end();)
+	{
+		if (graphIsDesired(*itr) || (scope && !scope->contains(itr->first.client, itr->second.client)))
+		{
+			++itr;
+			continue;
+		}
+
+		links_t::iterator actual = g_actualLinks.find(*itr);
+		if (actual != g_actualLinks.end())
+		{
+			if (disconnect(itr->first, itr->second) >= 0)
+				graphEraseActual(actual);
+		}
+
+		g_appliedLinks.erase(itr++);
+	}
+
+	if (g_loopsUnchecked)
+		graphBreakLoops();
+
+	graphRecheckRefused();
+
+	GraphConnector connector(scope);
+	graphForEachDesired(connector);
+
+	graphDrain();
+}
+
+// Recomputes the desired links from the tracked ports and rules and applies them.
+static void graphReconcile(GraphScope *scope = NULL)
+{
+	graphDesireAll();
+	graphApply(scope);
+}
+
+// Snapshot of the applied links, by client and port names, so known routes can
+// be restored as soon as their ports appear after a restart, before the ports get
+// tracked and the rules evaluated. Links read from the snapshot are made only once,
+// the regular reconciliation after removes them again if the rules no longer agree.
+struct SavedLink
+{
+	std::string outputClient;
+	std::string outputPort;
+	std::string inputClient;
+	std::string inputPort;
+};
+
+typedef std::vector<SavedLink> saved_links_t;
+
+static const char *g_statePath = NULL;
+
+// Links of the snapshot whose ports have not appeared yet.
+static saved_links_t g_restoreLinks;
+
+// The applied links as of the last save.
+static links_t g_savedLinks;
+
+// Saving waits for the links to settle, so a burst of port changes costs one write of the flash.
+enum { STATE_SAVE_DELAY_US = 2000000 };
+
+// When the applied links that changed get saved, 0 if they didn't.
+static uint64_t g_stateSaveDue = 0;
+
+static bool stateFindEndpoint(EndpointDir dir, const std::string &clientName, const std::string &portName, snd_seq_addr_t &addr)
+{
+	for (int t=0; t<2; ++t)
+	{
+		const EndpointIndex &endpoints = g_endpoints[t][dir];
+		for (size_t i=0; i<endpoints.size(); ++i)
+		{
+			snd_seq_addr_t endpoint = endpointGetAddr(dir, endpoints[i]);
+
+			const ClientInfoCache::ClientInfo *info = g_clientInfo.find(endpoint.client);
+			if (!info || info->name != clientName)
+				continue;
+
+			if (portName == g_endpointTables[dir].getName(endpoints[i]))
+			{
+				addr = endpoint;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+static bool stateDescribe(snd_seq_addr_t output, snd_seq_addr_t input, SavedLink &link)
+{
+	int outputId, inputId;
+	const ClientInfoCache::ClientInfo *outputInfo = g_clientInfo.find(output.client);
+	const ClientInfoCache::ClientInfo *inputInfo = g_clientInfo.find(input.client);
+
+	if (!graphFindEndpoints(std::make_pair(output, input), outputId, inputId) || !outputInfo || !inputInfo)
+		return false;
+
+	link.outputClient = outputInfo->name;
+	link.outputPort = g_endpointTables[ENDPOINT_OUTPUT].getName(outputId);
+	link.inputClient = inputInfo->name;
+	link.inputPort = g_endpointTables[ENDPOINT_INPUT].getName(inputId);
+
+	return true;
+}
+
+static int stateLoad()
+{
+	FILE *f = fopen(g_statePath, "rt");
+	if (!f)
+		return errno == ENOENT ? 0 : -errno;
+
+	char line[4 * 64 + 8];
+	while (fgets(line, sizeof(line), f))
+	{
+		if (line[0] == '#')
+			continue;
+
+		line[strcspn(line, "\r\n")] = '\0';
+
+		char *fields[4];
+		char *p = line;
+		int n;
+		for (n=0; n<4 && p; ++n)
+		{
+			fields[n] = p;
+			p = strchr(p, '\t');
+			if (p)
+				*p++ = '\0';
+		}
+
+		if (n != 4 || p)
+			continue;
+
+		SavedLink link;
+		link.outputClient = fields[0];
+		link.outputPort = fields[1];
+		link.inputClient = fields[2];
+		link.inputPort = fields[3];
+		g_restoreLinks.push_back(link);
+	}
+
+	fclose(f);
+
+	logPrintf(LOG_LEVEL_INFO, "Read %u links from '%s'.", (unsigned)g_restoreLinks.size(), g_statePath);
+
+	return 0;
+}
+
+// Makes the links of the snapshot right after opening the sequencer, looking up their ports
+// by name without tracking any, so of clients of the same name the last one found gets them.
+// Links whose ports are missing or failed are left for stateRestore(), links that already
+// existed are not taken as applied. Nothing is known of the routes yet, so the first
+// graphApply() disconnects the links made that close a loop, see graphBreakLoops().
+static void stateRestoreEarly()
+{
+	if (g_restoreLinks.empty())
+		return;
+
+	enum { FOUND_OUTPUT = 1, FOUND_INPUT = 2 };
+
+	size_t count = g_restoreLinks.size();
+	std::vector<link_t> links(count);
+	std::vector<int> found(count, 0);
+
+	snd_seq_client_info_t *clientInfo;
+	snd_seq_port_info_t *portInfo;
+
+	snd_seq_client_info_alloca(&clientInfo);
+	snd_seq_port_info_alloca(&portInfo);
+	snd_seq_client_info_set_client(clientInfo, -1);
+	while (g_backend->queryNextClient(clientInfo) >= 0)
+	{
+		int clientId = snd_seq_client_info_get_client(clientInfo);
+		const char *clientName = snd_seq_client_info_get_name(clientInfo);
+
+		snd_seq_port_info_set_client(portInfo, clientId);
+		snd_seq_port_info_set_port(portInfo, -1);
+
+		while (g_backend->queryNextPort(portInfo) >= 0)
+		{
+			const char *portName = snd_seq_port_info_get_name(portInfo);
+
+			snd_seq_addr_t addr;
+			addr.client = clientId;
+			addr.port = snd_seq_port_info_get_port(portInfo);
+
+			for (size_t i=0; i<count; ++i)
+			{
+				const SavedLink &link = g_restoreLinks[i];
+				if (link.outputClient == clientName && link.outputPort == portName)
+				{
+					links[i].first = addr;
+					found[i] |= FOUND_OUTPUT;
+				}
+				if (link.inputClient == clientName && link.inputPort == portName)
+				{
+					links[i].second = addr;
+					found[i] |= FOUND_INPUT;
+				}
+			}
+		}
+	}
+
+	saved_links_t remaining;
+
+	for (size_t i=0; i<count; ++i)
+	{
+		const SavedLink &saved = g_restoreLinks[i];
+		if (found[i] != (FOUND_OUTPUT | FOUND_INPUT))
+		{
+			remaining.push_back(saved);
+			continue;
+		}
+
+		++g_stats.syscalls;
+		int result = g_backend->subscribe(links[i].first, links[i].second);
+		if (result == -EBUSY)
+			continue;
+
+		if (result < 0)
+		{
+			remaining.push_back(saved);
+			continue;
+		}
+
+		logPrintf(LOG_LEVEL_INFO, "Restored %s:%s -> %s:%s", saved.outputClient.c_str(), saved.outputPort.c_str(), saved.inputClient.c_str(), saved.inputPort.c_str());
+		++g_stats.subscribes;
+		g_appliedLinks.insert(links[i]);
+		g_loopsUnchecked = true;
+	}
+
+	g_restoreLinks.swap(remaining);
+}
+
+// Makes the links of the snapshot between ports that are tracked by now.
+static void stateRestore()
+{
+	for (saved_links_t::iterator itr = g_restoreLinks.begin(); itr != g_restoreLinks.end();)
+	{
+		snd_seq_addr_t output, input;
+		if (!stateFindEndpoint(ENDPOINT_OUTPUT, itr->outputClient, itr->outputPort, output) || !stateFindEndpoint(ENDPOINT_INPUT, itr->inputClient, itr->inputPort, input))
+		{
+			++itr;
+			continue;
+		}
+
+		link_t link(output, input);
+		if (g_actualLinks.find(link) == g_actualLinks.end())
+		{
+			logPrintf(LOG_LEVEL_INFO, "Restoring %s:%s -> %s:%s", itr->outputClient.c_str(), itr->outputPort.c_str(), itr->inputClient.c_str(), itr->inputPort.c_str());
+			if (graphConnect(link) >= 0)
+				g_appliedLinks.insert(link);
+		}
+
+		itr = g_restoreLinks.erase(itr);
+	}
+}
+
+static void stateWriteLink(FILE *f, const SavedLink &link)
+{
+	const std::string *names[4] = { &link.outputClient, &link.outputPort, &link.inputClient, &link.inputPort };
+	for (int i=0; i<4; ++i)
+	{
+		if (names[i]->find_first_of("\t\r\n") != std::string::npos)
+			return;
+	}
+
+	fprintf(f, "%s\t%s\t%s\t%s\n", link.outputClient.c_str(), link.outputPort.c_str(), link.inputClient.c_str(), link.inputPort.c_str());
+}
+
+// Schedules saving the snapshot once the applied links changed since the last save.
+static void stateSchedule()
+{
+	if (g_stateSaveDue == 0 && !(g_appliedLinks == g_savedLinks))
+		g_stateSaveDue = getTimeUs() + STATE_SAVE_DELAY_US;
+}
+
+static int stateGetTimeout()
+{
+	if (g_stateSaveDue == 0)
+		return -1;
+
+	uint64_t now = getTimeUs();
+	if (now >= g_stateSaveDue)
+		return 0;
+
+	return (g_stateSaveDue - now + 999) / 1000;
+}
+
+// Writes the snapshot if the applied links changed since the last time.
+static void stateSave()
+{
+	g_stateSaveDue = 0;
+
+	if (g_appliedLinks == g_savedLinks)
+		return;
+
+	std::string tmp = std::string(g_statePath) + ".tmp";
+
+	FILE *f = fopen(tmp.c_str(), "wt");
+	if (!f)
+	{
+		logPrintf(LOG_LEVEL_WARNING, "Failed writing '%s'! (%d)", tmp.c_str(), -errno);
+		return;
+	}
+
+	fprintf(f, "# amidiauto state: output client, output port, input client, input port.\n");
+
+	for (links_t::const_iterator itr = g_appliedLinks.begin(); itr != g_appliedLinks.end(); ++itr)
+	{
+		SavedLink link;
+		if (stateDescribe(itr->first, itr->second, link))
+			stateWriteLink(f, link);
+	}
+
+	// Links of ports that did not appear since the start are still known good.
+	for (saved_links_t::const_iterator itr = g_restoreLinks.begin(); itr != g_restoreLinks.end(); ++itr)
+		stateWriteLink(f, *itr);
+
+	bool failed = fflush(f) != 0 || fsync(fileno(f)) != 0;
+	failed = fclose(f) != 0 || failed;
+
+	if (failed || rename(tmp.c_str(), g_statePath) != 0)
+	{
+		logPrintf(LOG_LEVEL_WARNING, "Failed writing '%s'! (%d)", g_statePath, -errno);
+		unlink(tmp.c_str());
+		return;
+	}
+
+	g_savedLinks = g_appliedLinks;
+}
+
+// Tracks the ports present and learns the links between them, without evaluating the rules.
+static void portsScan()
+{
+	snd_seq_client_info_t *clientInfo;
+	snd_seq_port_info_t *portInfo;
+
+	snd_seq_client_info_alloca(&clientInfo);
+	snd_seq_port_info_alloca(&portInfo);
+	snd_seq_client_info_set_client(clientInfo, -1);
+	while (g_backend->queryNextClient(clientInfo) >= 0)
+	{
+		int clientId = snd_seq_client_info_get_client(clientInfo);
+
+		g_clientInfo.set(clientId, snd_seq_client_info_get_name(clientInfo));
+
+		snd_seq_port_info_set_client(portInfo, clientId);
+		snd_seq_port_info_set_port(portInfo, -1);
+
+		while (g_backend->queryNextPort(portInfo) >= 0)
+		{
+			portAdd(*portInfo);
+		}
+	}
+
+	graphQueryActual();
+}
+
+static int portsInit()
+{
+	portsScan();
+
+	// Initially connect everything together.
+	stateRestore();
+	graphReconcile();
+
+	return 0;
+}
+
+static void seqUninit()
+{
+	if (g_port >= 0)
+	{
+		snd_seq_delete_simple_port(g_seq, g_port);
+		g_port = -1;
+	}
+	if (g_seq)
+	{
+		snd_seq_close(g_seq);
+		g_seq = NULL;
+	}
+}
+
+// Sizes of the kernel side input pool in events and the library side input buffer in bytes, 0 keeps the defaults.
+static unsigned g_inputPool = 0;
+static unsigned g_inputBuffer = 0;
+
+// Smaller sequencer pools and buffers, and heap memory handed back early, see lowMemoryInit().
+#ifndef AMIDIAUTO_TINY
+static bool g_lowMemory = false;
+#else
+static bool g_lowMemory = true;
+#endif
+
+enum
+{
+	// Used unless given by --input-pool and --input-buffer. Announcements beyond these
+	// overflow the input and resynchronize all connections, see handleSeqEvent().
+	LOW_MEMORY_INPUT_POOL     = 64,
+	LOW_MEMORY_INPUT_BUFFER   = 2048,
+
+	// Nothing but subscriptions gets sent.
+	LOW_MEMORY_OUTPUT_POOL    = 8,
+	LOW_MEMORY_OUTPUT_BUFFER  = 512,
+
+	LOW_MEMORY_TRIM_THRESHOLD = 16 * 1024,
+};
+
+static int seqInit()
+{
+	if (g_seq != NULL)
+	{
+		logPrintf(LOG_LEVEL_ERROR, "Already initialized!");
+		return -EINVAL;
+	}
+
+	// Non-blocking, so reading the input never stalls the loop, see handleSeqEvent().
+	int result = snd_seq_open(&g_seq, "default", SND_SEQ_OPEN_DUPLEX, SND_SEQ_NONBLOCK);
+	if (result < 0)
+	{
+		logPrintf(LOG_LEVEL_ERROR, "Couldn't open ALSA sequencer! (%d)", result);
+		goto error;
+	}
+
+	if (g_lowMemory)
+	{
+		if (g_inputPool == 0)
+			g_inputPool = LOW_MEMORY_INPUT_POOL;
+		if (g_inputBuffer == 0)
+			g_inputBuffer = LOW_MEMORY_INPUT_BUFFER;
+
+		result = snd_seq_set_client_pool_output(g_seq, LOW_MEMORY_OUTPUT_POOL);
+		if (result < 0)
+			logPrintf(LOG_LEVEL_ERROR, "Failed setting output pool size to %u! (%d)", LOW_MEMORY_OUTPUT_POOL, result);
+
+		result = snd_seq_set_output_buffer_size(g_seq, LOW_MEMORY_OUTPUT_BUFFER);
+		if (result < 0)
+			logPrintf(LOG_LEVEL_ERROR, "Failed setting output buffer size to %u! (%d)", LOW_MEMORY_OUTPUT_BUFFER, result);
+	}
+
+	if (g_inputPool > 0)
+	{
+		result = snd_seq_set_client_pool_input(g_seq, g_inputPool);
+		if (result < 0)
+			logPrintf(LOG_LEVEL_ERROR, "Failed setting input pool size to %u! (%d)", g_inputPool, result);
+	}
+
+	if (g_inputBuffer > 0)
+	{
+		result = snd_seq_set_input_buffer_size(g_seq, g_inputBuffer);
+		if (result < 0)
+			logPrintf(LOG_LEVEL_ERROR, "Failed setting input buffer size to %u! (%d)", g_inputBuffer, result);
+	}
+
+	result = snd_seq_set_client_name(g_seq, "amidiauto");
+	if (result < 0)
+	{
+		logPrintf(LOG_LEVEL_ERROR, "Failed setting client name! (%d)", result);
+		goto error;
+	}
+
+	result = snd_seq_create_simple_port(
+		g_seq,
+		"amidiauto",
+		SND_SEQ_PORT_CAP_WRITE |
+		SND_SEQ_PORT_CAP_NO_EXPORT,
+		SND_SEQ_PORT_TYPE_APPLICATION
+		);
+
+	if (result < 0)
+	{
+		logPrintf(LOG_LEVEL_ERROR, "Couldn't create a virtual MIDI port! (%d)", result);
+		goto error;
+	}
+
+	g_port = result;
+
+	result = snd_seq_connect_from(g_seq, g_port, SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_ANNOUNCE);
+
+	if (result < 0)
+	{
+		logPrintf(LOG_LEVEL_ERROR, "Couldn't connect to System::Anounce port! (%d)", result);
+		goto error;
+	}
+
+	// Have the kernel deliver only the announcements we act on.
+	static const int events[] =
+	{
+		SND_SEQ_EVENT_CLIENT_START,
+		SND_SEQ_EVENT_CLIENT_EXIT,
+		SND_SEQ_EVENT_CLIENT_CHANGE,
+		SND_SEQ_EVENT_PORT_START,
+		SND_SEQ_EVENT_PORT_EXIT,
+		SND_SEQ_EVENT_PORT_CHANGE,
+		SND_SEQ_EVENT_PORT_SUBSCRIBED,
+		SND_SEQ_EVENT_PORT_UNSUBSCRIBED,
+	};
+
+	for (size_t i=0; i<sizeof(events)/sizeof(events[0]); ++i)
+	{
+		result = snd_seq_set_client_event_filter(g_seq, events[i]);
+		if (result < 0)
+		{
+			logPrintf(LOG_LEVEL_ERROR, "Failed setting event filter! (%d)", result);
+			goto error;
+		}
+	}
+
+	return 0;
+
+error:
+	seqUninit();
+	return result;
+}
+
+static bool g_graphDirty = false;
+static unsigned g_coalesceMs = 0;
+static uint64_t g_coalesceDeadline = 0;
+
+static void pendingArm()
+{
+	if (g_pendingPorts.empty() && !g_graphDirty)
+		g_coalesceDeadline = getTimeUs() + g_coalesceMs * 1000u;
+}
+
+static void pendingAdd(snd_seq_addr_t addr, PendingFlags flag)
+{
+	pendingArm();
+
+	PendingPort *item = pendingFind(addr);
+
+	if (!item)
+	{
+		PendingPort port;
+		port.addr = addr;
+		port.flags = flag;
+		port.arrivalUs = flag == PENDING_START ? getTimeUs() : 0;
+		g_pendingPorts.push_back(port);
+	}
+	else if (flag == PENDING_START)
+	{
+		item->flags |= PENDING_START;
+		if (item->arrivalUs == 0)
+			item->arrivalUs = getTimeUs();
+	}
+	else if (flag == PENDING_CHANGE)
+	{
+		// A pending start reads the up to date port info anyway.
+		if (!(item->flags & PENDING_START))
+			item->flags |= PENDING_CHANGE;
+	}
+	else if (item->flags & PENDING_EXIT)
+	{
+		// Exit, start and exit again, only the first exit matters.
+		item->flags = PENDING_EXIT;
+	}
+	else if (item->flags & PENDING_START)
+	{
+		// The port appeared and disappeared within the window, nothing to do.
+		*item = g_pendingPorts.back();
+		g_pendingPorts.pop_back();
+	}
+	else
+	{
+		item->flags = PENDING_EXIT;
+	}
+}
+
+// Schedules a reconcile with the next flush, even if no ports change.
+static void pendingMarkDirty()
+{
+	pendingArm();
+	g_graphDirty = true;
+}
+
+// Returns the number of milliseconds until pending ports must be flushed, or -1 if none are pending.
+static int pendingGetTimeout()
+{
+	if (g_pendingPorts.empty() && !g_graphDirty)
+		return -1;
+
+	uint64_t now = getTimeUs();
+	if (now >= g_coalesceDeadline)
+		return 0;
+
+	return (g_coalesceDeadline - now + 999) / 1000;
+}
+
+// Tracks candidate ports of the client in the slots left by exited ones, and makes
+// the promoted ports desired, so only their links get evaluated. Returns true if any got promoted.
+static bool portFailover(int clientId)
+{
+	Client *client = g_clients.find(clientId);
+	const ClientInfoCache::ClientInfo *info = g_clientInfo.get(clientId);
+	if (!client || !info)
+		return false;
+
+	static const PortDir dirs[2] = { DIR_OUTPUT, DIR_INPUT };
+
+	bool promoted = false;
+
+	for (int d=0; d<2; ++d)
+	{
+		EndpointDir dir = (EndpointDir)d;
+
+		while (client->getCandidateCount(dir) > 0)
+		{
+			size_t count = client->getEndpointCount(dir);
+			if (count >= MAX_CLIENT_PORTS || !g_rules.hasPortRoom(info->portPolicy, count))
+				break;
+
+			snd_seq_addr_t addr;
+			addr.client = clientId;
+			addr.port = client->getCandidate(dir, 0);
+
+			snd_seq_port_info_t *portInfo;
+			snd_seq_port_info_alloca(&portInfo);
+
+			// The name is needed for tracking, and checks the port is still there.
+			++g_stats.syscalls;
+			if (g_backend->getPortInfo(addr.client, addr.port, portInfo) < 0 || !(portGetDir(*portInfo) & dirs[d]))
+			{
+				client->removeCandidate(dir, addr.port);
+				continue;
+			}
+
+			int id = g_endpointTables[dir].add(addr, snd_seq_port_info_get_name(portInfo));
+			if (id < 0)
+				break;
+
+			client->removeCandidate(dir, addr.port);
+			client->addEndpoint(dir, addr.port, id);
+			g_endpoints[client->getType()][dir].add(id);
+
+			if (dir == ENDPOINT_OUTPUT)
+				monitorTap(id);
+
+			logPrintf(LOG_LEVEL_INFO, "%d:%d port promoted as %s.", addr.client, addr.port, dir == ENDPOINT_OUTPUT ? "output" : "input");
+			++g_stats.failovers;
+
+			if (!g_graphDirty)
+				graphDesirePort(addr, dirs[d]);
+			promoted = true;
+		}
+	}
+
+	return promoted;
+}
+
+static void pendingFlush()
+{
+	uint64_t syscalls = g_stats.syscalls;
+	uint64_t allocations = g_stats.allocations;
+	bool changed = false;
+
+	// Ports are handled in address order, as they would be enumerated.
+	std::sort(g_pendingPorts.begin(), g_pendingPorts.end());
+
+	for (pending_ports_t::const_iterator itr = g_pendingPorts.begin(); itr != g_pendingPorts.end(); ++itr)
+	{
+		if (itr->flags & PENDING_EXIT)
+		{
+			graphRemovePort(itr->addr);
+			portRemove(itr->addr);
+			changed = true;
+		}
+	}
+
+	// Once all the exits are known, so none of them gets promoted. A port that
+	// came back within the window takes its place again instead.
+	for (pending_ports_t::const_iterator itr = g_pendingPorts.begin(); itr != g_pendingPorts.end(); ++itr)
+	{
+		if ((itr->flags & (PENDING_EXIT | PENDING_START)) == PENDING_EXIT && portFailover(itr->addr.client))
+			changed = true;
+	}
+
+	for (pending_ports_t::const_iterator itr = g_pendingPorts.begin(); itr != g_pendingPorts.end(); ++itr)
+	{
+		if (!(itr->flags & (PENDING_START | PENDING_CHANGE)))
+			continue;
+
+		snd_seq_addr_t addr = itr->addr;
+
+		if (itr->flags & PENDING_CHANGE)
+		{
+			// Its subscriptions remain, graphApply() drops the ones no longer desired.
+			graphUndesirePort(addr);
+			portRemove(addr, true);
+			changed = true;
+		}
+
+		snd_seq_port_info_t *portInfo;
+		snd_seq_port_info_alloca(&portInfo);
+
+		++g_stats.syscalls;
+		int result = g_backend->getPortInfo(addr.client, addr.port, portInfo);
+		if (result < 0)
+		{
+			logPrintf(LOG_LEVEL_ERROR, "Failed getting port %d:%d info: %d", addr.client, addr.port, result);
+			continue;
+		}
+
+		PortDir added = portAdd(*portInfo);
+		if (added != DIR_UNKNOWN)
+		{
+			if (!g_graphDirty)
+				graphDesirePort(addr, added);
+			changed = true;
+		}
+	}
+
+	if (changed && !g_restoreLinks.empty())
+		stateRestore();
+
+	if (g_graphDirty)
+	{
+		g_graphDirty = false;
+		graphReconcile();
+	}
+	else if (changed)
+	{
+		graphApply();
+	}
+
+	// Kept until now for the arrival times of the ports getting connected.
+	g_pendingPorts.clear();
+
+	g_stats.syscallsPerFlush.add(g_stats.syscalls - syscalls);
+	g_stats.eventAllocations += g_stats.allocations - allocations;
+
+	heapSample();
+}
+
+// Rates are measured over this long.
+enum { MONITOR_INTERVAL_US = 1000000 };
+
+// Most monitored events read per wakeup, so a flood can't starve the announcements.
+enum { MONITOR_MAX_BATCH = 256 };
+
+static void handleMonitorEvents()
+{
+	snd_seq_event_t *ev;
+
+	for (int i=0; i<MONITOR_MAX_BATCH; ++i)
+	{
+		int result = snd_seq_event_input(g_monitorSeq, &ev);
+		if (result == -ENOSPC)
+			continue; // Events got lost, the rates are a lower bound then.
+		if (result < 0 || !ev)
+			break;
+
+		const Client *client = findClientForPort(ev->source);
+		int outputId = client ? client->findEndpoint(ENDPOINT_OUTPUT, ev->source.port) : -1;
+		if (outputId >= 0 && g_monitorSources[outputId].state != MONITOR_OFF)
+			++g_monitorSources[outputId].events;
+
+		++g_stats.monitoredEvents;
+	}
+}
+
+// Returns the number of milliseconds until the next sample is due, or -1 if nothing is monitored.
+static int monitorGetTimeout()
+{
+	if (g_monitorTapCount == 0)
+		return -1;
+
+	uint64_t now = getTimeUs();
+	if (now >= g_monitorSampleUs + MONITOR_INTERVAL_US)
+		return 0;
+
+	return (g_monitorSampleUs + MONITOR_INTERVAL_US - now + 999) / 1000;
+}
+
+// Updates the rates and mutes the outputs going over their limit, and unmutes the
+// throttled ones once their hold time is over and they are back under it.
+static void monitorSample()
+{
+	uint64_t now = getTimeUs();
+	uint64_t elapsed = now - g_monitorSampleUs;
+	g_monitorSampleUs = now;
+
+	if (elapsed == 0)
+		return;
+
+	bool changed = false;
+
+	for (int id=0; id<MAX_ENDPOINTS; ++id)
+	{
+		MonitorSource &source = g_monitorSources[id];
+		if (source.state == MONITOR_OFF)
+			continue;
+
+		source.rate = (uint32_t)(source.events * 1000000ull / elapsed);
+		source.events = 0;
+		if (source.rate > source.peak)
+			source.peak = source.rate;
+
+		snd_seq_addr_t addr = endpointGetAddr(ENDPOINT_OUTPUT, id);
+
+		const ClientInfoCache::ClientInfo *info = g_clientInfo.get(addr.client);
+		if (!info || info->rateLimit < 0)
+			continue;
+
+		const ConnectionRules::RateLimit &limit = g_rules.getRateLimit(info->rateLimit);
+		bool over = source.rate > limit.eventsPerSecond;
+
+		if (source.state == MONITOR_OK && over)
+		{
+			++g_stats.rateLimited;
+
+			if (limit.holdSeconds != 0)
+			{
+				logPrintf(LOG_LEVEL_WARNING, "%d:%d sent %u events/s, over its limit of %u, throttling it for %u s!", addr.client, addr.port, source.rate, limit.eventsPerSecond, limit.holdSeconds);
+				source.state = MONITOR_THROTTLED;
+				source.mutedUntilUs = now + limit.holdSeconds * 1000000ull;
+			}
+			else
+			{
+				logPrintf(LOG_LEVEL_WARNING, "%d:%d sent %u events/s, over its limit of %u, disconnecting it!", addr.client, addr.port, source.rate, limit.eventsPerSecond);
+				source.state = MONITOR_DISCONNECTED;
+			}
+
+			g_desiredLinks.clearOutput(id);
+			changed = true;
+		}
+		else if (source.state == MONITOR_THROTTLED && now >= source.mutedUntilUs)
+		{
+			if (over)
+			{
+				source.mutedUntilUs = now + limit.holdSeconds * 1000000ull;
+				continue;
+			}
+
+			logPrintf(LOG_LEVEL_INFO, "%d:%d is back under its limit, reconnecting it.", addr.client, addr.port);
+			source.state = MONITOR_OK;
+
+			if (!g_graphDirty)
+				graphDesirePort(addr, DIR_OUTPUT);
+			changed = true;
+		}
+	}
+
+	if (changed && !g_graphDirty)
+		graphApply();
+}
+
+// Minimum time between full resynchronizations, so overflow storms are not made worse.
+enum { RESYNC_INTERVAL_US = 1000000 };
+
+static bool g_resyncPending = false;
+static uint64_t g_resyncDeadline = 0;
+static uint64_t g_lastResync = 0;
+
+static void resyncRequest()
+{
+	if (g_resyncPending)
+		return;
+
+	uint64_t now = getTimeUs();
+
+	g_resyncPending = true;
+	g_resyncDeadline = g_stats.resyncs > 0 && now - g_lastResync < RESYNC_INTERVAL_US ? g_lastResync + RESYNC_INTERVAL_US : now;
+}
+
+// Returns the number of milliseconds until the requested resync is due, or -1 if none is.
+static int resyncGetTimeout()
+{
+	if (!g_resyncPending)
+		return -1;
+
+	uint64_t now = getTimeUs();
+	if (now >= g_resyncDeadline)
+		return 0;
+
+	return (g_resyncDeadline - now + 999) / 1000;
+}
+
+// Forgets all the tracked state and rebuilds it from the sequencer, used when announcements were lost.
+static void resync()
+{
+	logPrintf(LOG_LEVEL_INFO, "Resynchronizing with the sequencer.");
+
+	g_resyncPending = false;
+	g_lastResync = getTimeUs();
+	++g_stats.resyncs;
+
+	// Anything still queued is superseded by the enumeration.
+	g_backend->dropInput();
+
+	g_pendingPorts.clear();
+	g_graphDirty = false;
+
+	monitorClear();
+	g_retryLinks.clear();
+	g_clients.clear();
+	endpointsClear();
+	g_desiredLinks.clear();
+	g_clientInfo.clear();
+
+	portsInit();
+
+	// Links we made to ports that are gone are no longer our concern.
+	for (links_t::iterator itr = g_appliedLinks.begin(); itr != g_appliedLinks.end();)
+	{
+		if (g_actualLinks.find(*itr) == g_actualLinks.end())
+			g_appliedLinks.erase(itr++);
+		else
+			++itr;
+	}
+
+	heapSample();
+}
+
+static bool handleSeqEvent()
+{
+	uint64_t allocations = g_stats.allocations;
+
+	do
+	{
+		snd_seq_event_t *ev;
+		int result = g_backend->eventInput(&ev);
+
+		if (result == -ENOSPC)
+		{
+			++g_stats.inputOverflows;
+			logPrintf(LOG_LEVEL_WARNING, "Sequencer input overflow, events were lost! (%u so far)", g_stats.inputOverflows);
+			resyncRequest();
+			continue;
+		}
+		else if (result == -EAGAIN)
+		{
+			break;
+		}
+		else if (result < 0)
+		{
+			logPrintf(LOG_LEVEL_ERROR, "Failed reading sequencer event! (%d)", result);
+			break;
+		}
+
+		++g_stats.announcements;
+
+		switch (ev->type)
+		{
+		case SND_SEQ_EVENT_PORT_START:
+			logPrintf(LOG_LEVEL_INFO, "%d:%d port appeared.", ev->data.addr.client, ev->data.addr.port);
+
+			pendingAdd(ev->data.addr, PENDING_START);
+			break;
+		case SND_SEQ_EVENT_PORT_EXIT:
+			logPrintf(LOG_LEVEL_INFO, "%d:%d port removed.", ev->data.addr.client, ev->data.addr.port);
+
+			pendingAdd(ev->data.addr, PENDING_EXIT);
+			break;
+		case SND_SEQ_EVENT_PORT_CHANGE:
+			logPrintf(LOG_LEVEL_INFO, "%d:%d port changed.", ev->data.addr.client, ev->data.addr.port);
+
+			pendingAdd(ev->data.addr, PENDING_CHANGE);
+			break;
+		case SND_SEQ_EVENT_PORT_SUBSCRIBED:
+			if (!monitorIsTap(ev->data.connect.dest))
+				graphAddActual(std::make_pair(ev->data.connect.sender, ev->data.connect.dest));
+			break;
+		case SND_SEQ_EVENT_PORT_UNSUBSCRIBED:
+			graphEraseActual(std::make_pair(ev->data.connect.sender, ev->data.connect.dest));
+			break;
+		case SND_SEQ_EVENT_CLIENT_START:
+			g_clientInfo.invalidate(ev->data.addr.client);
+			g_refusedStale = true;
+			break;
+		case SND_SEQ_EVENT_CLIENT_EXIT:
+			logPrintf(LOG_LEVEL_INFO, "%d client removed.", ev->data.addr.client);
+
+			// Its links are gone with it, the links of the other clients are unaffected.
+			g_clientInfo.invalidate(ev->data.addr.client);
+			g_refusedStale = true;
+			graphRemoveClient(ev->data.addr.client);
+			clientRemove(ev->data.addr.client);
+			break;
+		case SND_SEQ_EVENT_CLIENT_CHANGE:
+			logPrintf(LOG_LEVEL_INFO, "%d client changed.", ev->data.addr.client);
+
+			// The rules may treat the new name differently.
+			g_clientInfo.invalidate(ev->data.addr.client);
+			g_refusedStale = true;
+			pendingMarkDirty();
+			break;
+		default:
+			break;
+		}
+
+		snd_seq_free_event(ev);
+	} while (g_backend->eventInputPending() > 0);
+
+	g_stats.eventAllocations += g_stats.allocations - allocations;
+
+	if (g_coalesceMs == 0 && !g_resyncPending)
+		pendingFlush();
+
+	return false;
+}
+
+static int reloadRules(ConnectionRules &rules);
+
+static const char *g_rulesFile = NULL;
+static bool g_watchRules = false;
+
+// Service manager notifications, the sd_notify(3) protocol without depending on libsystemd.
+static int g_notifyFd = -1;
+static sockaddr_un g_notifyAddr;
+static socklen_t g_notifyAddrLength = 0;
+
+static uint64_t g_watchdogIntervalUs = 0;
+static uint64_t g_watchdogDeadline = 0;
+
+static void notifyInit()
+{
+	const char *path = getenv("NOTIFY_SOCKET");
+	if (!path || (path[0] != '/' && path[0] != '@') || strlen(path) >= sizeof(g_notifyAddr.sun_path))
+		return;
+
+	memset(&g_notifyAddr, 0, sizeof(g_notifyAddr));
+	g_notifyAddr.sun_family = AF_UNIX;
+	strcpy(g_notifyAddr.sun_path, path);
+
+	// Abstract namespace socket.
+	if (path[0] == '@')
+		g_notifyAddr.sun_path[0] = '\0';
+
+	g_notifyAddrLength = offsetof(sockaddr_un, sun_path) + strlen(path);
+
+	g_notifyFd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (g_notifyFd < 0)
+	{
+		logPrintf(LOG_LEVEL_WARNING, "Failed creating notification socket! (%d)", -errno);
+		return;
+	}
+
+	// Ping at half the interval the service manager expects, as recommended.
+	const char *usec = getenv("WATCHDOG_USEC");
+	const char *pid = getenv("WATCHDOG_PID");
+	if (usec && (!pid || strtol(pid, NULL, 10) == getpid()))
+		g_watchdogIntervalUs = strtoull(usec, NULL, 10) / 2;
+}
+
+static void notifyUninit()
+{
+	if (g_notifyFd >= 0)
+		close(g_notifyFd);
+
+	g_notifyFd = -1;
+}
+
+static void notifySend(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void notifySend(const char *fmt, ...)
+{
+	if (g_notifyFd < 0)
+		return;
+
+	char message[256];
+
+	va_list args;
+	va_start(args, fmt);
+	int n = vsnprintf(message, sizeof(message), fmt, args);
+	va_end(args);
+
+	if (n < 0 || (size_t)n >= sizeof(message))
+		return;
+
+	if (sendto(g_notifyFd, message, n, MSG_NOSIGNAL, (const sockaddr*)&g_notifyAddr, g_notifyAddrLength) < 0)
+		logPrintf(LOG_LEVEL_WARNING, "Failed notifying the service manager! (%d)", -errno);
+}
+
+// Returns the number of milliseconds until the watchdog is due, or -1 if it's not enabled.
+static int notifyGetTimeout()
+{
+	if (g_notifyFd < 0 || g_watchdogIntervalUs == 0)
+		return -1;
+
+	uint64_t now = getTimeUs();
+	if (now >= g_watchdogDeadline)
+		return 0;
+
+	return (g_watchdogDeadline - now + 999) / 1000;
+}
+
+static void notifyWatchdog()
+{
+	if (notifyGetTimeout() != 0)
+		return;
+
+	notifySend("WATCHDOG=1");
+	g_watchdogDeadline = getTimeUs() + g_watchdogIntervalUs;
+}
+
+// Tells the service manager the initial connections are in place.
+static void notifyReady()
+{
+	size_t endpoints = 0;
+	for (int t=0; t<2; ++t)
+		endpoints += g_endpoints[t][ENDPOINT_OUTPUT].size() + g_endpoints[t][ENDPOINT_INPUT].size();
+
+	unsigned long long ms = (getTimeUs() - g_startTimeUs) / 1000u;
+
+	logPrintf(LOG_LEVEL_INFO, "Connected %u links between %u ports in %llu ms.", (unsigned)g_appliedLinks.size(), (unsigned)endpoints, ms);
+	notifySend("READY=1\nSTATUS=Connected %u links between %u ports in %llu ms.", (unsigned)g_appliedLinks.size(), (unsigned)endpoints, ms);
+}
+
+static void rulesReload()
+{
+	notifySend("RELOADING=1\nMONOTONIC_USEC=%llu", (unsigned long long)getTimeUs());
+
+	ConnectionRules rules;
+	if (reloadRules(rules) < 0)
+	{
+		notifySend("READY=1");
+		return;
+	}
+
+	ConnectionRules changes;
+	g_rules.diff(rules, changes);
+
+	bool portsChanged = !g_rules.hasSamePortPolicies(rules);
+	bool thruChanged = !g_rules.hasSameThru(rules);
+	bool prioritiesChanged = !g_rules.hasSamePriorities(rules);
+
+	// The limits have no effect unless monitoring.
+	bool sameLimits = g_rules.hasSameRateLimits(rules);
+	bool limitsChanged = g_monitorSeq && !sameLimits;
+
+	if (!changes.hasRules() && !portsChanged && !thruChanged && !limitsChanged)
+	{
+		// Those only order the links made from now on, or wait for --monitor.
+		if (prioritiesChanged || !sameLimits)
+		{
+			logPrintf(LOG_LEVEL_INFO, prioritiesChanged ? "Priorities changed." : "Rate limits changed, they apply only with --monitor.");
+			g_rules = rules;
+			notifySend("READY=1");
+			return;
+		}
+
+		logPrintf(LOG_LEVEL_INFO, "Rules unchanged.");
+		notifySend("READY=1");
+		return;
+	}
+
+	g_rules = rules;
+
+	if (thruChanged)
+	{
+		g_refusedStale = true;
+		g_loopsUnchecked = true;
+	}
+
+	if (portsChanged)
+	{
+		// Which ports are tracked may differ for any client, select them all over again.
+		logPrintf(LOG_LEVEL_INFO, "Port selection changed.");
+		resyncRequest();
+		notifySend("READY=1");
+		return;
+	}
+
+	// Muted outputs get linked again.
+	bool unmuted = false;
+	if (limitsChanged)
+	{
+		logPrintf(LOG_LEVEL_INFO, "Rate limits changed.");
+		unmuted = monitorRetap();
+	}
+
+	if (thruChanged || unmuted)
 	{
-		client->clearInput();
+		// Links refused for closing a loop may be fine now and links made before may close one,
+		// or outputs got unmuted, for any client.
+		graphReconcile();
 	}
-	if (client->isOutputSet() && *client->getOutput() == addr)
+	else if (changes.hasRules())
 	{
-		client->clearOutput();
+		GraphScope scope(changes);
+		graphReconcile(&scope);
 	}
+
+	notifySend("READY=1");
 }
 
-static void portAutoConnect(snd_seq_addr_t addr, PortDir dir)
+static int rulesWatchInit()
 {
-	ClientType type;
-	Client *client = findClientForPort(addr, &type);
-	assert(client);
+	char dir[PATH_MAX];
+	strncpy(dir, g_rulesFile, sizeof(dir)-1);
+	dir[sizeof(dir)-1] = '\0';
 
-	if (!client)
+	char *slash = strrchr(dir, '/');
+	if (slash)
+		*slash = '\0';
+	else
+		strcpy(dir, ".");
+
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	// Watch the directory, so files replaced by editors are noticed as well.
+	if (inotify_add_watch(fd, *dir ? dir : "/", IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+	{
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+
+	return fd;
+}
+
+// Returns true if the rule file was written to.
+static bool rulesWatchRead(int fd)
+{
+	const char *name = strrchr(g_rulesFile, '/');
+	name = name ? name + 1 : g_rulesFile;
+
+	bool changed = false;
+
+	char buffer[4096] __attribute__((aligned(__alignof__(inotify_event))));
+	ssize_t n;
+	while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+	{
+		for (char *p = buffer; p < buffer + n; p += sizeof(inotify_event) + ((inotify_event*)p)->len)
+		{
+			const inotify_event *ev = (const inotify_event*)p;
+			if (ev->len > 0 && strcmp(ev->name, name) == 0)
+				changed = true;
+		}
+	}
+
+	return changed;
+}
+
+// Scheduling and memory locking of the process, so reacting to a plugged in
+// device is not held up by busy audio threads or by paging.
+enum
+{
+	PREFAULT_STACK_SIZE = 256 * 1024,
+	PREFAULT_HEAP_SIZE  = 1024 * 1024,
+};
+
+static int g_schedPolicy = SCHED_OTHER;
+static int g_schedPriority = 0;
+static bool g_lockMemory = false;
+
+static const char *realtimePolicyName(int policy)
+{
+	switch (policy)
+	{
+	case SCHED_FIFO:  return "fifo";
+	case SCHED_RR:    return "rr";
+	case SCHED_OTHER: return "other";
+	default:          return "unknown";
+	}
+}
+
+#ifndef AMIDIAUTO_BENCH
+// Returns the policy, or -1 if the name is not known.
+static int realtimeParsePolicy(const char *name)
+{
+	if (strcmp(name, "fifo") == 0)
+		return SCHED_FIFO;
+	if (strcmp(name, "rr") == 0)
+		return SCHED_RR;
+	if (strcmp(name, "other") == 0)
+		return SCHED_OTHER;
+
+	return -1;
+}
+#endif
+
+static void __attribute__((noinline)) realtimePrefaultStack()
+{
+	volatile char stack[PREFAULT_STACK_SIZE];
+	for (size_t i=0; i<sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
+static void realtimePrefaultHeap()
+{
+	// Keep freed memory within the heap instead of returning it to the system.
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+
+	char *heap = (char*)malloc(PREFAULT_HEAP_SIZE);
+	if (!heap)
+		return;
+
+	for (size_t i=0; i<PREFAULT_HEAP_SIZE; i += 4096)
+		heap[i] = 0;
+
+	free(heap);
+}
+
+#ifndef AMIDIAUTO_BENCH
+// To be called before anything gets allocated.
+static void lowMemoryInit()
+{
+	// A single arena, no padding of the heap top, and freed memory returned sooner.
+	mallopt(M_ARENA_MAX, 1);
+	mallopt(M_TOP_PAD, 0);
+	mallopt(M_TRIM_THRESHOLD, LOW_MEMORY_TRIM_THRESHOLD);
+}
+#endif
+
+// Returns the memory freed after loading the rules and making the initial connections
+// to the system. Locked memory is kept, see realtimePrefaultHeap().
+static void lowMemoryTrim()
+{
+	if (g_lowMemory && !g_lockMemory)
+		malloc_trim(0);
+}
+
+// To be called once the initial connections are made, failures are not fatal.
+static void realtimeInit()
+{
+	if (g_lockMemory)
+	{
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0)
+		{
+			realtimePrefaultStack();
+			realtimePrefaultHeap();
+		}
+		else
+		{
+			logPrintf(LOG_LEVEL_WARNING, "Failed locking memory! (%d)", -errno);
+		}
+	}
+
+	if (g_schedPolicy != SCHED_OTHER)
+	{
+		sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = g_schedPriority;
+
+		if (sched_setscheduler(0, g_schedPolicy, &param) != 0)
+			logPrintf(LOG_LEVEL_WARNING, "Failed setting %s scheduling at priority %d! (%d)", realtimePolicyName(g_schedPolicy), g_schedPriority, -errno);
+	}
+}
+
+// Returns a field of /proc/self/status in kB, like "VmLck", or -1 if unknown.
+static int procGetStatusKb(const char *field)
+{
+	FILE *f = fopen("/proc/self/status", "rt");
+	if (!f)
+		return -1;
+
+	size_t length = strlen(field);
+
+	int kb = -1;
+	char line[128];
+	while (fgets(line, sizeof(line), f))
+	{
+		if (strncmp(line, field, length) == 0 && line[length] == ':' && sscanf(line + length + 1, "%d kB", &kb) == 1)
+			break;
+	}
+
+	fclose(f);
+	return kb;
+}
+
+static void statsPrint()
+{
+	logFlush();
+	heapSample();
+
+	printf("Statistics:\n");
+	printf("Announcements: %llu\n", (unsigned long long)g_stats.announcements);
+	printf("Sequencer calls: %llu", (unsigned long long)g_stats.syscalls);
+	if (g_stats.announcements != 0)
+		printf(", %.2f per announcement", (double)g_stats.syscalls / g_stats.announcements);
+	printf("\n");
+	printf("Subscribed: %llu, unsubscribed: %llu\n", (unsigned long long)g_stats.subscribes, (unsigned long long)g_stats.unsubscribes);
+	printf("Rule checks: %llu", (unsigned long long)g_stats.ruleChecks);
+	if (g_stats.ruleCheckNs != 0)
+		printf(", %llu us total, %llu ns avg", (unsigned long long)(g_stats.ruleCheckNs / 1000u), (unsigned long long)(g_stats.ruleCheckNs / g_stats.ruleChecks));
+	printf("\n");
+	printf("Input overflows: %u, resyncs: %u\n", g_stats.inputOverflows, g_stats.resyncs);
+	printf("Ports promoted on exit: %u\n", g_stats.failovers);
+	printf("Subscriptions retried: %llu, given up: %u, pending: %u\n", (unsigned long long)g_stats.retries, g_stats.retriesFailed, (unsigned)g_retryLinks.size());
+	printf("Loop checks: %llu", (unsigned long long)g_stats.loopChecks);
+	if (g_stats.loopCheckNs != 0)
+		printf(", %llu ns avg", (unsigned long long)(g_stats.loopCheckNs / g_stats.loopChecks));
+	printf(", links refused: %u\n", g_stats.loopsRefused);
+	printf("Priority links: %llu", (unsigned long long)g_stats.priorityLinks);
+	if (g_stats.firstPriorityLinkUs != 0)
+		printf(", first made %llu ms after starting", (unsigned long long)(g_stats.firstPriorityLinkUs / 1000u));
+	printf("\n");
+
+	if (g_monitorSeq)
+	{
+		printf("Monitored events: %llu, outputs over their limit: %u\n", (unsigned long long)g_stats.monitoredEvents, g_stats.rateLimited);
+		for (int i=0; i<MAX_ENDPOINTS; ++i)
+		{
+			const MonitorSource &source = g_monitorSources[i];
+			if (source.state == MONITOR_OFF)
+				continue;
+
+			snd_seq_addr_t addr = endpointGetAddr(ENDPOINT_OUTPUT, i);
+			printf("  %d:%d: %u events/s, peak %u, %s\n", addr.client, addr.port, source.rate, source.peak, monitorStateName(source.state));
+		}
+	}
+
+	sched_param param;
+	int policy = sched_getscheduler(0);
+	if (policy >= 0 && sched_getparam(0, &param) == 0)
+		printf("Scheduling: %s, priority %d\n", realtimePolicyName(policy), param.sched_priority);
+	printf("Memory locked: %d kB\n", procGetStatusKb("VmLck"));
+	printf("Resident memory: %d kB, peak %d kB\n", procGetStatusKb("VmRSS"), procGetStatusKb("VmHWM"));
+	printf("Heap: %llu kB, peak %llu kB\n", (unsigned long long)(g_stats.heapBytes / 1024u), (unsigned long long)(g_stats.heapPeakBytes / 1024u));
+
+	g_stats.hotplugLatencyUs.print("Port start to subscribed", "us");
+	g_stats.priorityLatencyUs.print("Port start to priority link subscribed", "us");
+	g_stats.syscallsPerFlush.print("Sequencer calls per flush", "calls");
+	fflush(stdout);
+}
+
+// Control socket, answers queries about the routing state from memory.
+// Requests are single lines, each response is a number of tab separated
+// records followed by an 'ok' line or an 'error<TAB>message' line.
+enum
+{
+	CONTROL_MAX_CONNECTIONS = 4,
+	CONTROL_MAX_REQUEST     = 256,
+};
+
+struct ControlConnection
+{
+	ControlConnection();
+
+	int fd;
+	bool eof;
+
+	// The request being received, up to and including its newline.
+	char in[CONTROL_MAX_REQUEST];
+	size_t inLength;
+
+	std::string out;
+};
+
+ControlConnection::ControlConnection()
+	:fd(-1)
+	,eof(false)
+	,inLength(0)
+{
+}
+
+static const char *g_controlPath = NULL;
+static int g_controlFd = -1;
+static ControlConnection g_controlConnections[CONTROL_MAX_CONNECTIONS];
+
+static void controlPrintf(ControlConnection &c, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void controlPrintf(ControlConnection &c, const char *fmt, ...)
+{
+	char line[512];
+
+	va_list args;
+	va_start(args, fmt);
+	int n = vsnprintf(line, sizeof(line), fmt, args);
+	va_end(args);
+
+	if (n < 0)
+		return;
+
+	c.out.append(line, (size_t)n < sizeof(line) ? n : sizeof(line)-1);
+}
+
+static const char *controlStrengthName(ConnectionRules::Strength strength)
+{
+	switch (strength)
+	{
+	case ConnectionRules::STRENGTH_VERY_VAGUE: return "very_vague";
+	case ConnectionRules::STRENGTH_VAGUE:      return "vague";
+	case ConnectionRules::STRENGTH_SPECIFIC:   return "specific";
+	default:                                   return "none";
+	}
+}
+
+static void controlEndpoints(ControlConnection &c)
+{
+	static const char *const types[2] = { "software", "hardware" };
+	static const char *const dirs[2] = { "output", "input" };
+
+	for (int t=0; t<2; ++t)
+	{
+		for (int d=0; d<2; ++d)
+		{
+			const EndpointIndex &endpoints = g_endpoints[t][d];
+			for (size_t i=0; i<endpoints.size(); ++i)
+			{
+				snd_seq_addr_t addr = endpointGetAddr((EndpointDir)d, endpoints[i]);
+				const ClientInfoCache::ClientInfo *info = g_clientInfo.find(addr.client);
+				controlPrintf(c, "endpoint\t%d:%d\t%s\t%s\t%s\n", addr.client, addr.port, types[t], dirs[d], info ? info->name : "");
+			}
+		}
+	}
+}
+
+struct LinkCollector
+{
+	explicit LinkCollector(links_t &links);
+
+	void operator ()(const link_t &link);
+
+	links_t &m_links;
+};
+
+LinkCollector::LinkCollector(links_t &links)
+	:m_links(links)
+{
+}
+
+void LinkCollector::operator ()(const link_t &link)
+{
+	m_links.insert(link);
+}
+
+static void controlGraph(ControlConnection &c)
+{
+	links_t links = g_actualLinks;
+	links.insert(g_appliedLinks.begin(), g_appliedLinks.end());
+
+	LinkCollector collector(links);
+	graphForEachDesired(collector);
+
+	for (links_t::const_iterator itr = links.begin(); itr != links.end(); ++itr)
+	{
+		char flags[sizeof(",desired,actual,applied")] = "";
+		if (graphIsDesired(*itr))
+			strcat(flags, ",desired");
+		if (g_actualLinks.find(*itr) != g_actualLinks.end())
+			strcat(flags, ",actual");
+		if (g_appliedLinks.find(*itr) != g_appliedLinks.end())
+			strcat(flags, ",applied");
+
+		controlPrintf(c, "link\t%d:%d\t%d:%d\t%s\n", itr->first.client, itr->first.port, itr->second.client, itr->second.port, flags[0] ? flags + 1 : "");
+	}
+}
+
+static bool controlParseAddr(const char *str, snd_seq_addr_t &addr)
+{
+	int client, port = 0;
+	char end;
+	int n = sscanf(str, "%d:%d%c", &client, &port, &end);
+	if (n != 1 && n != 2)
+		return false;
+
+	if (client < 0 || client >= MAX_CLIENTS || port < 0 || port > 255)
+		return false;
+
+	addr.client = client;
+	addr.port = port;
+	return true;
+}
+
+static void controlWhyRule(ControlConnection &c, const char *kind, ConnectionRules::Strength strength, int rule)
+{
+	ConnectionRules::Type type;
+	const char *output;
+	const char *input;
+
+	if (g_rules.getRule(rule, type, output, input))
+		controlPrintf(c, "%s\t%s\t%d\t%s\t%s\n", kind, controlStrengthName(strength), rule, output, input);
+	else
+		controlPrintf(c, "%s\tnone\t-1\t\t\n", kind);
+}
+
+// Arguments are an output and an input, as client or client:port.
+static bool controlWhy(ControlConnection &c, const char *outputArg, const char *inputArg)
+{
+	snd_seq_addr_t output, input;
+	if (!outputArg || !inputArg || !controlParseAddr(outputArg, output) || !controlParseAddr(inputArg, input))
+	{
+		controlPrintf(c, "error\tusage: why <client[:port]> <client[:port]>\n");
+		return false;
+	}
+
+	ClientType outputType, inputType;
+	const Client *outputClient = findClientForPort(output, &outputType);
+	const Client *inputClient = findClientForPort(input, &inputType);
+	const ClientInfoCache::ClientInfo *outputInfo = outputClient ? g_clientInfo.find(output.client) : NULL;
+	const ClientInfoCache::ClientInfo *inputInfo = inputClient ? g_clientInfo.find(input.client) : NULL;
+
+	if (!outputInfo || !inputInfo)
+	{
+		controlPrintf(c, "error\tclient %d is not tracked\n", !outputInfo ? output.client : input.client);
+		return false;
+	}
+
+	ConnectionRules::Strength required = g_linkStrengths[outputType][inputType];
+
+	// Tracked ports have matches of their own when some rules name ports.
+	int outputId = outputClient->findEndpoint(ENDPOINT_OUTPUT, output.port);
+	int inputId = inputClient->findEndpoint(ENDPOINT_INPUT, input.port);
+	const ConnectionRules::Match *outputMatch = outputId >= 0 ? graphGetMatch(ENDPOINT_OUTPUT, outputId) : &outputInfo->match;
+	const ConnectionRules::Match *inputMatch = inputId >= 0 ? graphGetMatch(ENDPOINT_INPUT, inputId) : &inputInfo->match;
+
+	ConnectionRules::Verdict verdict;
+	g_rules.explain(*outputMatch, *inputMatch, required, verdict);
+
+	controlPrintf(c, "verdict\t%s\t%s\n", verdict.allowed ? "allowed" : "denied", controlStrengthName(required));
+	controlWhyRule(c, "allow", verdict.allowStrength, verdict.allowRule);
+	controlWhyRule(c, "disallow", verdict.disallowStrength, verdict.disallowRule);
+
+	return true;
+}
+
+static void controlStats(ControlConnection &c)
+{
+	heapSample();
+
+	size_t endpoints = 0;
+	for (int t=0; t<2; ++t)
+		endpoints += g_endpoints[t][ENDPOINT_OUTPUT].size() + g_endpoints[t][ENDPOINT_INPUT].size();
+
+	const Histogram &latency = g_stats.hotplugLatencyUs;
+	const Histogram &flushes = g_stats.syscallsPerFlush;
+
+	controlPrintf(c, "stat\tendpoints\t%u\n", (unsigned)endpoints);
+	controlPrintf(c, "stat\tlinks_desired\t%u\n", (unsigned)g_desiredLinks.size());
+	controlPrintf(c, "stat\tlinks_actual\t%u\n", (unsigned)g_actualLinks.size());
+	controlPrintf(c, "stat\tlinks_applied\t%u\n", (unsigned)g_appliedLinks.size());
+	controlPrintf(c, "stat\tannouncements\t%llu\n", (unsigned long long)g_stats.announcements);
+	controlPrintf(c, "stat\tsyscalls\t%llu\n", (unsigned long long)g_stats.syscalls);
+	controlPrintf(c, "stat\tsubscribes\t%llu\n", (unsigned long long)g_stats.subscribes);
+	controlPrintf(c, "stat\tunsubscribes\t%llu\n", (unsigned long long)g_stats.unsubscribes);
+	controlPrintf(c, "stat\trule_checks\t%llu\n", (unsigned long long)g_stats.ruleChecks);
+	controlPrintf(c, "stat\trule_check_ns\t%llu\n", (unsigned long long)g_stats.ruleCheckNs);
+	controlPrintf(c, "stat\tinput_overflows\t%u\n", g_stats.inputOverflows);
+	controlPrintf(c, "stat\tresyncs\t%u\n", g_stats.resyncs);
+	controlPrintf(c, "stat\tfailovers\t%u\n", g_stats.failovers);
+	controlPrintf(c, "stat\tretries\t%llu\n", (unsigned long long)g_stats.retries);
+	controlPrintf(c, "stat\tretries_failed\t%u\n", g_stats.retriesFailed);
+	controlPrintf(c, "stat\tretries_pending\t%u\n", (unsigned)g_retryLinks.size());
+	controlPrintf(c, "stat\tloop_checks\t%llu\n", (unsigned long long)g_stats.loopChecks);
+	controlPrintf(c, "stat\tloop_check_ns\t%llu\n", (unsigned long long)g_stats.loopCheckNs);
+	controlPrintf(c, "stat\tloops_refused\t%u\n", g_stats.loopsRefused);
+	controlPrintf(c, "stat\tmonitored_events\t%llu\n", (unsigned long long)g_stats.monitoredEvents);
+	controlPrintf(c, "stat\trate_limited\t%u\n", g_stats.rateLimited);
+	controlPrintf(c, "stat\thotplug_latency_count\t%llu\n", (unsigned long long)latency.getCount());
+	controlPrintf(c, "stat\thotplug_latency_sum_us\t%llu\n", (unsigned long long)latency.getSum());
+	controlPrintf(c, "stat\thotplug_latency_max_us\t%llu\n", (unsigned long long)latency.getMax());
+	controlPrintf(c, "stat\tpriority_links\t%llu\n", (unsigned long long)g_stats.priorityLinks);
+	controlPrintf(c, "stat\tfirst_priority_link_us\t%llu\n", (unsigned long long)g_stats.firstPriorityLinkUs);
+	controlPrintf(c, "stat\tpriority_latency_count\t%llu\n", (unsigned long long)g_stats.priorityLatencyUs.getCount());
+	controlPrintf(c, "stat\tpriority_latency_max_us\t%llu\n", (unsigned long long)g_stats.priorityLatencyUs.getMax());
+	controlPrintf(c, "stat\tflush_count\t%llu\n", (unsigned long long)flushes.getCount());
+	controlPrintf(c, "stat\tflush_syscalls_max\t%llu\n", (unsigned long long)flushes.getMax());
+
+	sched_param param;
+	int policy = sched_getscheduler(0);
+	if (policy >= 0 && sched_getparam(0, &param) == 0)
+	{
+		controlPrintf(c, "stat\tsched_policy\t%s\n", realtimePolicyName(policy));
+		controlPrintf(c, "stat\tsched_priority\t%d\n", param.sched_priority);
+	}
+	controlPrintf(c, "stat\tmemory_locked_kb\t%d\n", procGetStatusKb("VmLck"));
+	controlPrintf(c, "stat\trss_kb\t%d\n", procGetStatusKb("VmRSS"));
+	controlPrintf(c, "stat\trss_peak_kb\t%d\n", procGetStatusKb("VmHWM"));
+	controlPrintf(c, "stat\theap_bytes\t%llu\n", (unsigned long long)g_stats.heapBytes);
+	controlPrintf(c, "stat\theap_peak_bytes\t%llu\n", (unsigned long long)g_stats.heapPeakBytes);
+}
+
+static void controlRates(ControlConnection &c)
+{
+	for (int i=0; i<MAX_ENDPOINTS; ++i)
+	{
+		const MonitorSource &source = g_monitorSources[i];
+		if (source.state == MONITOR_OFF)
+			continue;
+
+		snd_seq_addr_t addr = endpointGetAddr(ENDPOINT_OUTPUT, i);
+		const ClientInfoCache::ClientInfo *info = g_clientInfo.find(addr.client);
+		unsigned limit = info && info->rateLimit >= 0 ? g_rules.getRateLimit(info->rateLimit).eventsPerSecond : 0;
+
+		controlPrintf(c, "rate\t%d:%d\t%u\t%u\t%u\t%s\n", addr.client, addr.port, source.rate, source.peak, limit, monitorStateName(source.state));
+	}
+}
+
+static void controlHandle(ControlConnection &c, char *line)
+{
+	const char *command = strtok(line, " \t\r");
+	const char *arg1 = strtok(NULL, " \t\r");
+	const char *arg2 = strtok(NULL, " \t\r");
+
+	if (!command)
+		return;
+
+	if (strcmp(command, "endpoints") == 0)
+	{
+		controlEndpoints(c);
+	}
+	else if (strcmp(command, "graph") == 0)
+	{
+		controlGraph(c);
+	}
+	else if (strcmp(command, "why") == 0)
+	{
+		if (!controlWhy(c, arg1, arg2))
+			return;
+	}
+	else if (strcmp(command, "stats") == 0)
+	{
+		controlStats(c);
+	}
+	else if (strcmp(command, "rates") == 0)
+	{
+		controlRates(c);
+	}
+	else if (strcmp(command, "help") == 0)
+	{
+		controlPrintf(c, "command\tendpoints\ncommand\tgraph\ncommand\twhy\ncommand\tstats\ncommand\trates\n");
+	}
+	else
+	{
+		controlPrintf(c, "error\tunknown command '%s'\n", command);
+		return;
+	}
+
+	controlPrintf(c, "ok\n");
+}
+
+static void controlClose(ControlConnection &c)
+{
+	if (c.fd >= 0)
+		close(c.fd);
+
+	c.fd = -1;
+	c.eof = false;
+	c.inLength = 0;
+
+	// Give back what a long reply took, clear() would keep it.
+	std::string().swap(c.out);
+}
+
+static int controlInit()
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (strlen(g_controlPath) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	strcpy(addr.sun_path, g_controlPath);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	// A socket left behind by a previous instance.
+	unlink(g_controlPath);
+
+	if (bind(fd, (const sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, CONTROL_MAX_CONNECTIONS) < 0)
+	{
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+
+	g_controlFd = fd;
+	return fd;
+}
+
+static void controlUninit()
+{
+	if (g_controlFd < 0)
 		return;
 
-	clients_t *lists[2] = { &g_swClients, &g_hwClients };
-	ConnectionRules::Strength strengths[2] =
+	for (int i=0; i<CONTROL_MAX_CONNECTIONS; ++i)
+		controlClose(g_controlConnections[i]);
+
+	close(g_controlFd);
+	g_controlFd = -1;
+
+	unlink(g_controlPath);
+}
+
+static void controlAccept()
+{
+	int fd;
+	while ((fd = accept4(g_controlFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+	{
+		int i;
+		for (i=0; i<CONTROL_MAX_CONNECTIONS; ++i)
+		{
+			if (g_controlConnections[i].fd < 0)
+				break;
+		}
+
+		if (i == CONTROL_MAX_CONNECTIONS)
+		{
+			logPrintf(LOG_LEVEL_WARNING, "Too many control connections, dropping a new one.");
+			close(fd);
+			continue;
+		}
+
+		g_controlConnections[i].fd = fd;
+	}
+}
+
+// Fills in the poll entries of the connections, CONTROL_MAX_CONNECTIONS of them.
+static void controlGetPollFds(pollfd *fds)
+{
+	for (int i=0; i<CONTROL_MAX_CONNECTIONS; ++i)
 	{
-		type == CLIENT_SOFTWARE ? ConnectionRules::STRENGTH_SPECIFIC : ConnectionRules::STRENGTH_VERY_VAGUE,
-		type == CLIENT_SOFTWARE ? ConnectionRules::STRENGTH_VERY_VAGUE : ConnectionRules::STRENGTH_SPECIFIC
-	};
+		const ControlConnection &c = g_controlConnections[i];
 
-	for (int i=0; i<2; ++i)
-	{
-		clients_t &list = *lists[i];
-		ConnectionRules::Strength strength = strengths[i];
+		fds[i].fd = c.fd;
+		fds[i].events = (c.eof ? 0 : POLLIN) | (c.out.empty() ? 0 : POLLOUT);
+		fds[i].revents = 0;
+	}
+}
 
-		for (clients_t::iterator itr = list.begin(); itr != list.end(); ++itr)
+static void controlService(ControlConnection &c, short revents)
+{
+	if (revents & (POLLIN | POLLHUP | POLLERR))
+	{
+		bool tooLong = false;
+		ssize_t n;
+		while ((n = read(c.fd, c.in + c.inLength, sizeof(c.in) - c.inLength)) > 0)
 		{
-			Client &client = itr->second;
+			// Whatever follows a request that was too long is read only to be dropped,
+			// closing with unread data would reset the connection before the reply.
+			if (tooLong)
+				continue;
 
-			const snd_seq_addr_t *input = client.getInput();
-			const snd_seq_addr_t *output = client.getOutput();
+			c.inLength += n;
 
-			if ((dir & DIR_INPUT) && output)
+			char *begin = c.in;
+			char *end;
+			while ((end = (char*)memchr(begin, '\n', c.in + c.inLength - begin)) != NULL)
 			{
-				if (g_rules.isConnectionAllowed(*output, addr, strength))
-					connect(*output, addr);
+				char line[CONTROL_MAX_REQUEST];
+				memcpy(line, begin, end - begin);
+				line[end - begin] = '\0';
+				controlHandle(c, line);
+
+				begin = end + 1;
 			}
-			if (dir & DIR_OUTPUT && input)
+
+			c.inLength -= begin - c.in;
+			memmove(c.in, begin, c.inLength);
+
+			if (c.inLength == sizeof(c.in))
 			{
-				if (g_rules.isConnectionAllowed(addr, *input, strength))
-					connect(addr, *input);
+				controlPrintf(c, "error\trequest too long\n");
+				c.inLength = 0;
+				tooLong = true;
 			}
 		}
-	}
-}
 
-static void portsConnectAll(const clients_t &listA, const clients_t &listB, ConnectionRules::Strength minimumStrength)
-{
-	std::set<std::pair<snd_seq_addr_t, snd_seq_addr_t> > handled;
+		if (tooLong || n == 0 || (n < 0 && errno != EAGAIN))
+			c.eof = true;
+	}
 
-	for (clients_t::const_iterator listAItr = listA.begin(); listAItr != listA.end(); ++listAItr)
+	while (!c.out.empty())
 	{
-		const Client &aClient = listAItr->second;
-
-		const snd_seq_addr_t *aInput = aClient.getInput();
-		const snd_seq_addr_t *aOutput = aClient.getOutput();
-
-		if (!aInput && !aOutput)
-			continue;
-
-		for (clients_t::const_iterator listBItr = listB.begin(); listBItr != listB.end(); ++listBItr)
+		ssize_t n = send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+		if (n < 0)
 		{
-			const Client &bClient = listBItr->second;
-
-			const snd_seq_addr_t *bInput = bClient.getInput();
-			const snd_seq_addr_t *bOutput = bClient.getOutput();
+			if (errno == EAGAIN)
+				return;
 
-			if (bInput && aOutput && handled.find(std::make_pair(*aOutput, *bInput)) == handled.end())
-			{
-				if (g_rules.isConnectionAllowed(*aOutput, *bInput, minimumStrength))
-				{
-					connect(*aOutput, *bInput);
-					handled.insert(std::make_pair(*aOutput, *bInput));
-				}
-			}
-			if (bOutput && aInput && handled.find(std::make_pair(*bOutput, *aInput)) == handled.end())
-			{
-				if (g_rules.isConnectionAllowed(*bOutput, *aInput, minimumStrength))
-				{
-					connect(*bOutput, *aInput);
-					handled.insert(std::make_pair(*bOutput, *aInput));
-				}
-			}
+			controlClose(c);
+			return;
 		}
+
+		c.out.erase(0, n);
 	}
+
+	if (c.eof)
+		controlClose(c);
 }
 
-static int portsInit()
+// Returns true if the daemon should quit.
+static bool handleSignals(int fd)
 {
-	snd_seq_client_info_t *clientInfo;
-	snd_seq_port_info_t *portInfo;
+	bool quit = false;
 
-	snd_seq_client_info_alloca(&clientInfo);
-	snd_seq_port_info_alloca(&portInfo);
-	snd_seq_client_info_set_client(clientInfo, -1);
-	while (snd_seq_query_next_client(g_seq, clientInfo) >= 0)
+	signalfd_siginfo info;
+	while (read(fd, &info, sizeof(info)) == sizeof(info))
 	{
-		int clientId = snd_seq_client_info_get_client(clientInfo);
-
-		snd_seq_port_info_set_client(portInfo, clientId);
-		snd_seq_port_info_set_port(portInfo, -1);
-
-		while (snd_seq_query_next_port(g_seq, portInfo) >= 0)
+		switch (info.ssi_signo)
 		{
-			portAdd(*portInfo);
+		case SIGHUP:
+			logPrintf(LOG_LEVEL_INFO, "Reloading rules.");
+			rulesReload();
+			break;
+		case SIGUSR1:
+			statsPrint();
+			break;
+		case SIGINT:
+		case SIGTERM:
+			quit = true;
+			break;
+		default:
+			break;
 		}
 	}
 
-	// Initially connect everything together.
-	portsConnectAll(g_hwClients, g_swClients, ConnectionRules::STRENGTH_VERY_VAGUE);
-	portsConnectAll(g_hwClients, g_hwClients, ConnectionRules::STRENGTH_SPECIFIC);
-	portsConnectAll(g_swClients, g_swClients, ConnectionRules::STRENGTH_SPECIFIC);
+	return quit;
 }
 
-static void seqUninit()
+// Returns the poll() timeout in milliseconds until the next timed action, or -1 to wait forever.
+static int getPollTimeout()
 {
-	if (g_port >= 0)
-	{
-		snd_seq_delete_simple_port(g_seq, g_port);
-		g_port = -1;
-	}
-	if (g_seq)
+	int timeouts[] = { resyncGetTimeout(), pendingGetTimeout(), graphDrainGetTimeout(), notifyGetTimeout(), monitorGetTimeout(), retryGetTimeout(), stateGetTimeout() };
+
+	int result = -1;
+	for (size_t i=0; i<sizeof(timeouts)/sizeof(timeouts[0]); ++i)
 	{
-		snd_seq_close(g_seq);
-		g_seq = NULL;
+		if (timeouts[i] >= 0 && (result < 0 || timeouts[i] < result))
+			result = timeouts[i];
 	}
+
+	return result;
 }
 
-static int seqInit()
+// Not used by the bench, which drives the event handling itself.
+static int run() __attribute__((unused));
+
+static int run()
 {
-	if (g_seq != NULL)
+	enum { FD_SEQ, FD_SIGNALS, FD_RULES, FD_CONTROL, FD_MONITOR, FD_COUNT };
+
+	bool done = false;
+	bool ready = false;
+	int npfd = 0;
+	pollfd fds[FD_COUNT + CONTROL_MAX_CONNECTIONS];
+	sigset_t signals;
+
+	for (int i=0; i<FD_COUNT + CONTROL_MAX_CONNECTIONS; ++i)
 	{
-		fprintf(stderr, "Already initialized!\n");
-		return -EINVAL;
+		fds[i].fd = -1;
+		fds[i].events = POLLIN;
+		fds[i].revents = 0;
 	}
 
-	int result = snd_seq_open(&g_seq, "default", SND_SEQ_OPEN_DUPLEX, 0);
+	int result = seqInit();
+
 	if (result < 0)
+		goto cleanup;
+
+	// Before the ports get tracked, so the limited ones get monitored right away.
+	if (g_monitorEnabled)
 	{
-		fprintf(stderr, "Couldn't open ALSA sequencer! (%d)\n", result);
-		goto error;
+		if (monitorInit() >= 0)
+			snd_seq_poll_descriptors(g_monitorSeq, &fds[FD_MONITOR], 1, POLLIN);
+	}
+	else if (g_rules.hasRateLimits())
+	{
+		logPrintf(LOG_LEVEL_WARNING, "The rate limits apply only with --monitor!");
 	}
 
-	result = snd_seq_set_client_name(g_seq, "amidiauto");
-	if (result < 0)
+	if (g_statePath)
 	{
-		fprintf(stderr, "Failed setting client name! (%d)\n", result);
-		goto error;
+		int err = stateLoad();
+		if (err < 0)
+			logPrintf(LOG_LEVEL_WARNING, "Failed reading '%s'! (%d)", g_statePath, err);
+
+		stateRestoreEarly();
 	}
 
-	result = snd_seq_create_simple_port(
-		g_seq,
-		"amidiauto",
-		SND_SEQ_PORT_CAP_WRITE |
-		SND_SEQ_PORT_CAP_NO_EXPORT,
-		SND_SEQ_PORT_TYPE_APPLICATION
-		);
+	// The rules are first evaluated by the loop, see pendingFlush(), so the restored
+	// links are up and saved announcements get handled without waiting for them.
+	portsScan();
+	stateRestore();
+	g_graphDirty = true;
 
-	if (result < 0)
+	notifyInit();
+
+	npfd = snd_seq_poll_descriptors_count(g_seq, POLLIN);
+	if (npfd != 1)
 	{
-		fprintf(stderr, "Couldn't create a virtual MIDI port! (%d)\n", result);
-		goto error;
+		logPrintf(LOG_LEVEL_ERROR, "Unexpected count (%d) of seq fds! Expected 1!", npfd);
+		result = -EINVAL;
+		goto cleanup;
 	}
 
-	g_port = result;
+	snd_seq_poll_descriptors(g_seq, &fds[FD_SEQ], 1, POLLIN);
 
-	result = snd_seq_connect_from(g_seq, g_port, SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_ANNOUNCE);
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGHUP);
+	sigaddset(&signals, SIGUSR1);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigprocmask(SIG_BLOCK, &signals, NULL);
 
-	if (result < 0)
+	fds[FD_SIGNALS].fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fds[FD_SIGNALS].fd < 0)
 	{
-		fprintf(stderr, "Couldn't connect to System::Anounce port! (%d)\n", result);
-		goto error;
+		result = -errno;
+		logPrintf(LOG_LEVEL_ERROR, "Failed creating signalfd! (%d)", result);
+		goto cleanup;
 	}
 
-	return 0;
-
-error:
-	seqUninit();
-	return result;
-}
+	if (g_watchRules)
+	{
+		fds[FD_RULES].fd = rulesWatchInit();
+		if (fds[FD_RULES].fd < 0)
+			logPrintf(LOG_LEVEL_WARNING, "Failed watching '%s' for changes! (%d)", g_rulesFile, fds[FD_RULES].fd);
+	}
 
-static bool handleSeqEvent(snd_seq_t *seq, int port)
-{
-	do
+	if (g_controlPath)
 	{
-		snd_seq_event_t *ev;
-		snd_seq_event_input(seq, &ev);
+		fds[FD_CONTROL].fd = controlInit();
+		if (fds[FD_CONTROL].fd < 0)
+			logPrintf(LOG_LEVEL_WARNING, "Failed creating control socket '%s'! (%d)", g_controlPath, fds[FD_CONTROL].fd);
+	}
 
-		switch (ev->type)
+	while (!done)
+	{
+		// Once the initial connections are made.
+		if (!ready && !g_graphDirty && graphDrainGetTimeout() < 0)
 		{
-		case SND_SEQ_EVENT_PORT_START:
-			{
-				printf("%d:%d port appeared.\n", ev->data.addr.client, ev->data.addr.port);
+			ready = true;
 
-				snd_seq_port_info_t *portInfo;
-				snd_seq_port_info_alloca(&portInfo);
+			lowMemoryTrim();
+			realtimeInit();
+			heapSample();
+			notifyReady();
+		}
 
-				int result = snd_seq_get_any_port_info(g_seq, ev->data.addr.client, ev->data.addr.port, portInfo);
-				if (result >= 0)
-				{
-					if (portAdd(*portInfo))
-						portAutoConnect(ev->data.addr, portGetDir(*portInfo));
-				}
-				else
-				{
-					fprintf(stderr, "Failed getting port %d:%d info: %d\n", ev->data.addr.client, ev->data.addr.port, result);
-				}
-			}
-			break;
-		case SND_SEQ_EVENT_PORT_EXIT:
-			printf("%d:%d port removed.\n", ev->data.addr.client, ev->data.addr.port);
+		if (g_statePath)
+			stateSchedule();
 
-			portRemove(ev->data.addr);
-			break;
-		default:
-			break;
+		logFlush();
+
+		controlGetPollFds(&fds[FD_COUNT]);
+
+		int n = poll(fds, FD_COUNT + CONTROL_MAX_CONNECTIONS, getPollTimeout());
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			logPrintf(LOG_LEVEL_ERROR, "Polling failed! (%d)", errno);
+			result = -errno;
+			goto cleanup;
 		}
 
-		snd_seq_free_event(ev);
-	} while (snd_seq_event_input_pending(seq, 0) > 0);
+		notifyWatchdog();
 
-	return false;
-}
+		if (resyncGetTimeout() == 0)
+			resync();
+		else if (pendingGetTimeout() == 0)
+			pendingFlush();
+		else if (graphDrainGetTimeout() == 0)
+			graphDrain();
 
-static int run()
-{
-	bool done = false;
-	int npfd = 0;
+		if (monitorGetTimeout() == 0)
+			monitorSample();
 
-	int result = seqInit();
+		if (retryGetTimeout() == 0)
+			retryService();
 
-	if (result < 0)
-		goto cleanup;
+		if (stateGetTimeout() == 0)
+			stateSave();
 
-	portsInit();
+		if (fds[FD_SEQ].revents)
+		{
+			--n;
+			done = handleSeqEvent();
+		}
 
-	npfd = snd_seq_poll_descriptors_count(g_seq, POLLIN);
-	if (npfd != 1)
-	{
-		fprintf(stderr, "Unexpected count (%d) of seq fds! Expected 1!\n", npfd);
-		result = -EINVAL;
-		goto cleanup;
-	}
+		if (fds[FD_SIGNALS].revents)
+		{
+			--n;
+			done = handleSignals(fds[FD_SIGNALS].fd) || done;
+		}
 
-	pollfd fds[1];
-	snd_seq_poll_descriptors(g_seq, &fds[0], 1, POLLIN);
+		if (fds[FD_RULES].revents)
+		{
+			--n;
+			if (rulesWatchRead(fds[FD_RULES].fd))
+			{
+				logPrintf(LOG_LEVEL_INFO, "'%s' changed, reloading rules.", g_rulesFile);
+				rulesReload();
+			}
+		}
 
-	while (!done)
-	{
-		int n = poll(fds, npfd, -1);
-		if (n < 0)
+		if (fds[FD_CONTROL].revents)
 		{
-			fprintf(stderr, "Polling failed! (%d)\n", errno);
-			result = -errno;
-			goto cleanup;
+			--n;
+			controlAccept();
 		}
 
-		if (fds[0].revents)
+		if (fds[FD_MONITOR].revents)
 		{
 			--n;
-			done = handleSeqEvent(g_seq, g_port);
+			handleMonitorEvents();
+		}
+
+		for (int i=0; i<CONTROL_MAX_CONNECTIONS; ++i)
+		{
+			if (fds[FD_COUNT+i].revents)
+			{
+				--n;
+				controlService(g_controlConnections[i], fds[FD_COUNT+i].revents);
+			}
 		}
 
 		assert(n == 0);
 	}
 
 cleanup:
+	// The links changed within the delay are kept as well.
+	if (g_statePath && ready)
+		stateSave();
+
+	for (int i=FD_SIGNALS; i<FD_CONTROL; ++i)
+	{
+		if (fds[i].fd >= 0)
+			close(fds[i].fd);
+	}
+
+	controlUninit();
+
+	notifySend("STOPPING=1");
+	notifyUninit();
+
+	logFlush();
+
+	monitorUninit();
 	seqUninit();
 
 	return result;
 }
 
+#ifndef AMIDIAUTO_BENCH
 static void printVersion(void)
 {
 	printf("Version %x.%02x, Copyright (C) Blokas Labs " HOMEPAGE_URL "\n", AMIDIAUTO_VERSION >> 8, AMIDIAUTO_VERSION & 0xff);
@@ -717,9 +7125,40 @@ static void printVersion(void)
 
 static void printUsage()
 {
-	printf("Usage: amidiauto\n\nThat's all there is to it! :)\n\n");
+	printf("Usage: amidiauto [options]\n"
+		"\n"
+		"Options:\n"
+		"  -c, --coalesce <ms>  Collect port announcements for up to <ms> milliseconds\n"
+		"                       and connect them in a single pass. Default is 0.\n"
+		"  -w, --watch          Reload the rules when the rule file changes.\n"
+		"                       Rules are also reloaded on SIGHUP.\n"
+		"  --input-pool <n>     Size of the sequencer input pool, in events.\n"
+		"  --input-buffer <n>   Size of the sequencer input buffer, in bytes.\n"
+		"  -s, --socket <path>  Answer queries about the connections on a Unix\n"
+		"                       domain socket at <path>.\n"
+		"  --state <path>       Keep the made connections in <path> and restore\n"
+		"                       them right away after a restart.\n"
+		"  --sched <policy>     Run under fifo or rr real-time scheduling.\n"
+		"  --priority <n>       Real-time scheduling priority. Implies fifo if no\n"
+		"                       policy is given.\n"
+		"  --mlock              Lock the process memory and prefault it.\n"
+		"                       These need root or RLIMIT_RTPRIO and RLIMIT_MEMLOCK.\n"
+		"  --monitor            Measure the event rates of the clients in the [limits]\n"
+		"                       section of the rules and disconnect floods.\n"
+		"  --compile            Write the compiled rules next to the rule file, to be\n"
+		"                       loaded instead of parsing it while it is unchanged.\n"
+		"  --generate <file>    Write the compiled rules as a header to build them into\n"
+		"                       the binary with, see RULES in the Makefile.\n"
+		"  --low-memory         Use small sequencer pools and buffers and return freed\n"
+		"                       memory to the system, for boards short of memory.\n"
+		"  -q, --quiet          Log only errors.\n"
+		"  -v, --version        Print the version and exit.\n"
+		"  -h, --help           Print this message and exit.\n"
+		"\n");
 	printVersion();
 }
+#endif
+#endif // AMIDIAUTO_GENERATOR
 
 static char *trimWhiteSpace(char *str)
 {
@@ -736,6 +7175,133 @@ static char *trimWhiteSpace(char *str)
 	return str;
 }
 
+// Parses a '<client> = <selection>[, fanout <n>]' line of the [ports] section,
+// where the selection is 'first', 'all', 'max <n>' or 'name <pattern>'.
+static bool parsePortPolicy(ConnectionRules &rules, char *line)
+{
+	char *equals = strchr(line, '=');
+	if (!equals)
+		return false;
+
+	*equals = '\0';
+
+	char *client = trimWhiteSpace(line);
+	if (*client == '\0')
+		return false;
+
+	ConnectionRules::PortPolicy policy;
+	const char *port = NULL;
+
+	char *item = equals + 1;
+	while (item)
+	{
+		char *next = strchr(item, ',');
+		if (next)
+			*next++ = '\0';
+
+		item = trimWhiteSpace(item);
+
+		unsigned n;
+		if (strcmp(item, "first") == 0)
+		{
+			policy.selection = ConnectionRules::SELECT_FIRST;
+		}
+		else if (strcmp(item, "all") == 0)
+		{
+			policy.selection = ConnectionRules::SELECT_ALL;
+		}
+		else if (sscanf(item, "max %u", &n) == 1 && n > 0)
+		{
+			policy.selection = ConnectionRules::SELECT_MAX;
+			policy.count = n;
+		}
+		else if (strncmp(item, "name ", 5) == 0 && *trimWhiteSpace(item + 5) != '\0')
+		{
+			policy.selection = ConnectionRules::SELECT_NAME;
+			port = trimWhiteSpace(item + 5);
+		}
+		else if (sscanf(item, "fanout %u", &n) == 1 && n > 0)
+		{
+			policy.fanout = n;
+		}
+		else
+		{
+			return false;
+		}
+
+		item = next;
+	}
+
+	return rules.addPortPolicy(client, policy, port);
+}
+
+// Parses a '<client> = <events per second>[, throttle <seconds> | disconnect]' line of the [limits] section.
+static bool parseRateLimit(ConnectionRules &rules, char *line)
+{
+	char *equals = strchr(line, '=');
+	if (!equals)
+		return false;
+
+	*equals = '\0';
+
+	char *client = trimWhiteSpace(line);
+	if (*client == '\0')
+		return false;
+
+	char *action = strchr(equals + 1, ',');
+	if (action)
+		*action++ = '\0';
+
+	ConnectionRules::RateLimit limit;
+
+	char end;
+	if (sscanf(equals + 1, "%u %c", &limit.eventsPerSecond, &end) != 1 || limit.eventsPerSecond == 0)
+		return false;
+
+	if (action)
+	{
+		action = trimWhiteSpace(action);
+
+		if (strcmp(action, "disconnect") == 0)
+			limit.holdSeconds = 0;
+		else if (sscanf(action, "throttle %u %c", &limit.holdSeconds, &end) != 1 || limit.holdSeconds == 0)
+			return false;
+	}
+
+	return rules.addRateLimit(client, limit);
+}
+
+static bool parsePriority(ConnectionRules &rules, char *line)
+{
+	char *equals = strchr(line, '=');
+	if (!equals)
+		return false;
+
+	*equals = '\0';
+
+	char *client = trimWhiteSpace(line);
+	if (*client == '\0')
+		return false;
+
+	int priority;
+	char end;
+	if (sscanf(equals + 1, "%d %c", &priority, &end) != 1)
+		return false;
+
+	return rules.addPriority(client, priority);
+}
+
+// Parses a '<client>' line of the [thru] section, rejecting the ones looking like a
+// rule or a setting, which a text pattern would otherwise take as part of the name.
+static bool parseThru(ConnectionRules &rules, char *line)
+{
+	if (strstr(line, "->") || strstr(line, "<-") || strchr(line, '='))
+		return false;
+
+	return rules.addThru(line);
+}
+
+// Returns the number of lines ignored for not being valid, or a negative error.
 static int parseRuleFile(ConnectionRules &rules, const char *fileName)
 {
 	if (!fileName)
@@ -745,14 +7311,19 @@ static int parseRuleFile(ConnectionRules &rules, const char *fileName)
 	if (!f)
 		return -ENOENT;
 
-	fprintf(stderr, "Reading rules in '%s'...\n", fileName);
+	logPrintf(LOG_LEVEL_INFO, "Reading rules in '%s'...", fileName);
 
 	enum { MAX_LENGTH = 1024 };
 	char l[MAX_LENGTH];
 
 	unsigned int i=0;
+	int ignored = 0;
 
 	ConnectionRules::Type type = ConnectionRules::TYPE_UNKNOWN;
+	bool ports = false;
+	bool limits = false;
+	bool thru = false;
+	bool priorities = false;
 
 	while (!feof(f) && fgets(l, MAX_LENGTH, f) != NULL)
 	{
@@ -769,27 +7340,98 @@ static int parseRuleFile(ConnectionRules &rules, const char *fileName)
 		}
 		else if (line[0] == '[')
 		{
+			ports = false;
+			limits = false;
+			thru = false;
+			priorities = false;
+
 			if (strcmp(line+1, "allow]") == 0)
 			{
-				type = ConnectionRules::TYPE_ALLOW;
+				type = ConnectionRules::TYPE_ALLOW;
+				continue;
+			}
+			else if (strcmp(line+1, "disallow]") == 0)
+			{
+				type = ConnectionRules::TYPE_DISALLOW;
+				continue;
+			}
+			else if (strcmp(line+1, "ports]") == 0)
+			{
+				type = ConnectionRules::TYPE_UNKNOWN;
+				ports = true;
+				continue;
+			}
+			else if (strcmp(line+1, "limits]") == 0)
+			{
+				type = ConnectionRules::TYPE_UNKNOWN;
+				limits = true;
 				continue;
 			}
-			else if (strcmp(line+1, "disallow]") == 0)
+			else if (strcmp(line+1, "thru]") == 0)
 			{
-				type = ConnectionRules::TYPE_DISALLOW;
+				type = ConnectionRules::TYPE_UNKNOWN;
+				thru = true;
+				continue;
+			}
+			else if (strcmp(line+1, "priority]") == 0)
+			{
+				type = ConnectionRules::TYPE_UNKNOWN;
+				priorities = true;
 				continue;
 			}
 			else
 			{
-				fprintf(stderr, "Unknown section on line %u!\n", i-1);
+				logPrintf(LOG_LEVEL_WARNING, "Unknown section on line %u!", i-1);
 				type = ConnectionRules::TYPE_UNKNOWN;
+				++ignored;
 				continue;
 			}
 		}
 
+		if (ports)
+		{
+			if (!parsePortPolicy(rules, line))
+			{
+				logPrintf(LOG_LEVEL_WARNING, "Ignoring line %u, it's not a valid port selection!", i);
+				++ignored;
+			}
+			continue;
+		}
+
+		if (limits)
+		{
+			if (!parseRateLimit(rules, line))
+			{
+				logPrintf(LOG_LEVEL_WARNING, "Ignoring line %u, it's not a valid rate limit!", i);
+				++ignored;
+			}
+			continue;
+		}
+
+		if (thru)
+		{
+			if (!parseThru(rules, line))
+			{
+				logPrintf(LOG_LEVEL_WARNING, "Ignoring line %u, it's not a valid thru client!", i);
+				++ignored;
+			}
+			continue;
+		}
+
+		if (priorities)
+		{
+			if (!parsePriority(rules, line))
+			{
+				logPrintf(LOG_LEVEL_WARNING, "Ignoring line %u, it's not a valid priority!", i);
+				++ignored;
+			}
+			continue;
+		}
+
 		if (type == ConnectionRules::TYPE_UNKNOWN)
 		{
-			fprintf(stderr, "Ignoring line %u which is not within [allow] or [disallow] section!\n", i-1);
+			logPrintf(LOG_LEVEL_WARNING, "Ignoring line %u which is not within [allow] or [disallow] section!", i-1);
+			++ignored;
 			continue;
 		}
 
@@ -811,7 +7453,8 @@ static int parseRuleFile(ConnectionRules &rules, const char *fileName)
 		}
 		else
 		{
-			fprintf(stderr, "Ignoring line %u, it's missing a direction specifier!\n", i);
+			logPrintf(LOG_LEVEL_WARNING, "Ignoring line %u, it's missing a direction specifier!", i);
+			++ignored;
 			continue;
 		}
 
@@ -825,79 +7468,617 @@ static int parseRuleFile(ConnectionRules &rules, const char *fileName)
 
 		if (*left == '\0' || *right == '\0')
 		{
-			fprintf(stderr, "Ignoring line %u, it's incomplete!\n", i);
+			logPrintf(LOG_LEVEL_WARNING, "Ignoring line %u, it's incomplete!", i);
+			++ignored;
 			continue;
 		}
 
+		bool added = false;
+
 		switch (dir)
 		{
 		case DIR_DUPLEX:
-			rules.addRule(type, left, right);
-			if (strcmp(left, right) != 0)
+			added = rules.addRule(type, left, right);
+			if (added && strcmp(left, right) != 0)
 				rules.addRule(type, right, left);
 			break;
 		case DIR_INPUT:
-			rules.addRule(type, right, left);
+			added = rules.addRule(type, right, left);
 			break;
 		case DIR_OUTPUT:
-			rules.addRule(type, left, right);
+			added = rules.addRule(type, left, right);
 			break;
 		}
+
+		if (!added)
+		{
+			logPrintf(LOG_LEVEL_WARNING, "Ignoring line %u, it's not a valid rule!", i);
+			++ignored;
+		}
 	}
 
 	fclose(f);
 
+	rules.compile();
+
+	return ignored;
+}
+
+// Start of a compiled rules image, written by --compile next to the rule file,
+// followed by the tables of ConnectionRules::writeImage().
+struct RulesImageHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t checksum; // Of the tables.
+
+	// Of the rule file the image was compiled from, it's stale once these differ.
+	uint64_t sourceSize;
+	int64_t sourceMtimeSec;
+	int64_t sourceMtimeNsec;
+
+	uint64_t tablesSize;
+};
+
+enum { RULES_IMAGE_VERSION = 4 };
+
+static const char RULES_IMAGE_MAGIC[4] = { 'A', 'M', 'R', 'I' };
+static const uint32_t RULES_IMAGE_BYTE_ORDER = 0x01020304;
+
+#ifndef AMIDIAUTO_GENERATOR
+static std::string rulesImagePath(const char *fileName)
+{
+	return std::string(fileName) + ".bin";
+}
+
+#endif
+
+// FNV-1a.
+static uint32_t rulesImageChecksum(const char *data, size_t size)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i=0; i<size; ++i)
+	{
+		hash ^= (uint8_t)data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void rulesImageStamp(RulesImageHeader &header, const struct stat &source)
+{
+	header.sourceSize = source.st_size;
+	header.sourceMtimeSec = source.st_mtim.tv_sec;
+	header.sourceMtimeNsec = source.st_mtim.tv_nsec;
+}
+
+#ifndef AMIDIAUTO_BENCH
+// Lays out the header and tables of an image of the rules read from a file with the given stat.
+// Without one the stamp stays zero, so the image only depends on the rules.
+static void rulesImageBuild(const ConnectionRules &rules, const struct stat *source, std::vector<char> &image)
+{
+	ImageWriter writer;
+	rules.writeImage(writer);
+	const std::vector<char> &tables = writer.getData();
+
+	RulesImageHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RULES_IMAGE_MAGIC, sizeof(header.magic));
+	header.version = RULES_IMAGE_VERSION;
+	header.byteOrder = RULES_IMAGE_BYTE_ORDER;
+	header.checksum = rulesImageChecksum(&tables[0], tables.size());
+	header.tablesSize = tables.size();
+	if (source)
+		rulesImageStamp(header, *source);
+
+	const char *p = (const char *)&header;
+	image.assign(p, p + sizeof(header));
+	image.insert(image.end(), tables.begin(), tables.end());
+}
+
+#ifndef AMIDIAUTO_GENERATOR
+// Writes the compiled rules read from fileName to its image, replacing it atomically.
+static int rulesImageWrite(const ConnectionRules &rules, const char *fileName)
+{
+	struct stat source;
+	if (stat(fileName, &source) < 0)
+		return -errno;
+
+	std::vector<char> image;
+	rulesImageBuild(rules, &source, image);
+
+	std::string path = rulesImagePath(fileName);
+	std::string temp = path + ".tmp";
+
+	FILE *f = fopen(temp.c_str(), "wb");
+	if (!f)
+		return -errno;
+
+	bool ok = fwrite(&image[0], image.size(), 1, f) == 1;
+	ok = fclose(f) == 0 && ok;
+
+	if (!ok || rename(temp.c_str(), path.c_str()) < 0)
+	{
+		int result = -errno;
+		unlink(temp.c_str());
+		return result < 0 ? result : -EIO;
+	}
+
 	return 0;
 }
+#endif
+#endif
 
-int main(int argc, char **argv, char **envp)
+// Checks an image and loads its tables. The stamp of the rule file is compared only if
+// source is given, returning -ESTALE if the rule file changed since it got compiled.
+static int rulesImageLoad(ConnectionRules &rules, const char *data, size_t size, const struct stat *source)
 {
-	if (argc == 2 && (strcmp(argv[1], "-v") == 0 || strcmp(argv[1], "--version") == 0))
+	if (size < sizeof(RulesImageHeader))
+		return -EINVAL;
+
+	const RulesImageHeader &header = *(const RulesImageHeader *)data;
+	const char *tables = data + sizeof(header);
+
+	if (memcmp(header.magic, RULES_IMAGE_MAGIC, sizeof(header.magic)) != 0 || header.version != RULES_IMAGE_VERSION || header.byteOrder != RULES_IMAGE_BYTE_ORDER)
+		return -EINVAL;
+
+	if (source)
 	{
-		printVersion();
-		return 0;
+		RulesImageHeader stamp;
+		rulesImageStamp(stamp, *source);
+
+		if (header.sourceSize != stamp.sourceSize || header.sourceMtimeSec != stamp.sourceMtimeSec || header.sourceMtimeNsec != stamp.sourceMtimeNsec)
+			return -ESTALE;
 	}
-	else if (argc != 1)
+
+	if (header.tablesSize != size - sizeof(header) || rulesImageChecksum(tables, header.tablesSize) != header.checksum)
+		return -EINVAL;
+
+	ImageReader reader(tables, header.tablesSize);
+	if (!rules.readImage(reader))
+		return -EINVAL;
+
+	return 0;
+}
+
+#ifndef AMIDIAUTO_GENERATOR
+// Loads the image of fileName, if it's valid and up to date with the rule file. The rules
+// keep it mapped and use its tables in place, it must be replaced rather than rewritten.
+static int rulesImageRead(ConnectionRules &rules, const char *fileName)
+{
+	struct stat source;
+	if (stat(fileName, &source) < 0)
+		return -errno;
+
+	std::string path = rulesImagePath(fileName);
+
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	struct stat image;
+	if (fstat(fd, &image) < 0 || (size_t)image.st_size < sizeof(RulesImageHeader))
 	{
-		printUsage();
-		return 0;
+		close(fd);
+		return -EINVAL;
+	}
+
+	void *data = mmap(NULL, image.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (data == MAP_FAILED)
+		return -errno;
+
+	// Stays mapped for as long as the rules refer to it.
+	ImageMapping mapping;
+	mapping.reset(data, image.st_size);
+
+	int result = rulesImageLoad(rules, mapping.getData(), mapping.getSize(), &source);
+	if (result >= 0)
+		rules.keepImage(mapping);
+
+	return result;
+}
+
+// Reads the compiled image of the rule file if it's up to date, parses the rule file otherwise.
+static int readRules(ConnectionRules &rules, const char *fileName)
+{
+	int result = rulesImageRead(rules, fileName);
+	if (result >= 0)
+	{
+		logPrintf(LOG_LEVEL_INFO, "Read compiled rules of '%s'.", fileName);
+		return result;
+	}
+
+	if (result == -ESTALE)
+		logPrintf(LOG_LEVEL_WARNING, "'%s' is stale, run amidiauto --compile again.", rulesImagePath(fileName).c_str());
+	else if (result != -ENOENT)
+		logPrintf(LOG_LEVEL_WARNING, "Ignoring invalid '%s'! (%d)", rulesImagePath(fileName).c_str(), result);
+
+	return parseRuleFile(rules, fileName);
+}
+
+#ifndef AMIDIAUTO_BENCH
+// Parses the rule file and writes its compiled image, for --compile.
+static int compileRules(const char *fileName)
+{
+	ConnectionRules rules;
+
+	int result = parseRuleFile(rules, fileName);
+	if (result < 0)
+	{
+		fprintf(stderr, "Failed reading rules from '%s'! (%d)\n", fileName, result);
+		return result;
+	}
+
+	result = rulesImageWrite(rules, fileName);
+	if (result < 0)
+	{
+		fprintf(stderr, "Failed writing '%s'! (%d)\n", rulesImagePath(fileName).c_str(), result);
+		return result;
+	}
+
+	// Read back, so a broken image is noticed right away rather than on the next start.
+	ConnectionRules check;
+	result = rulesImageRead(check, fileName);
+	if (result < 0)
+	{
+		fprintf(stderr, "Failed verifying '%s'! (%d)\n", rulesImagePath(fileName).c_str(), result);
+		return result;
+	}
+
+	logPrintf(LOG_LEVEL_INFO, "Compiled '%s' into '%s'.", fileName, rulesImagePath(fileName).c_str());
+
+	return 0;
+}
+#endif // AMIDIAUTO_BENCH
+#endif // AMIDIAUTO_GENERATOR
+
+#ifndef AMIDIAUTO_BENCH
+
+// Parses the rule file and writes its image as the static tables of a header, for --generate.
+// Building with AMIDIAUTO_STATIC_RULES includes the header instead of reading any rule file.
+static int generateRules(const char *fileName, const char *headerName)
+{
+	ConnectionRules rules;
+
+	int result = parseRuleFile(rules, fileName);
+	if (result < 0)
+	{
+		fprintf(stderr, "Failed reading rules from '%s'! (%d)\n", fileName, result);
+		return result;
+	}
+
+	std::vector<char> image;
+	rulesImageBuild(rules, NULL, image);
+	assert(image.size() % sizeof(uint32_t) == 0);
+
+	ConnectionRules check;
+	result = rulesImageLoad(check, &image[0], image.size(), NULL);
+	if (result < 0)
+	{
+		fprintf(stderr, "Failed verifying the compiled rules! (%d)\n", result);
+		return result;
+	}
+
+	FILE *f = fopen(headerName, "w");
+	if (!f)
+	{
+		result = -errno;
+		fprintf(stderr, "Failed writing '%s'! (%d)\n", headerName, result);
+		return result;
+	}
+
+	// Words rather than bytes keep the tables aligned for reading them in place.
+	fprintf(f, "// Generated by amidiauto from '%s', do not edit.\n\n", fileName);
+	fprintf(f, "static const uint32_t g_staticRulesImage[] =\n{\n");
+	for (size_t i=0; i<image.size(); i+=sizeof(uint32_t))
+	{
+		uint32_t word;
+		memcpy(&word, &image[i], sizeof(word));
+		fprintf(f, "%s0x%08x,", i % 32 == 0 ? "\t" : " ", word);
+		if (i % 32 == 28 || i + sizeof(uint32_t) == image.size())
+			fputc('\n', f);
+	}
+	fprintf(f, "};\n");
+
+	if (ferror(f) | fclose(f))
+	{
+		unlink(headerName);
+		fprintf(stderr, "Failed writing '%s'!\n", headerName);
+		return -EIO;
+	}
+
+	logPrintf(LOG_LEVEL_INFO, "Generated '%s' from '%s'.", headerName, fileName);
+
+	return 0;
+}
+#endif
+
+#ifdef AMIDIAUTO_GENERATOR
+// The whole of the build with AMIDIAUTO_GENERATOR, for make RULES= on the build host.
+static int generatorMain(int argc, char **argv)
+{
+	if (argc != 3)
+	{
+		fprintf(stderr, "Usage: %s <rule file> <header>\n", argv[0]);
+		return 1;
 	}
 
+	logInit();
+
+	int result = generateRules(argv[1], argv[2]);
+
+	logFlush();
+
+	return result < 0 ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	return generatorMain(argc, argv);
+}
+#else
+
+#ifdef AMIDIAUTO_STATIC_RULES
+#include "amidiauto_rules.h"
+
+// Loads the rules built into the binary, using their tables in place without touching the file
+// system, nor the heap but for compiling regular expressions. The header must be generated
+// by a build for the same byte order and type sizes, it's refused otherwise.
+static int staticRulesLoad(ConnectionRules &rules)
+{
+	return rulesImageLoad(rules, (const char *)g_staticRulesImage, sizeof(g_staticRulesImage), NULL);
+}
+#endif // AMIDIAUTO_STATIC_RULES
+
+static void rulesAddDefault(ConnectionRules &rules)
+{
+	if (rules.hasRules())
+		return;
+
+	logPrintf(LOG_LEVEL_INFO, "Using default 'allow all' rule.");
+	rules.addRule(ConnectionRules::TYPE_ALLOW, "*", "*");
+	rules.compile();
+}
+
+#ifndef AMIDIAUTO_BENCH
+// Reads $AMIDIAUTO_CFG, or /etc/amidiauto.conf if it is not set or could not be read.
+// Builds with AMIDIAUTO_STATIC_RULES use their built in rules instead, unless those don't load.
+// Falls back to allowing everything if no rules were found.
+static int loadRules(ConnectionRules &rules)
+{
 	int result = -ENOENT;
-	for (int i=0; envp[i] != NULL; ++i)
+
+#ifdef AMIDIAUTO_STATIC_RULES
+	result = staticRulesLoad(rules);
+	if (result < 0)
 	{
-		if (strncmp("AMIDIAUTO_CFG=", envp[i], 14) == 0)
+		logPrintf(LOG_LEVEL_ERROR, "Failed loading the built in rules! (%d)", result);
+	}
+#endif
+
+	const char *cfg = getenv("AMIDIAUTO_CFG");
+	if (result < 0 && cfg)
+	{
+		result = readRules(rules, cfg);
+		if (result < 0)
 		{
-			const char *cfg = &envp[i][14];
-			result = parseRuleFile(g_rules, cfg);
-			if (result < 0)
-			{
-				fprintf(stderr, "Failed reading rules from $AMIDIAUTO_CFG='%s' (%d)\n", cfg, result);
-			}
-			break;
+			logPrintf(LOG_LEVEL_WARNING, "Failed reading rules from $AMIDIAUTO_CFG='%s' (%d)", cfg, result);
 		}
 	}
 
 	if (result < 0)
 	{
-		result = parseRuleFile(g_rules, "/etc/amidiauto.conf");
+		result = readRules(rules, "/etc/amidiauto.conf");
 
 		if (result < 0)
 		{
-			fprintf(stderr, "Reading '/etc/amidiauto.conf' failed! (%d)\n", result);
+			logPrintf(LOG_LEVEL_WARNING, "Reading '/etc/amidiauto.conf' failed! (%d)", result);
+		}
+	}
+
+	rulesAddDefault(rules);
+
+	return result;
+}
+#endif
+
+// Reads the rule file again for a reload. Unlike at startup, a rule file that can't be read,
+// is empty or has lines that are not valid is most likely still being written by an editor,
+// so it's an error and the current rules are to be kept, rather than falling back to others.
+static int reloadRules(ConnectionRules &rules)
+{
+#ifdef AMIDIAUTO_STATIC_RULES
+	if (staticRulesLoad(rules) >= 0)
+		return 0;
+#endif
+
+	struct stat st;
+	if (stat(g_rulesFile, &st) < 0)
+	{
+		int result = -errno;
+		logPrintf(LOG_LEVEL_ERROR, "Failed reading '%s', keeping the current rules! (%d)", g_rulesFile, result);
+		return result;
+	}
+
+	if (st.st_size == 0)
+	{
+		logPrintf(LOG_LEVEL_ERROR, "'%s' is empty, keeping the current rules!", g_rulesFile);
+		return -ENODATA;
+	}
+
+	int result = readRules(rules, g_rulesFile);
+	if (result < 0)
+	{
+		logPrintf(LOG_LEVEL_ERROR, "Failed reading '%s', keeping the current rules! (%d)", g_rulesFile, result);
+		return result;
+	}
+	else if (result > 0)
+	{
+		logPrintf(LOG_LEVEL_ERROR, "'%s' has %d line(s) that are not valid, keeping the current rules!", g_rulesFile, result);
+		return -EINVAL;
+	}
+
+	rulesAddDefault(rules);
+
+	return 0;
+}
+
+#ifndef AMIDIAUTO_BENCH
+int main(int argc, char **argv)
+{
+	enum
+	{
+		OPT_INPUT_POOL = 256,
+		OPT_INPUT_BUFFER,
+		OPT_STATE,
+		OPT_SCHED,
+		OPT_PRIORITY,
+		OPT_MLOCK,
+		OPT_MONITOR,
+		OPT_COMPILE,
+		OPT_GENERATE,
+		OPT_LOW_MEMORY,
+	};
+
+	static const option longOptions[] =
+	{
+		{ "coalesce",     required_argument, NULL, 'c'              },
+		{ "watch",        no_argument,       NULL, 'w'              },
+		{ "input-pool",   required_argument, NULL, OPT_INPUT_POOL   },
+		{ "input-buffer", required_argument, NULL, OPT_INPUT_BUFFER },
+		{ "socket",       required_argument, NULL, 's'              },
+		{ "state",        required_argument, NULL, OPT_STATE        },
+		{ "sched",        required_argument, NULL, OPT_SCHED        },
+		{ "priority",     required_argument, NULL, OPT_PRIORITY     },
+		{ "mlock",        no_argument,       NULL, OPT_MLOCK        },
+		{ "monitor",      no_argument,       NULL, OPT_MONITOR      },
+		{ "compile",      no_argument,       NULL, OPT_COMPILE      },
+		{ "generate",     required_argument, NULL, OPT_GENERATE     },
+		{ "low-memory",   no_argument,       NULL, OPT_LOW_MEMORY   },
+		{ "quiet",        no_argument,       NULL, 'q'              },
+		{ "version",      no_argument,       NULL, 'v'              },
+		{ "help",         no_argument,       NULL, 'h'              },
+		{ NULL,           0,                 NULL, 0                }
+	};
+
+	bool compile = false;
+	const char *generate = NULL;
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "c:ws:qvh", longOptions, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'c':
+			g_coalesceMs = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			g_watchRules = true;
+			break;
+		case OPT_INPUT_POOL:
+			g_inputPool = strtoul(optarg, NULL, 10);
+			break;
+		case OPT_INPUT_BUFFER:
+			g_inputBuffer = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			g_controlPath = optarg;
+			break;
+		case OPT_STATE:
+			g_statePath = optarg;
+			break;
+		case OPT_SCHED:
+			g_schedPolicy = realtimeParsePolicy(optarg);
+			if (g_schedPolicy < 0)
+			{
+				fprintf(stderr, "Unknown scheduling policy '%s'!\n", optarg);
+				return -EINVAL;
+			}
+			break;
+		case OPT_PRIORITY:
+			g_schedPriority = strtol(optarg, NULL, 10);
+			break;
+		case OPT_MLOCK:
+			g_lockMemory = true;
+			break;
+		case OPT_MONITOR:
+			g_monitorEnabled = true;
+			break;
+		case OPT_COMPILE:
+			compile = true;
+			break;
+		case OPT_GENERATE:
+			generate = optarg;
+			break;
+		case OPT_LOW_MEMORY:
+			g_lowMemory = true;
+			break;
+		case 'q':
+			g_logLevel = LOG_LEVEL_ERROR;
+			break;
+		case 'v':
+			printVersion();
+			return 0;
+		default:
+			printUsage();
+			return 0;
 		}
 	}
 
-	if (!g_rules.hasRules())
+	if (optind != argc)
+	{
+		printUsage();
+		return 0;
+	}
+
+	// A priority alone asks for real-time scheduling.
+	if (g_schedPriority != 0 && g_schedPolicy == SCHED_OTHER)
+		g_schedPolicy = SCHED_FIFO;
+
+	if (g_schedPolicy != SCHED_OTHER && g_schedPriority == 0)
+		g_schedPriority = sched_get_priority_min(g_schedPolicy);
+
+	if (g_schedPriority < sched_get_priority_min(g_schedPolicy) || g_schedPriority > sched_get_priority_max(g_schedPolicy))
+	{
+		fprintf(stderr, "Priority %d is out of range for %s scheduling!\n", g_schedPriority, realtimePolicyName(g_schedPolicy));
+		return -EINVAL;
+	}
+
+	if (g_lowMemory)
+		lowMemoryInit();
+
+	g_startTimeUs = getTimeUs();
+
+	logInit();
+
+	const char *cfg = getenv("AMIDIAUTO_CFG");
+	g_rulesFile = cfg ? cfg : "/etc/amidiauto.conf";
+
+	if (compile)
 	{
-		printf("Using default 'allow all' rule.\n", result);
-		g_rules.addRule(ConnectionRules::TYPE_ALLOW, "*", "*");
+		int result = compileRules(g_rulesFile);
+		logFlush();
+		return result < 0 ? 1 : 0;
 	}
 
-	result = run();
+	if (generate)
+	{
+		int result = generateRules(g_rulesFile, generate);
+		logFlush();
+		return result < 0 ? 1 : 0;
+	}
+
+	loadRules(g_rules);
+
+	int result = run();
 
 	if (result < 0)
 		fprintf(stderr, "Error %d!\n", result);
 
 	return result;
 }
+#endif // AMIDIAUTO_BENCH
+#endif // AMIDIAUTO_GENERATOR
@@ -0,0 +1,1306 @@
+/*
+ * amidiauto - ALSA MIDI autoconnect daemon.
+ * Copyright (C) 2019  Vilniaus Blokas UAB, https://blokas.io/
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+// Runs the connection logic against a simulated sequencer with synthetic
+// topologies and rule sets, and reports how long it takes. Built by 'make bench'.
+// With --soak <seconds>, keeps plugging and unplugging clients for that long
+// instead, and fails if the latency, the heap or the links drift, see soakRun().
+// Every run checks the rule patterns first, see checkPatterns(), with --check the
+// timings are taken at 100 clients only, for 'make check'.
+
+#define AMIDIAUTO_BENCH
+#define AMIDIAUTO_PROFILE
+#include "amidiauto.cpp"
+
+#if __cplusplus >= 201103L
+#define BENCH_THROW_BAD_ALLOC
+#define BENCH_NOTHROW noexcept
+#else
+#define BENCH_THROW_BAD_ALLOC throw(std::bad_alloc)
+#define BENCH_NOTHROW throw()
+#endif
+
+// Bytes held through operator new, for the soak to tell a leak from the heap settling.
+static uint64_t g_benchHeapBytes = 0;
+
+// Counted, so that the announcement handling can be checked for not allocating
+// in the steady state, a daemon running for months should not fragment its heap.
+void *operator new(size_t size) BENCH_THROW_BAD_ALLOC
+{
+	++g_stats.allocations;
+
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+
+	g_benchHeapBytes += malloc_usable_size(p);
+
+	return p;
+}
+
+void *operator new[](size_t size) BENCH_THROW_BAD_ALLOC
+{
+	return operator new(size);
+}
+
+// Not inlined, so the compiler does not take free() for a mismatch of the inlined new.
+void __attribute__((noinline)) operator delete(void *p) BENCH_NOTHROW
+{
+	// Objects made before the counting started, from static constructors, were counted too.
+	g_benchHeapBytes -= std::min<uint64_t>(g_benchHeapBytes, malloc_usable_size(p));
+	free(p);
+}
+
+void __attribute__((noinline)) operator delete[](void *p) BENCH_NOTHROW
+{
+	operator delete(p);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void *p, size_t) noexcept
+{
+	operator delete(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+	operator delete(p);
+}
+#endif
+
+// In-memory sequencer, announcements of changes are queued like the kernel would.
+class SimSeqBackend : public SeqBackend
+{
+public:
+	SimSeqBackend();
+
+	void reset();
+
+	// Changes made while announcements are off are not reported, used for the initial topology.
+	void setAnnounce(bool announce);
+
+	void addClient(int clientId, const char *name);
+	void addPort(int clientId, int port, unsigned caps, unsigned type, const char *name);
+	void removeClient(int clientId);
+
+	size_t getLinkCount() const;
+	const links_t &getLinks() const;
+
+	virtual int getClientInfo(int clientId, snd_seq_client_info_t *info);
+	virtual int getPortInfo(int clientId, int port, snd_seq_port_info_t *info);
+
+	virtual int queryNextClient(snd_seq_client_info_t *info);
+	virtual int queryNextPort(snd_seq_port_info_t *info);
+
+	virtual int querySubscriber(snd_seq_addr_t output, int index, snd_seq_addr_t *input);
+
+	virtual int subscribe(snd_seq_addr_t output, snd_seq_addr_t input);
+	virtual int unsubscribe(snd_seq_addr_t output, snd_seq_addr_t input);
+
+	virtual int eventInput(snd_seq_event_t **ev);
+	virtual int eventInputPending();
+	virtual void dropInput();
+
+private:
+	struct Port
+	{
+		std::string name;
+		unsigned caps;
+		unsigned type;
+	};
+
+	typedef std::map<int, Port> ports_t;
+
+	struct Client
+	{
+		std::string name;
+		ports_t ports;
+	};
+
+	typedef std::map<int, Client> clients_t;
+
+	void announce(int type, int clientId, int port);
+	void announceLink(int type, snd_seq_addr_t output, snd_seq_addr_t input);
+
+	const Port *findPort(snd_seq_addr_t addr) const;
+	void fillPortInfo(int clientId, int port, const Port &p, snd_seq_port_info_t *info) const;
+
+	clients_t m_clients;
+	links_t m_links;
+	bool m_announce;
+
+	// Consumed from m_eventHead on, the queue keeps its capacity so queueing
+	// announcements does not count towards the allocations being measured.
+	std::vector<snd_seq_event_t> m_events;
+	size_t m_eventHead;
+	snd_seq_event_t m_event;
+};
+
+SimSeqBackend::SimSeqBackend()
+	:m_announce(false)
+	,m_eventHead(0)
+{
+	memset(&m_event, 0, sizeof(m_event));
+}
+
+void SimSeqBackend::reset()
+{
+	m_clients.clear();
+	m_links.clear();
+	dropInput();
+	m_announce = false;
+
+	addClient(SND_SEQ_CLIENT_SYSTEM, "System");
+	addPort(SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_TIMER, SND_SEQ_PORT_CAP_READ, 0, "Timer");
+	addPort(SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_ANNOUNCE, SND_SEQ_PORT_CAP_READ, 0, "Announce");
+}
+
+void SimSeqBackend::setAnnounce(bool announce)
+{
+	m_announce = announce;
+}
+
+void SimSeqBackend::announce(int type, int clientId, int port)
+{
+	if (!m_announce)
+		return;
+
+	snd_seq_event_t ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.type = type;
+	ev.data.addr.client = clientId;
+	ev.data.addr.port = port;
+	m_events.push_back(ev);
+}
+
+void SimSeqBackend::announceLink(int type, snd_seq_addr_t output, snd_seq_addr_t input)
+{
+	if (!m_announce)
+		return;
+
+	snd_seq_event_t ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.type = type;
+	ev.data.connect.sender = output;
+	ev.data.connect.dest = input;
+	m_events.push_back(ev);
+}
+
+void SimSeqBackend::addClient(int clientId, const char *name)
+{
+	m_clients[clientId].name = name;
+	announce(SND_SEQ_EVENT_CLIENT_START, clientId, 0);
+}
+
+void SimSeqBackend::addPort(int clientId, int port, unsigned caps, unsigned type, const char *name)
+{
+	Port &p = m_clients[clientId].ports[port];
+	p.name = name;
+	p.caps = caps;
+	p.type = type;
+	announce(SND_SEQ_EVENT_PORT_START, clientId, port);
+}
+
+void SimSeqBackend::removeClient(int clientId)
+{
+	clients_t::iterator client = m_clients.find(clientId);
+	if (client == m_clients.end())
+		return;
+
+	for (ports_t::const_iterator port = client->second.ports.begin(); port != client->second.ports.end(); ++port)
+	{
+		for (links_t::iterator itr = m_links.begin(); itr != m_links.end();)
+		{
+			if ((itr->first.client == clientId && itr->first.port == port->first) || (itr->second.client == clientId && itr->second.port == port->first))
+				m_links.erase(itr++);
+			else
+				++itr;
+		}
+
+		announce(SND_SEQ_EVENT_PORT_EXIT, clientId, port->first);
+	}
+
+	m_clients.erase(client);
+	announce(SND_SEQ_EVENT_CLIENT_EXIT, clientId, 0);
+}
+
+size_t SimSeqBackend::getLinkCount() const
+{
+	return m_links.size();
+}
+
+const links_t &SimSeqBackend::getLinks() const
+{
+	return m_links;
+}
+
+const SimSeqBackend::Port *SimSeqBackend::findPort(snd_seq_addr_t addr) const
+{
+	clients_t::const_iterator client = m_clients.find(addr.client);
+	if (client == m_clients.end())
+		return NULL;
+
+	ports_t::const_iterator port = client->second.ports.find(addr.port);
+	if (port == client->second.ports.end())
+		return NULL;
+
+	return &port->second;
+}
+
+void SimSeqBackend::fillPortInfo(int clientId, int port, const Port &p, snd_seq_port_info_t *info) const
+{
+	snd_seq_port_info_set_client(info, clientId);
+	snd_seq_port_info_set_port(info, port);
+	snd_seq_port_info_set_name(info, p.name.c_str());
+	snd_seq_port_info_set_capability(info, p.caps);
+	snd_seq_port_info_set_type(info, p.type);
+}
+
+int SimSeqBackend::getClientInfo(int clientId, snd_seq_client_info_t *info)
+{
+	clients_t::const_iterator client = m_clients.find(clientId);
+	if (client == m_clients.end())
+		return -ENOENT;
+
+	snd_seq_client_info_set_client(info, clientId);
+	snd_seq_client_info_set_name(info, client->second.name.c_str());
+	return 0;
+}
+
+int SimSeqBackend::getPortInfo(int clientId, int port, snd_seq_port_info_t *info)
+{
+	snd_seq_addr_t addr;
+	addr.client = clientId;
+	addr.port = port;
+
+	const Port *p = findPort(addr);
+	if (!p)
+		return -ENOENT;
+
+	fillPortInfo(clientId, port, *p, info);
+	return 0;
+}
+
+int SimSeqBackend::queryNextClient(snd_seq_client_info_t *info)
+{
+	// Like alsa-lib, step to the next id and let the kernel find the nearest one present.
+	clients_t::const_iterator client = m_clients.lower_bound(snd_seq_client_info_get_client(info) + 1);
+	if (client == m_clients.end())
+		return -ENOENT;
+
+	snd_seq_client_info_set_client(info, client->first);
+	snd_seq_client_info_set_name(info, client->second.name.c_str());
+	return 0;
+}
+
+int SimSeqBackend::queryNextPort(snd_seq_port_info_t *info)
+{
+	clients_t::const_iterator client = m_clients.find(snd_seq_port_info_get_client(info));
+	if (client == m_clients.end())
+		return -ENOENT;
+
+	// The port number is 8 bits, so a port of -1 wraps around to the first one.
+	ports_t::const_iterator port = client->second.ports.lower_bound((snd_seq_port_info_get_port(info) + 1) & 0xff);
+	if (port == client->second.ports.end())
+		return -ENOENT;
+
+	fillPortInfo(client->first, port->first, port->second, info);
+	return 0;
+}
+
+int SimSeqBackend::querySubscriber(snd_seq_addr_t output, int index, snd_seq_addr_t *input)
+{
+	snd_seq_addr_t first;
+	first.client = 0;
+	first.port = 0;
+
+	links_t::const_iterator itr = m_links.lower_bound(std::make_pair(output, first));
+	for (int i=0; i<index && itr != m_links.end() && itr->first == output; ++i)
+		++itr;
+
+	if (itr == m_links.end() || !(itr->first == output))
+		return -ENOENT;
+
+	*input = itr->second;
+	return 0;
+}
+
+int SimSeqBackend::subscribe(snd_seq_addr_t output, snd_seq_addr_t input)
+{
+	if (!findPort(output) || !findPort(input))
+		return -ENOENT;
+
+	if (!m_links.insert(std::make_pair(output, input)).second)
+		return -EBUSY;
+
+	announceLink(SND_SEQ_EVENT_PORT_SUBSCRIBED, output, input);
+	return 0;
+}
+
+int SimSeqBackend::unsubscribe(snd_seq_addr_t output, snd_seq_addr_t input)
+{
+	if (m_links.erase(std::make_pair(output, input)) == 0)
+		return -ENOENT;
+
+	announceLink(SND_SEQ_EVENT_PORT_UNSUBSCRIBED, output, input);
+	return 0;
+}
+
+int SimSeqBackend::eventInput(snd_seq_event_t **ev)
+{
+	if (m_eventHead == m_events.size())
+		return -EAGAIN;
+
+	m_event = m_events[m_eventHead++];
+
+	int pending = m_events.size() - m_eventHead;
+	if (pending == 0)
+		dropInput();
+
+	*ev = &m_event;
+	return pending + 1;
+}
+
+int SimSeqBackend::eventInputPending()
+{
+	return m_events.size() - m_eventHead;
+}
+
+void SimSeqBackend::dropInput()
+{
+	m_events.clear();
+	m_eventHead = 0;
+}
+
+static SimSeqBackend g_sim;
+
+enum
+{
+	FIRST_CLIENT_ID  = 16,
+	CHURN_ITERATIONS = 200,
+	QUICK_CLIENTS    = 100,
+	SINK_CLIENT      = 200,
+
+	// Half of them hardware, so their links take a few batches to make.
+	PRIORITY_CLIENTS = 20,
+
+	// Passing their input on, along with a device that does not and gets plugged in and out.
+	LOOP_CLIENTS     = 10,
+	LOOP_CYCLES      = 5,
+};
+
+static const unsigned g_clientCounts[] = { 10, 100, 200 };
+static const unsigned g_ruleCounts[] = { 1, 10, 100, 1000 };
+
+static void benchReset()
+{
+	g_sim.reset();
+
+	g_pendingPorts.clear();
+	g_graphDirty = false;
+
+	g_clients.clear();
+	endpointsClear();
+	g_desiredLinks.clear();
+	graphClearActual();
+	g_refusedRoutes.clear();
+	g_refusedStale = false;
+	g_loopsUnchecked = false;
+	g_appliedLinks.clear();
+	g_clientInfo.clear();
+
+	g_stats = Stats();
+}
+
+// Half of the clients are hardware devices, the rest are applications, every one has a duplex port.
+static void benchAddClient(unsigned i, unsigned clientCount)
+{
+	char name[64];
+	bool hardware = i < clientCount / 2;
+
+	snprintf(name, sizeof(name), hardware ? "Device %u" : "App %u", i);
+
+	int clientId = FIRST_CLIENT_ID + i;
+	g_sim.addClient(clientId, name);
+	g_sim.addPort(clientId, 0,
+		SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ | SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+		SND_SEQ_PORT_TYPE_MIDI_GENERIC | (hardware ? SND_SEQ_PORT_TYPE_HARDWARE : SND_SEQ_PORT_TYPE_APPLICATION),
+		name
+		);
+}
+
+// A catch all rule followed by a mix of specific and wildcard allow and disallow rules.
+// With thru, every client passes its input on, so each link made gets checked for closing a loop.
+// With ports, the specific rules name the ports too, so every port gets a match of its own.
+static void benchMakeRules(ConnectionRules &rules, unsigned ruleCount, unsigned clientCount, bool thru, bool ports)
+{
+	if (thru)
+		rules.addThru("*");
+
+	rules.addRule(ConnectionRules::TYPE_ALLOW, "*", "*");
+
+	for (unsigned i=1; i<ruleCount; ++i)
+	{
+		char a[64];
+		char b[64];
+
+		unsigned x = (i * 7) % clientCount;
+		unsigned y = (i * 13) % clientCount;
+
+		switch (i % 4)
+		{
+		case 0:
+			snprintf(a, sizeof(a), ports ? "Device %u:@0" : "Device %u", x);
+			snprintf(b, sizeof(b), ports ? "App %u:^App" : "App %u", y);
+			rules.addRule(ConnectionRules::TYPE_DISALLOW, a, b);
+			break;
+		case 1:
+			snprintf(a, sizeof(a), ports ? "App %u:@0" : "App %u", x);
+			snprintf(b, sizeof(b), ports ? "Device %u:^Device" : "Device %u", y);
+			rules.addRule(ConnectionRules::TYPE_ALLOW, a, b);
+			break;
+		case 2:
+			snprintf(a, sizeof(a), "Device %u", x);
+			rules.addRule(ConnectionRules::TYPE_DISALLOW, a, "*");
+			break;
+		default:
+			snprintf(b, sizeof(b), "App %u", y);
+			rules.addRule(ConnectionRules::TYPE_ALLOW, "*", b);
+			break;
+		}
+	}
+
+	rules.compile();
+}
+
+// Makes the rest of the queued links, which the daemon does a batch per loop iteration,
+// see graphDrain(). Counted as part of handling the announcements that queued them.
+static void benchDrain()
+{
+	uint64_t allocations = g_stats.allocations;
+
+	while (graphDrainGetTimeout() == 0)
+		graphDrain();
+
+	g_stats.eventAllocations += g_stats.allocations - allocations;
+}
+
+static void benchHandleEvents()
+{
+	handleSeqEvent();
+	benchDrain();
+}
+
+static uint64_t percentile(std::vector<uint64_t> &samples, unsigned p)
+{
+	if (samples.empty())
+		return 0;
+
+	std::sort(samples.begin(), samples.end());
+	return samples[(samples.size() - 1) * p / 100];
+}
+
+static void benchCycle(unsigned n, unsigned clientCount, std::vector<uint64_t> *latencies)
+{
+	g_sim.removeClient(FIRST_CLIENT_ID + n);
+	uint64_t start = getTimeUs();
+	benchHandleEvents();
+	if (latencies)
+		latencies->push_back(getTimeUs() - start);
+
+	benchAddClient(n, clientCount);
+	start = getTimeUs();
+	benchHandleEvents();
+	if (latencies)
+		latencies->push_back(getTimeUs() - start);
+}
+
+// Returns the number of allocations made while handling the churn, which should be none.
+static uint64_t benchRun(unsigned clientCount, unsigned ruleCount, bool thru, bool ports)
+{
+	benchReset();
+
+	ConnectionRules rules;
+	benchMakeRules(rules, ruleCount, clientCount, thru, ports);
+	g_rules = rules;
+
+	for (unsigned i=0; i<clientCount; ++i)
+		benchAddClient(i, clientCount);
+
+	g_sim.setAnnounce(true);
+
+	uint64_t start = getTimeUs();
+	portsInit();
+	benchDrain();
+	uint64_t startupUs = getTimeUs() - start;
+
+	size_t links = g_sim.getLinkCount();
+	uint64_t startupCalls = g_stats.syscalls;
+
+	// Only the subscription announcements of our own calls are queued by now.
+	if (g_sim.eventInputPending() > 0)
+		benchHandleEvents();
+
+	// Unplug and replug the hardware devices one at a time, after one cycle
+	// for the containers to grow to their steady state sizes.
+	std::vector<uint64_t> latencies;
+	latencies.reserve(CHURN_ITERATIONS * 2);
+
+	unsigned hardwareCount = clientCount / 2 > 0 ? clientCount / 2 : 1;
+	benchCycle(0, clientCount, NULL);
+
+	uint64_t calls = g_stats.syscalls;
+	uint64_t announcements = g_stats.announcements;
+	uint64_t allocations = g_stats.eventAllocations;
+
+	for (unsigned i=0; i<CHURN_ITERATIONS; ++i)
+		benchCycle((i * 7) % hardwareCount, clientCount, &latencies);
+
+	calls = g_stats.syscalls - calls;
+	announcements = g_stats.announcements - announcements;
+	allocations = g_stats.eventAllocations - allocations;
+
+	printf("%7u %5u %10.2f %6u %8llu %8llu %8llu %8llu %9.2f %9llu %8llu %7llu\n",
+		clientCount,
+		ruleCount,
+		startupUs / 1000.0,
+		(unsigned)links,
+		(unsigned long long)startupCalls,
+		(unsigned long long)percentile(latencies, 50),
+		(unsigned long long)percentile(latencies, 99),
+		(unsigned long long)percentile(latencies, 100),
+		announcements ? (double)calls / announcements : 0.0,
+		(unsigned long long)(g_stats.ruleChecks ? g_stats.ruleCheckNs / g_stats.ruleChecks : 0),
+		(unsigned long long)(g_stats.loopChecks ? g_stats.loopCheckNs / g_stats.loopChecks : 0),
+		(unsigned long long)allocations
+		);
+	fflush(stdout);
+
+	logFlush();
+
+	return allocations;
+}
+
+enum
+{
+	SOAK_CLIENTS        = 100,
+	SOAK_RULES          = 100,
+	SOAK_MAX_BURST      = 4,
+	SOAK_ROUND_US       = 10000000,
+	SOAK_MAX_SAMPLES    = 200000,
+
+	// A round fails if its p99 grows past both of these over the first round's.
+	SOAK_LATENCY_FACTOR = 3,
+	SOAK_LATENCY_US     = 1000,
+};
+
+static uint32_t g_soakRandom = 1;
+
+// Deterministic, so a failing run can be repeated.
+static unsigned soakRandom(unsigned n)
+{
+	g_soakRandom = g_soakRandom * 1103515245u + 12345u;
+	return (g_soakRandom >> 16) % n;
+}
+
+// Unplugs a few random clients at once, then plugs them back in together, the
+// way a powered hub going away and coming back does.
+static void soakCycle(std::vector<uint64_t> &latencies)
+{
+	unsigned burst = 1 + soakRandom(SOAK_MAX_BURST);
+	unsigned clients[SOAK_MAX_BURST];
+
+	for (unsigned i=0; i<burst; ++i)
+	{
+		clients[i] = soakRandom(SOAK_CLIENTS);
+		if (std::find(clients, clients + i, clients[i]) != clients + i)
+		{
+			--i;
+			continue;
+		}
+
+		g_sim.removeClient(FIRST_CLIENT_ID + clients[i]);
+	}
+
+	uint64_t start = getTimeUs();
+	benchHandleEvents();
+	latencies.push_back(getTimeUs() - start);
+
+	for (unsigned i=0; i<burst; ++i)
+		benchAddClient(clients[i], SOAK_CLIENTS);
+
+	start = getTimeUs();
+	benchHandleEvents();
+	latencies.push_back(getTimeUs() - start);
+}
+
+// Once every client is back, the links must be those the startup enumeration made, and
+// what the daemon believes is connected must be what the sequencer has.
+static const char *soakCheckLinks(const links_t &expected)
+{
+	if (!(g_sim.getLinks() == expected))
+		return "links differ from the startup ones";
+	if (!(g_actualLinks == expected))
+		return "actual links differ from the sequencer";
+	if (!(g_appliedLinks == expected))
+		return "applied links differ from the sequencer";
+	if (g_desiredLinks.size() != expected.size())
+		return "desired links differ from the sequencer";
+
+	return NULL;
+}
+
+// Returns 0 if every round passed, 1 otherwise. The first round is the baseline,
+// the heap must not grow past what it held at its end.
+static int soakRun(unsigned seconds)
+{
+	benchReset();
+
+	ConnectionRules rules;
+	benchMakeRules(rules, SOAK_RULES, SOAK_CLIENTS, false, true);
+	g_rules = rules;
+
+	for (unsigned i=0; i<SOAK_CLIENTS; ++i)
+		benchAddClient(i, SOAK_CLIENTS);
+
+	g_sim.setAnnounce(true);
+	portsInit();
+	benchDrain();
+	if (g_sim.eventInputPending() > 0)
+		benchHandleEvents();
+
+	links_t expected = g_sim.getLinks();
+
+	uint64_t durationUs = (uint64_t)seconds * 1000000u;
+	uint64_t roundUs = std::min<uint64_t>(SOAK_ROUND_US, std::max<uint64_t>(durationUs / 2, 1));
+
+	std::vector<uint64_t> latencies;
+	latencies.reserve(SOAK_MAX_SAMPLES);
+
+	printf("Soaking %u clients under %u rules for %u s, %u links.\n", SOAK_CLIENTS, SOAK_RULES, seconds, (unsigned)expected.size());
+	printf("%7s %9s %8s %8s %8s %9s %9s %7s %7s  %s\n", "time s", "cycles", "p50 us", "p99 us", "max us", "heap kB", "rss kB", "links", "allocs", "status");
+
+	uint64_t start = getTimeUs();
+	uint64_t cycles = 0;
+	uint64_t baselineP99 = 0;
+	uint64_t baselineHeap = 0;
+	unsigned failures = 0;
+
+	for (unsigned round=0; getTimeUs() - start < durationUs; ++round)
+	{
+		uint64_t roundEnd = std::min(getTimeUs() + roundUs, start + durationUs);
+		uint64_t allocations = g_stats.eventAllocations;
+
+		latencies.clear();
+		while (getTimeUs() < roundEnd && latencies.size() + 2 <= latencies.capacity())
+		{
+			soakCycle(latencies);
+			++cycles;
+		}
+
+		allocations = g_stats.eventAllocations - allocations;
+
+		uint64_t p50 = percentile(latencies, 50);
+		uint64_t p99 = percentile(latencies, 99);
+		uint64_t max = percentile(latencies, 100);
+
+		const char *status = soakCheckLinks(expected);
+		if (round == 0)
+		{
+			baselineP99 = p99;
+			baselineHeap = g_benchHeapBytes;
+		}
+		else if (!status)
+		{
+			if (allocations != 0)
+				status = "allocated while handling announcements";
+			else if (g_benchHeapBytes > baselineHeap)
+				status = "heap grew";
+			else if (p99 > baselineP99 * SOAK_LATENCY_FACTOR && p99 > baselineP99 + SOAK_LATENCY_US)
+				status = "p99 latency grew";
+		}
+
+		if (status)
+			++failures;
+
+		printf("%7.1f %9llu %8llu %8llu %8llu %9.1f %9d %7u %7llu  %s\n",
+			(getTimeUs() - start) / 1000000.0,
+			(unsigned long long)cycles,
+			(unsigned long long)p50,
+			(unsigned long long)p99,
+			(unsigned long long)max,
+			g_benchHeapBytes / 1024.0,
+			procGetStatusKb("VmRSS"),
+			(unsigned)g_sim.getLinkCount(),
+			(unsigned long long)allocations,
+			status ? status : "ok"
+			);
+		fflush(stdout);
+
+		logFlush();
+	}
+
+	if (failures != 0)
+	{
+		fprintf(stderr, "%u soak rounds failed!\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
+
+// The output side of an allow rule to "Sink", and a client, or a port if port is not -1, it should match.
+struct PatternCase
+{
+	const char *side;
+	int client;
+	const char *clientName;
+	int port;
+	const char *portName;
+	bool matches;
+};
+
+static const PatternCase g_patternCases[] =
+{
+	{ "sound",            20, "Pisound MIDI", -1, NULL,         true  },
+	{ "sound",            20, "Launchpad",    -1, NULL,         false },
+	{ "^Pisound",         20, "Pisound MIDI", -1, NULL,         true  },
+	{ "^Pisound",         20, "My Pisound",   -1, NULL,         false },
+	{ "MIDI$",            20, "Pisound MIDI", -1, NULL,         true  },
+	{ "MIDI$",            20, "MIDI Out",     -1, NULL,         false },
+	{ "^Pisound$",        20, "Pisound",      -1, NULL,         true  },
+	{ "^Pisound$",        20, "Pisound 2",    -1, NULL,         false },
+	{ "/^Pi.*d$/",        20, "Pisound",      -1, NULL,         true  },
+	{ "/^Pi.*d$/",        20, "Pisounds",     -1, NULL,         false },
+	{ "@20",              20, "Anything",     -1, NULL,         true  },
+	{ "@20",              21, "Anything",     -1, NULL,         false },
+	{ "Pisound:@1",       20, "Pisound",       1, "MIDI 2",     true  },
+	{ "Pisound:@1",       20, "Pisound",       0, "MIDI 1",     false },
+	{ "Pisound:MIDI 2",   20, "Pisound",       1, "MIDI 2",     true  },
+	{ "Pisound:MIDI 2",   20, "Pisound",       0, "MIDI 1",     false },
+	{ "Pisound:^MIDI",    20, "Pisound",       0, "MIDI 1",     true  },
+	{ "Pisound:^MIDI",    20, "Pisound",       0, "Out MIDI",   false },
+	{ "Pisound:/[0-9]$/", 20, "Pisound",       0, "MIDI 1",     true  },
+	{ "Pisound:/[0-9]$/", 20, "Pisound",       0, "MIDI",       false },
+	{ "/a:b/:out",        20, "a:b c",         0, "out 1",      true  },
+	{ "/a:b/:out",        20, "a:c",           0, "out 1",      false },
+	{ "/a:b/:out",        20, "a:b c",         0, "in 1",       false },
+	{ "*:Synth",          30, "Anything",      0, "Synth in",   true  },
+	{ "*:Synth",          30, "Anything",      0, "MIDI in",    false },
+	{ "Pisound:*",        20, "Pisound",       3, "Anything",   true  },
+};
+
+// Sides that are not valid, addRule() must refuse them.
+static const char *const g_invalidSides[] =
+{
+	"Pisound*", "/[/", "Foo:", "*:*", "^", "$", "^$", "",
+};
+
+// Client patterns the sections must refuse.
+static const char *const g_invalidClients[] =
+{
+	"Pisound*", "/[/", "^", "$", "^$", "", "*:*",
+};
+
+// Lines of the [thru] section that are valid text patterns, but rules or settings.
+static const char *const g_invalidThruLines[] =
+{
+	"Foo -> Bar", "Foo <- Bar", "Foo <-> Bar", "Synth = 5", "Pisound = all",
+};
+
+// The strength an allow rule gets graded at, graded on the client patterns only.
+struct StrengthCase
+{
+	const char *output;
+	const char *input;
+	ConnectionRules::Strength strength;
+};
+
+static const StrengthCase g_strengthCases[] =
+{
+	{ "*",             "*",          ConnectionRules::STRENGTH_VERY_VAGUE },
+	{ "*",             "Sink",       ConnectionRules::STRENGTH_VAGUE      },
+	{ "*:Synth",       "Sink",       ConnectionRules::STRENGTH_VAGUE      },
+	{ "*:Synth",       "*:In",       ConnectionRules::STRENGTH_VERY_VAGUE },
+	{ "Pisound:MIDI",  "Sink",       ConnectionRules::STRENGTH_SPECIFIC   },
+	{ "Pisound:*",     "Sink",       ConnectionRules::STRENGTH_SPECIFIC   },
+};
+
+// Copies the rules through a compiled image, so the tables used in place get checked too.
+static bool checkThroughImage(const ConnectionRules &rules, std::vector<char> &image, ConnectionRules &loaded)
+{
+	ImageWriter writer;
+	rules.writeImage(writer);
+	image = writer.getData();
+
+	ImageReader reader(&image[0], image.size());
+	return loaded.readImage(reader);
+}
+
+// The priority of the case's client, the sections match their client patterns like the rules.
+static bool checkSectionCase(const ConnectionRules &rules, const PatternCase &c)
+{
+	ConnectionRules::SectionMatch sections;
+	rules.matchSections(c.client, c.clientName, sections);
+
+	return sections.priority == (c.matches ? 7 : 0) && sections.thru == c.matches;
+}
+
+static bool checkPatternCase(const ConnectionRules &rules, const PatternCase &c)
+{
+	ConnectionRules::Match output, port, input;
+	rules.match(c.client, c.clientName, output);
+	rules.match(SINK_CLIENT, "Sink", input);
+
+	if (c.port >= 0)
+	{
+		rules.matchPort(output, c.port, c.portName, port);
+		return rules.isConnectionAllowed(port, input, ConnectionRules::STRENGTH_VERY_VAGUE) == c.matches;
+	}
+
+	return rules.isConnectionAllowed(output, input, ConnectionRules::STRENGTH_VERY_VAGUE) == c.matches;
+}
+
+// Checks parsing and matching each form of pattern, returns the number of cases that failed.
+static unsigned checkPatterns()
+{
+	unsigned failures = 0;
+
+	for (size_t i=0; i<sizeof(g_patternCases)/sizeof(g_patternCases[0]); ++i)
+	{
+		const PatternCase &c = g_patternCases[i];
+
+		ConnectionRules rules;
+		if (!rules.addRule(ConnectionRules::TYPE_ALLOW, c.side, "Sink"))
+		{
+			fprintf(stderr, "'%s' was refused!\n", c.side);
+			++failures;
+			continue;
+		}
+		rules.compile();
+
+		std::vector<char> image;
+		ConnectionRules loaded;
+		bool ok = checkPatternCase(rules, c) && checkThroughImage(rules, image, loaded) && checkPatternCase(loaded, c);
+		if (!ok)
+		{
+			fprintf(stderr, "'%s' should %smatch %d '%s' port %d '%s'!\n", c.side, c.matches ? "" : "not ", c.client, c.clientName, c.port, c.portName ? c.portName : "");
+			++failures;
+		}
+
+		if (c.port >= 0)
+			continue;
+
+		// A later line of the same pattern does not apply.
+		ConnectionRules sections;
+		sections.addPriority(c.side, 7);
+		sections.addPriority(c.side, 3);
+		sections.addThru(c.side);
+		sections.compile();
+
+		ok = checkSectionCase(sections, c) && checkThroughImage(sections, image, loaded) && checkSectionCase(loaded, c);
+		if (!ok)
+		{
+			fprintf(stderr, "'%s' in [priority] and [thru] should %smatch %d '%s'!\n", c.side, c.matches ? "" : "not ", c.client, c.clientName);
+			++failures;
+		}
+	}
+
+	for (size_t i=0; i<sizeof(g_invalidSides)/sizeof(g_invalidSides[0]); ++i)
+	{
+		ConnectionRules rules;
+		if (rules.addRule(ConnectionRules::TYPE_ALLOW, g_invalidSides[i], "Sink") || rules.addRule(ConnectionRules::TYPE_ALLOW, "Sink", g_invalidSides[i]))
+		{
+			fprintf(stderr, "'%s' should be refused!\n", g_invalidSides[i]);
+			++failures;
+		}
+	}
+
+	for (size_t i=0; i<sizeof(g_invalidClients)/sizeof(g_invalidClients[0]); ++i)
+	{
+		ConnectionRules rules;
+		if (rules.addPriority(g_invalidClients[i], 1) || rules.addThru(g_invalidClients[i]))
+		{
+			fprintf(stderr, "'%s' should be refused in [priority] and [thru]!\n", g_invalidClients[i]);
+			++failures;
+		}
+	}
+
+	for (size_t i=0; i<sizeof(g_invalidThruLines)/sizeof(g_invalidThruLines[0]); ++i)
+	{
+		ConnectionRules rules;
+		char line[64];
+		snprintf(line, sizeof(line), "%s", g_invalidThruLines[i]);
+		if (parseThru(rules, line))
+		{
+			fprintf(stderr, "'%s' should be ignored in [thru]!\n", g_invalidThruLines[i]);
+			++failures;
+		}
+	}
+
+	for (size_t i=0; i<sizeof(g_strengthCases)/sizeof(g_strengthCases[0]); ++i)
+	{
+		const StrengthCase &c = g_strengthCases[i];
+
+		ConnectionRules rules;
+		rules.addRule(ConnectionRules::TYPE_ALLOW, c.output, c.input);
+		rules.compile();
+
+		// Names every pattern of the cases matches, the ports included.
+		ConnectionRules::Match output, outputPort, input, inputPort;
+		rules.match(20, "Pisound", output);
+		rules.matchPort(output, 0, "MIDI Synth", outputPort);
+		rules.match(SINK_CLIENT, "Sink", input);
+		rules.matchPort(input, 0, "In", inputPort);
+
+		ConnectionRules::Verdict verdict;
+		rules.explain(outputPort, inputPort, ConnectionRules::STRENGTH_VERY_VAGUE, verdict);
+		if (verdict.allowStrength != c.strength)
+		{
+			fprintf(stderr, "'%s' -> '%s' should be of strength %d, not %d!\n", c.output, c.input, c.strength, verdict.allowStrength);
+			++failures;
+		}
+	}
+
+	printf("Checked %u pattern, %u refused side, %u refused client, %u ignored thru line and %u strength cases, %u failed.\n",
+		(unsigned)(sizeof(g_patternCases)/sizeof(g_patternCases[0])),
+		(unsigned)(sizeof(g_invalidSides)/sizeof(g_invalidSides[0])),
+		(unsigned)(sizeof(g_invalidClients)/sizeof(g_invalidClients[0])),
+		(unsigned)(sizeof(g_invalidThruLines)/sizeof(g_invalidThruLines[0])),
+		(unsigned)(sizeof(g_strengthCases)/sizeof(g_strengthCases[0])),
+		failures
+		);
+
+	return failures;
+}
+
+static unsigned benchCountLinks(int clientId)
+{
+	unsigned count = 0;
+	for (links_t::const_iterator itr = g_appliedLinks.begin(); itr != g_appliedLinks.end(); ++itr)
+	{
+		if (itr->first.client == clientId || itr->second.client == clientId)
+			++count;
+	}
+	return count;
+}
+
+// A client of a higher priority appearing while the links found at startup are still being
+// made gets its links made by the next batch, ahead of the rest. Returns 1 if it does not.
+static unsigned checkPriorityDrain()
+{
+	benchReset();
+
+	ConnectionRules rules;
+	rules.addRule(ConnectionRules::TYPE_ALLOW, "*", "*");
+	rules.addPriority("Urgent", 10);
+	rules.compile();
+	g_rules = rules;
+
+	for (unsigned i=0; i<PRIORITY_CLIENTS; ++i)
+		benchAddClient(i, PRIORITY_CLIENTS);
+
+	g_sim.setAnnounce(true);
+	portsInit();
+
+	const char *failure = NULL;
+
+	if (graphDrainGetTimeout() != 0)
+		failure = "the startup links were made at once";
+
+	int urgent = FIRST_CLIENT_ID + PRIORITY_CLIENTS;
+	g_sim.addClient(urgent, "Urgent");
+	g_sim.addPort(urgent, 0,
+		SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ | SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+		SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_HARDWARE,
+		"Urgent"
+		);
+	handleSeqEvent();
+
+	// Linked both ways to each of the applications.
+	unsigned expected = PRIORITY_CLIENTS;
+	if (!failure && benchCountLinks(urgent) != expected)
+		failure = "the links of the client of a higher priority were not made first";
+	if (!failure && graphDrainGetTimeout() != 0)
+		failure = "the startup links were made along";
+
+	benchDrain();
+
+	if (!failure && g_appliedLinks.size() != g_sim.getLinkCount())
+		failure = "not every link was made";
+
+	logFlush();
+
+	if (failure)
+	{
+		fprintf(stderr, "Draining the link queue failed, %s!\n", failure);
+		return 1;
+	}
+
+	printf("Checked the links of a client of a higher priority appearing meanwhile get made first.\n");
+	return 0;
+}
+
+static void benchMakeLoopRules(ConnectionRules &rules, bool appsThru)
+{
+	rules.addThru("Device");
+	if (appsThru)
+		rules.addThru("App");
+	rules.addRule(ConnectionRules::TYPE_ALLOW, "*", "*");
+	rules.compile();
+}
+
+// Links refused for closing a loop get refused once, not again on every hot-plug of
+// clients that take no part in the loop. Returns 1 if they do.
+static unsigned checkLoopRefusals()
+{
+	benchReset();
+
+	ConnectionRules rules;
+	benchMakeLoopRules(rules, true);
+	g_rules = rules;
+
+	for (unsigned i=0; i<LOOP_CLIENTS; ++i)
+		benchAddClient(i, LOOP_CLIENTS);
+
+	g_sim.setAnnounce(true);
+	portsInit();
+	benchDrain();
+
+	if (g_sim.eventInputPending() > 0)
+		benchHandleEvents();
+
+	unsigned refused = g_stats.loopsRefused;
+	size_t links = g_sim.getLinkCount();
+
+	const char *failure = NULL;
+
+	if (refused == 0)
+		failure = "no link was refused";
+
+	int keys = FIRST_CLIENT_ID + LOOP_CLIENTS;
+
+	for (unsigned i=0; i<LOOP_CYCLES && !failure; ++i)
+	{
+		g_sim.addClient(keys, "Keys");
+		g_sim.addPort(keys, 0,
+			SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+			SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_HARDWARE,
+			"Keys"
+			);
+		benchHandleEvents();
+
+		g_sim.removeClient(keys);
+		benchHandleEvents();
+
+		if (g_stats.loopsRefused != refused)
+			failure = "the same links were refused again";
+		else if (g_sim.getLinkCount() != links)
+			failure = "the links changed";
+	}
+
+	logFlush();
+
+	if (failure)
+	{
+		fprintf(stderr, "Refusing links closing a loop failed, %s!\n", failure);
+		return 1;
+	}
+
+	printf("Checked %u links closing a loop are refused once over %u hot-plugs.\n", refused, LOOP_CYCLES);
+	return 0;
+}
+
+// Once more clients pass their input on, the links made before that close a loop get
+// disconnected, as rulesReload() does, and refused from then on. Returns 1 if they are not.
+static unsigned checkLoopBreaking()
+{
+	benchReset();
+
+	ConnectionRules rules;
+	benchMakeLoopRules(rules, false);
+	g_rules = rules;
+
+	for (unsigned i=0; i<LOOP_CLIENTS; ++i)
+		benchAddClient(i, LOOP_CLIENTS);
+
+	g_sim.setAnnounce(true);
+	portsInit();
+	benchDrain();
+	benchHandleEvents();
+
+	size_t links = g_sim.getLinkCount();
+
+	const char *failure = NULL;
+
+	if (g_stats.loopsRefused != 0)
+		failure = "links were refused before";
+
+	ConnectionRules thru;
+	benchMakeLoopRules(thru, true);
+	g_rules = thru;
+
+	g_refusedStale = true;
+	g_loopsUnchecked = true;
+	graphReconcile();
+	benchHandleEvents();
+
+	unsigned refused = g_stats.loopsRefused;
+
+	if (!failure && refused == 0)
+		failure = "no link was disconnected";
+	if (!failure && g_sim.getLinkCount() != links - refused)
+		failure = "the links disconnected were not the ones refused";
+
+	for (links_t::const_iterator itr = g_appliedLinks.begin(); itr != g_appliedLinks.end() && !failure; ++itr)
+	{
+		if (graphWouldLoop(itr->first.client, itr->second.client))
+			failure = "a link closing a loop was left";
+	}
+
+	graphReconcile();
+	benchHandleEvents();
+
+	if (!failure && (g_stats.loopsRefused != refused || g_sim.getLinkCount() != links - refused))
+		failure = "the links disconnected were made again";
+
+	logFlush();
+
+	if (failure)
+	{
+		fprintf(stderr, "Breaking loops failed, %s!\n", failure);
+		return 1;
+	}
+
+	printf("Checked %u links closing a loop are disconnected once more clients pass their input on.\n", refused);
+	return 0;
+}
+
+// Saved links restored before the routes are known get checked by the first pass of the
+// loop, which disconnects one of a pair closing a loop. Returns 1 if it does not.
+static unsigned checkRestoreLoops()
+{
+	benchReset();
+
+	ConnectionRules rules;
+	benchMakeLoopRules(rules, true);
+	g_rules = rules;
+
+	for (unsigned i=0; i<LOOP_CLIENTS; ++i)
+		benchAddClient(i, LOOP_CLIENTS);
+
+	SavedLink link;
+	link.outputClient = link.outputPort = "Device 0";
+	link.inputClient = link.inputPort = "App 5";
+	g_restoreLinks.push_back(link);
+	std::swap(link.outputClient, link.inputClient);
+	std::swap(link.outputPort, link.inputPort);
+	g_restoreLinks.push_back(link);
+
+	g_sim.setAnnounce(true);
+	stateRestoreEarly();
+
+	const char *failure = NULL;
+
+	if (g_appliedLinks.size() != 2)
+		failure = "the saved links were not restored";
+
+	portsScan();
+	stateRestore();
+	g_graphDirty = true;
+	pendingFlush();
+	benchHandleEvents();
+
+	if (!failure && g_stats.loopsRefused == 0)
+		failure = "no link was disconnected";
+
+	for (links_t::const_iterator itr = g_appliedLinks.begin(); itr != g_appliedLinks.end() && !failure; ++itr)
+	{
+		if (graphWouldLoop(itr->first.client, itr->second.client))
+			failure = "a link closing a loop was left";
+	}
+
+	g_restoreLinks.clear();
+	logFlush();
+
+	if (failure)
+	{
+		fprintf(stderr, "Restoring links closing a loop failed, %s!\n", failure);
+		return 1;
+	}
+
+	printf("Checked restored links closing a loop get disconnected.\n");
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	// Only errors are of interest, logging every connection would skew the timings.
+	g_logLevel = LOG_LEVEL_ERROR;
+
+	g_backend = &g_sim;
+
+	if (argc == 3 && strcmp(argv[1], "--soak") == 0)
+		return soakRun(strtoul(argv[2], NULL, 10));
+
+	// A pass of each kind at 100 clients only, for 'make check'.
+	bool quick = argc == 2 && strcmp(argv[1], "--check") == 0;
+
+	if (checkPatterns() != 0 || checkPriorityDrain() != 0 || checkLoopRefusals() != 0 || checkLoopBreaking() != 0 || checkRestoreLoops() != 0)
+		return 1;
+
+	printf("Event latencies are in us over %u unplug and replug cycles of a hardware client.\n", CHURN_ITERATIONS);
+	printf("%7s %5s %10s %6s %8s %8s %8s %8s %9s %9s %8s %7s\n", "clients", "rules", "startup ms", "links", "calls", "p50 us", "p99 us", "max us", "calls/ev", "ns/check", "ns/loop", "allocs");
+
+	uint64_t allocations = 0;
+
+	for (size_t c=0; c<sizeof(g_clientCounts)/sizeof(g_clientCounts[0]); ++c)
+	{
+		if (quick && g_clientCounts[c] != QUICK_CLIENTS)
+			continue;
+
+		for (size_t r=0; r<sizeof(g_ruleCounts)/sizeof(g_ruleCounts[0]); ++r)
+			allocations += benchRun(g_clientCounts[c], g_ruleCounts[r], false, false);
+	}
+
+	printf("With every client passing its input through, links closing a loop are refused:\n");
+
+	for (size_t c=0; c<sizeof(g_clientCounts)/sizeof(g_clientCounts[0]); ++c)
+	{
+		if (!quick || g_clientCounts[c] == QUICK_CLIENTS)
+			allocations += benchRun(g_clientCounts[c], 1, true, false);
+	}
+
+	printf("With the specific rules naming ports as well:\n");
+
+	for (size_t c=0; c<sizeof(g_clientCounts)/sizeof(g_clientCounts[0]); ++c)
+	{
+		if (!quick || g_clientCounts[c] == QUICK_CLIENTS)
+			allocations += benchRun(g_clientCounts[c], 1000, false, true);
+	}
+
+	// Handling announcements must not allocate once warmed up.
+	if (allocations != 0)
+	{
+		fprintf(stderr, "%llu allocations were made while handling announcements!\n", (unsigned long long)allocations);
+		return 1;
+	}
+
+	return 0;
+}